@@ -0,0 +1,181 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "archive_index.h"
+
+#define INDEX_MAGIC "MTARIDX1"
+#define MAX_PATH_LEN 4096
+
+// Start of every index file, ties the index to one state of its archive
+typedef struct {
+    char magic[8];
+    int64_t archive_size;
+    int64_t archive_mtime_sec;
+    int64_t archive_mtime_nsec;
+    int64_t count;
+} index_file_header_t;
+
+void index_init(archive_index_t *index) {
+    index->records = NULL;
+    index->count = 0;
+    index->capacity = 0;
+}
+
+void index_clear(archive_index_t *index) {
+    free(index->records);
+    index_init(index);
+}
+
+int index_add(archive_index_t *index, const char *name, off_t header_offset, off_t size, time_t mtime) {
+    if (index->count == index->capacity) {  // grow the array geometrically
+        int capacity = index->capacity == 0 ? 64 : index->capacity * 2;
+        index_record_t *grown = realloc(index->records, capacity * sizeof(index_record_t));
+        if (grown == NULL) {
+            return -1;
+        }
+        index->records = grown;
+        index->capacity = capacity;
+    }
+    index_record_t *record = &index->records[index->count++];
+    record->header_offset = header_offset;
+    record->size = size;
+    record->mtime = mtime;
+    record->version = 1;
+    strncpy(record->name, name, sizeof(record->name));
+    return 0;
+}
+
+int index_has_long_names(const archive_index_t *index) {
+    for (int i = 0; i < index->count; i++) {
+        if (memchr(index->records[i].name, '\0', sizeof(index->records[i].name)) == NULL) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * qsort comparison grouping records by name, in archive order within each name
+ */
+static int compare_records(const void *a, const void *b) {
+    const index_record_t *r1 = *(index_record_t *const *)a;
+    const index_record_t *r2 = *(index_record_t *const *)b;
+    int cmp = strncmp(r1->name, r2->name, sizeof(r1->name));
+    if (cmp != 0) {
+        return cmp;
+    }
+    return (r1->header_offset > r2->header_offset) - (r1->header_offset < r2->header_offset);
+}
+
+int index_number_versions(archive_index_t *index) {
+    index_record_t **sorted = malloc((index->count > 0 ? index->count : 1) * sizeof(index_record_t *));
+    if (sorted == NULL) {
+        return -1;
+    }
+    for (int i = 0; i < index->count; i++) {
+        sorted[i] = &index->records[i];
+    }
+    qsort(sorted, index->count, sizeof(index_record_t *), compare_records);
+    for (int i = 0; i < index->count; i++) {
+        if (i > 0 && strncmp(sorted[i]->name, sorted[i - 1]->name, sizeof(sorted[i]->name)) == 0) {
+            sorted[i]->version = sorted[i - 1]->version + 1;
+        } else {
+            sorted[i]->version = 1;
+        }
+    }
+    free(sorted);
+    return 0;
+}
+
+/*
+ * Builds the index file name for 'archive_name' in 'path'
+ * Returns 0 on success or -1 if the name doesn't fit
+ */
+static int index_path(const char *archive_name, char *path, size_t len) {
+    int n = snprintf(path, len, "%s%s", archive_name, INDEX_SUFFIX);
+    return (n < 0 || (size_t)n >= len) ? -1 : 0;
+}
+
+int index_exists(const char *archive_name) {
+    char path[MAX_PATH_LEN];
+    if (index_path(archive_name, path, sizeof(path)) != 0) {
+        return 0;
+    }
+    return access(path, F_OK) == 0;
+}
+
+int index_load(const char *archive_name, archive_index_t *index) {
+    char path[MAX_PATH_LEN];
+    index_file_header_t file_header;
+    struct stat stat_buf;
+    index_init(index);
+    if (index_path(archive_name, path, sizeof(path)) != 0 || stat(archive_name, &stat_buf) != 0) {
+        return -1;
+    }
+    FILE *index_ptr = fopen(path, "r");
+    if (index_ptr == NULL) {  // no index, callers fall back to scanning the archive
+        return -1;
+    }
+    if (fread(&file_header, sizeof(file_header), 1, index_ptr) != 1 ||
+        memcmp(file_header.magic, INDEX_MAGIC, sizeof(file_header.magic)) != 0 ||
+        file_header.archive_size != stat_buf.st_size ||
+        file_header.archive_mtime_sec != stat_buf.st_mtim.tv_sec ||
+        file_header.archive_mtime_nsec != stat_buf.st_mtim.tv_nsec ||
+        file_header.count < 0) {  // unreadable, or the archive changed since the index was written
+        fclose(index_ptr);
+        return -1;
+    }
+    index->records = malloc((file_header.count > 0 ? file_header.count : 1) * sizeof(index_record_t));
+    if (index->records == NULL) {
+        fclose(index_ptr);
+        return -1;
+    }
+    index->capacity = file_header.count;
+    if (fread(index->records, sizeof(index_record_t), file_header.count, index_ptr) != (size_t)file_header.count) {
+        index_clear(index);
+        fclose(index_ptr);
+        return -1;
+    }
+    index->count = file_header.count;
+    fclose(index_ptr);
+    return 0;
+}
+
+int index_save(const char *archive_name, const archive_index_t *index) {
+    char path[MAX_PATH_LEN];
+    char temp_path[MAX_PATH_LEN];
+    index_file_header_t file_header;
+    struct stat stat_buf;
+    if (index_path(archive_name, path, sizeof(path)) != 0 ||
+        snprintf(temp_path, sizeof(temp_path), "%s.tmp", path) >= (int)sizeof(temp_path)) {
+        return -1;
+    }
+    if (stat(archive_name, &stat_buf) != 0) {
+        return -1;
+    }
+    memcpy(file_header.magic, INDEX_MAGIC, sizeof(file_header.magic));
+    file_header.archive_size = stat_buf.st_size;
+    file_header.archive_mtime_sec = stat_buf.st_mtim.tv_sec;
+    file_header.archive_mtime_nsec = stat_buf.st_mtim.tv_nsec;
+    file_header.count = index->count;
+
+    // Write to a temporary file first, then rename over the old index in one step
+    FILE *index_ptr = fopen(temp_path, "w");
+    if (index_ptr == NULL) {
+        return -1;
+    }
+    if (fwrite(&file_header, sizeof(file_header), 1, index_ptr) != 1 ||
+        fwrite(index->records, sizeof(index_record_t), index->count, index_ptr) != (size_t)index->count) {
+        fclose(index_ptr);
+        remove(temp_path);
+        return -1;
+    }
+    if (fclose(index_ptr) != 0 || rename(temp_path, path) != 0) {
+        remove(temp_path);
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,64 @@
+#ifndef _ARCHIVE_INDEX_H
+#define _ARCHIVE_INDEX_H
+#include <stdint.h>
+#include <sys/types.h>
+
+// Suffix appended to an archive's name to get the name of its index file
+#define INDEX_SUFFIX ".idx"
+
+// One member header of an archive, as stored in the index file
+typedef struct {
+    // Offset of the member's header block within the archive
+    int64_t header_offset;
+    // Size of the member's contents in bytes
+    int64_t size;
+    // Modification time of the member in Unix epoch time
+    int64_t mtime;
+    // 1 for the first copy of this name in the archive, 2 for the first update, and so on
+    int32_t version;
+    // Member name, cut to 100 bytes; null-terminated only when shorter than that
+    char name[100];
+} index_record_t;
+
+// In-memory copy of an index, describing every member header in archive order
+typedef struct {
+    index_record_t *records;
+    int count;
+    int capacity;
+} archive_index_t;
+
+// Initialize a new, empty index
+void index_init(archive_index_t *index);
+
+// Free all memory associated with an index
+void index_clear(archive_index_t *index);
+
+// Add a record for a member header to the end of the index
+// Returns 0 on success or -1 if memory could not be allocated
+int index_add(archive_index_t *index, const char *name, off_t header_offset, off_t size, time_t mtime);
+
+// Determine whether any record's name fills its whole field, and so may have been cut short
+// Returns 1 if one does, 0 otherwise
+int index_has_long_names(const archive_index_t *index);
+
+// Number every record by how many times its name appeared before it, plus one
+// Returns 0 on success or -1 if memory could not be allocated
+int index_number_versions(archive_index_t *index);
+
+// Determine whether an index file exists for the archive 'archive_name'
+// Returns 1 if it does, 0 otherwise
+int index_exists(const char *archive_name);
+
+// Load the index file of the archive 'archive_name' into 'index'
+// The index is only accepted if the archive's current size and modification time
+// match those recorded when the index was saved.
+// Returns 0 on success or -1 if there is no index, it is stale, or it can't be read
+int index_load(const char *archive_name, archive_index_t *index);
+
+// Write 'index' as the index file of the archive 'archive_name', stamped with
+// the archive's current size and modification time
+// The file is replaced atomically, so readers never see a half-written index.
+// Returns 0 on success or -1 if an error occurred
+int index_save(const char *archive_name, const archive_index_t *index);
+
+#endif
@@ -0,0 +1,451 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "archive_stream.h"
+
+#define STREAM_BUFFER_SIZE STREAM_VIEW_MAX  // a view of uncompressed input always fits in the buffer
+
+static const unsigned char GZIP_MAGIC[] = {0x1f, 0x8b};
+static const unsigned char ZSTD_MAGIC[] = {0x28, 0xb5, 0x2f, 0xfd};
+
+const char *compression_name(compression_t compression) {
+    switch (compression) {
+        case COMPRESS_GZIP:
+            return "gzip";
+        case COMPRESS_ZSTD:
+            return "zstd";
+        default:
+            return "none";
+    }
+}
+
+int compression_max_level(compression_t compression) {
+    switch (compression) {
+        case COMPRESS_GZIP:
+            return Z_BEST_COMPRESSION;
+        case COMPRESS_ZSTD:
+#ifdef HAVE_ZSTD
+            return ZSTD_maxCLevel();
+#else
+            return 22;
+#endif
+        default:
+            return 0;
+    }
+}
+
+int compression_available(compression_t compression) {
+#ifndef HAVE_ZSTD
+    if (compression == COMPRESS_ZSTD) {
+        return 0;
+    }
+#endif
+    return 1;
+}
+
+/*
+ * Writes all 'count' bytes of 'buf' to 'fd', retrying after short writes
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int write_fd(int fd, const unsigned char *buf, size_t count) {
+    while (count > 0) {
+        ssize_t nwritten = write(fd, buf, count);
+        if (nwritten == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buf += nwritten;
+        count -= nwritten;
+    }
+    return 0;
+}
+
+/*
+ * Refills the reader's buffer with the next chunk of raw input
+ * Returns 0 on success (setting 'input_done' at end of input) or -1 if an error occurs
+ */
+static int fill_buffer(archive_stream_t *stream) {
+    stream->buffer_pos = 0;
+    stream->buffer_len = 0;
+    while (1) {
+        ssize_t nread = read(stream->fd, stream->buffer, STREAM_BUFFER_SIZE);
+        if (nread == -1 && errno == EINTR) {
+            continue;
+        }
+        if (nread == -1) {
+            return -1;
+        }
+        if (nread == 0) {
+            stream->input_done = 1;
+        }
+        stream->buffer_len = nread;
+        return 0;
+    }
+}
+
+/*
+ * Makes at least 'count' bytes (at most STREAM_BUFFER_SIZE) of uncompressed input sit in the
+ * reader's buffer, fewer only at end of input, moving the bytes not consumed yet to its front
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int top_up_buffer(archive_stream_t *stream, size_t count) {
+    size_t buffered = stream->buffer_len - stream->buffer_pos;
+    memmove(stream->buffer, stream->buffer + stream->buffer_pos, buffered);
+    stream->buffer_pos = 0;
+    stream->buffer_len = buffered;
+    while (stream->buffer_len < count && !stream->input_done) {
+        ssize_t nread = read(stream->fd, stream->buffer + stream->buffer_len, STREAM_BUFFER_SIZE - stream->buffer_len);
+        if (nread == -1 && errno == EINTR) {
+            continue;
+        }
+        if (nread == -1) {
+            return -1;
+        }
+        if (nread == 0) {
+            stream->input_done = 1;
+        }
+        stream->buffer_len += nread;
+    }
+    return 0;
+}
+
+/*
+ * Writes the first 'produced' bytes of encoder output sitting in the writer's buffer to 'fd'
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int flush_buffer(archive_stream_t *stream, size_t produced) {
+    return write_fd(stream->fd, stream->buffer, produced);
+}
+
+int stream_open_writer(archive_stream_t *stream, int fd, compression_t compression, int level, int num_threads) {
+    memset(stream, 0, sizeof(*stream));
+    stream->fd = fd;
+    stream->writing = 1;
+    stream->compression = compression;
+    if (compression == COMPRESS_NONE) {
+        return 0;
+    }
+    stream->buffer = malloc(STREAM_BUFFER_SIZE);
+    if (stream->buffer == NULL) {
+        return -1;
+    }
+    if (compression == COMPRESS_GZIP) {
+        z_stream *zs = calloc(1, sizeof(z_stream));
+        // windowBits + 16 selects a gzip wrapper instead of a raw zlib one
+        int status = zs == NULL ? Z_MEM_ERROR : deflateInit2(zs, level < 0 ? Z_DEFAULT_COMPRESSION : level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY);
+        if (status != Z_OK) {
+            free(zs);
+            free(stream->buffer);
+            errno = status == Z_MEM_ERROR ? ENOMEM : EINVAL;  // zlib doesn't set errno itself
+            return -1;
+        }
+        stream->codec = zs;
+        return 0;
+    }
+#ifdef HAVE_ZSTD
+    ZSTD_CCtx *cctx = ZSTD_createCCtx();
+    if (cctx == NULL) {
+        free(stream->buffer);
+        errno = ENOMEM;
+        return -1;
+    }
+    if (ZSTD_isError(ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, level < 0 ? ZSTD_CLEVEL_DEFAULT : level))) {
+        ZSTD_freeCCtx(cctx);
+        free(stream->buffer);
+        errno = EINVAL;
+        return -1;
+    }
+    if (num_threads > 1) {  // fails harmlessly on a libzstd built without threading
+        ZSTD_CCtx_setParameter(cctx, ZSTD_c_nbWorkers, num_threads);
+    }
+    stream->codec = cctx;
+    return 0;
+#else
+    free(stream->buffer);
+    errno = ENOTSUP;
+    return -1;
+#endif
+}
+
+int stream_open_reader(archive_stream_t *stream, int fd) {
+    memset(stream, 0, sizeof(*stream));
+    stream->fd = fd;
+    stream->buffer = malloc(STREAM_BUFFER_SIZE);
+    if (stream->buffer == NULL) {
+        return -1;
+    }
+    // Look at the first bytes to pick a decoder; they stay in the buffer for the decoder to consume
+    while (stream->buffer_len < sizeof(ZSTD_MAGIC)) {
+        ssize_t nread = read(fd, stream->buffer + stream->buffer_len, STREAM_BUFFER_SIZE - stream->buffer_len);
+        if (nread == -1 && errno == EINTR) {
+            continue;
+        }
+        if (nread == -1) {
+            free(stream->buffer);
+            return -1;
+        }
+        if (nread == 0) {
+            stream->input_done = 1;
+            break;
+        }
+        stream->buffer_len += nread;
+    }
+    if (stream->buffer_len >= sizeof(GZIP_MAGIC) && memcmp(stream->buffer, GZIP_MAGIC, sizeof(GZIP_MAGIC)) == 0) {
+        z_stream *zs = calloc(1, sizeof(z_stream));
+        // windowBits + 32 accepts both gzip and zlib headers
+        if (zs == NULL || inflateInit2(zs, 15 + 32) != Z_OK) {
+            free(zs);
+            free(stream->buffer);
+            return -1;
+        }
+        stream->compression = COMPRESS_GZIP;
+        stream->codec = zs;
+    } else if (stream->buffer_len >= sizeof(ZSTD_MAGIC) && memcmp(stream->buffer, ZSTD_MAGIC, sizeof(ZSTD_MAGIC)) == 0) {
+#ifdef HAVE_ZSTD
+        ZSTD_DCtx *dctx = ZSTD_createDCtx();
+        if (dctx == NULL) {
+            free(stream->buffer);
+            return -1;
+        }
+        stream->compression = COMPRESS_ZSTD;
+        stream->codec = dctx;
+#else
+        free(stream->buffer);
+        errno = ENOTSUP;
+        return -1;
+#endif
+    }
+    return 0;
+}
+
+compression_t stream_detect_file(int fd) {
+    unsigned char magic[sizeof(ZSTD_MAGIC)];
+    ssize_t nread = pread(fd, magic, sizeof(magic), 0);
+    if (nread >= (ssize_t)sizeof(GZIP_MAGIC) && memcmp(magic, GZIP_MAGIC, sizeof(GZIP_MAGIC)) == 0) {
+        return COMPRESS_GZIP;
+    }
+    if (nread == sizeof(ZSTD_MAGIC) && memcmp(magic, ZSTD_MAGIC, sizeof(ZSTD_MAGIC)) == 0) {
+        return COMPRESS_ZSTD;
+    }
+    return COMPRESS_NONE;
+}
+
+int stream_is_passthrough(const archive_stream_t *stream) {
+    return stream->compression == COMPRESS_NONE && stream->buffer_pos == stream->buffer_len;
+}
+
+size_t stream_buffered(const archive_stream_t *stream) {
+    return stream->compression == COMPRESS_NONE ? stream->buffer_len - stream->buffer_pos : 0;
+}
+
+int stream_write(archive_stream_t *stream, const void *buf, size_t count) {
+    if (stream->compression == COMPRESS_NONE) {
+        return write_fd(stream->fd, buf, count);
+    }
+    if (stream->compression == COMPRESS_GZIP) {
+        z_stream *zs = stream->codec;
+        zs->next_in = (unsigned char *)buf;
+        zs->avail_in = count;
+        while (zs->avail_in > 0) {  // keep draining output until all input is consumed
+            zs->next_out = stream->buffer;
+            zs->avail_out = STREAM_BUFFER_SIZE;
+            if (deflate(zs, Z_NO_FLUSH) == Z_STREAM_ERROR ||
+                flush_buffer(stream, STREAM_BUFFER_SIZE - zs->avail_out) != 0) {
+                return -1;
+            }
+        }
+        return 0;
+    }
+#ifdef HAVE_ZSTD
+    ZSTD_inBuffer input = {buf, count, 0};
+    while (input.pos < input.size) {
+        ZSTD_outBuffer output = {stream->buffer, STREAM_BUFFER_SIZE, 0};
+        if (ZSTD_isError(ZSTD_compressStream2(stream->codec, &output, &input, ZSTD_e_continue)) ||
+            flush_buffer(stream, output.pos) != 0) {
+            errno = EIO;
+            return -1;
+        }
+    }
+    return 0;
+#else
+    return -1;
+#endif
+}
+
+/*
+ * Decodes up to 'count' bytes into 'buf', refilling the input buffer as needed
+ * Returns the number of bytes produced (fewer than 'count' only at end of input) or -1
+ */
+static ssize_t decode(archive_stream_t *stream, unsigned char *buf, size_t count) {
+    size_t produced = 0;
+    while (produced < count) {
+        if (stream->buffer_pos == stream->buffer_len) {
+            if (stream->input_done || fill_buffer(stream) != 0) {
+                break;
+            }
+            if (stream->buffer_len == 0) {  // end of input
+                break;
+            }
+        }
+        if (stream->compression == COMPRESS_GZIP) {
+            z_stream *zs = stream->codec;
+            if (stream->frame_done) {  // another gzip member follows, as produced by concatenating files
+                inflateReset(zs);
+                stream->frame_done = 0;
+            }
+            zs->next_in = stream->buffer + stream->buffer_pos;
+            zs->avail_in = stream->buffer_len - stream->buffer_pos;
+            zs->next_out = buf + produced;
+            zs->avail_out = count - produced;
+            int ret = inflate(zs, Z_NO_FLUSH);
+            if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+                errno = EIO;
+                return -1;
+            }
+            stream->buffer_pos = stream->buffer_len - zs->avail_in;
+            produced = count - zs->avail_out;
+            if (ret == Z_STREAM_END) {
+                stream->frame_done = 1;
+            }
+        } else {
+#ifdef HAVE_ZSTD
+            ZSTD_inBuffer input = {stream->buffer, stream->buffer_len, stream->buffer_pos};
+            ZSTD_outBuffer output = {buf, count, produced};
+            size_t ret = ZSTD_decompressStream(stream->codec, &output, &input);
+            if (ZSTD_isError(ret)) {
+                errno = EIO;
+                return -1;
+            }
+            stream->buffer_pos = input.pos;
+            produced = output.pos;
+#else
+            return -1;
+#endif
+        }
+    }
+    return produced;
+}
+
+ssize_t stream_read(archive_stream_t *stream, void *buf, size_t count) {
+    if (stream->compression != COMPRESS_NONE) {
+        return decode(stream, buf, count);
+    }
+    // Serve bytes already read ahead, then refill the buffer, or read 'fd' directly for large reads
+    size_t total = 0;
+    while (total < count) {
+        size_t buffered = stream->buffer_len - stream->buffer_pos;
+        if (buffered > 0) {
+            size_t taken = buffered < count - total ? buffered : count - total;
+            memcpy((char *)buf + total, stream->buffer + stream->buffer_pos, taken);
+            stream->buffer_pos += taken;
+            total += taken;
+            continue;
+        }
+        if (stream->input_done) {
+            break;
+        }
+        if (count - total < STREAM_BUFFER_SIZE) {
+            if (top_up_buffer(stream, 1) != 0) {
+                return -1;
+            }
+            continue;
+        }
+        ssize_t nread = read(stream->fd, (char *)buf + total, count - total);
+        if (nread == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (nread == 0) {
+            stream->input_done = 1;
+        }
+        total += nread;
+    }
+    return total;
+}
+
+ssize_t stream_view(archive_stream_t *stream, const void **data, size_t count) {
+    if (count > STREAM_VIEW_MAX) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (stream->compression != COMPRESS_NONE) {
+        if (stream->view_capacity < count) {
+            unsigned char *view = realloc(stream->view, count);
+            if (view == NULL) {
+                return -1;
+            }
+            stream->view = view;
+            stream->view_capacity = count;
+        }
+        *data = stream->view;
+        return decode(stream, stream->view, count);
+    }
+    if (stream->buffer_len - stream->buffer_pos < count && top_up_buffer(stream, count) != 0) {
+        return -1;
+    }
+    size_t buffered = stream->buffer_len - stream->buffer_pos;
+    size_t taken = buffered < count ? buffered : count;
+    *data = stream->buffer + stream->buffer_pos;
+    stream->buffer_pos += taken;
+    return taken;
+}
+
+int stream_close(archive_stream_t *stream) {
+    int result = 0;
+    if (stream->compression == COMPRESS_GZIP) {
+        z_stream *zs = stream->codec;
+        if (stream->writing) {
+            int ret;
+            zs->next_in = NULL;
+            zs->avail_in = 0;
+            do {  // emit everything still held by the encoder, plus the gzip trailer
+                zs->next_out = stream->buffer;
+                zs->avail_out = STREAM_BUFFER_SIZE;
+                ret = deflate(zs, Z_FINISH);
+                if (ret == Z_STREAM_ERROR || flush_buffer(stream, STREAM_BUFFER_SIZE - zs->avail_out) != 0) {
+                    result = -1;
+                    break;
+                }
+            } while (ret != Z_STREAM_END);
+            deflateEnd(zs);
+        } else {
+            inflateEnd(zs);
+        }
+        free(zs);
+    }
+#ifdef HAVE_ZSTD
+    if (stream->compression == COMPRESS_ZSTD) {
+        if (stream->writing) {
+            size_t remaining;
+            do {  // ends the frame, waiting for any worker threads to finish
+                ZSTD_inBuffer input = {NULL, 0, 0};
+                ZSTD_outBuffer output = {stream->buffer, STREAM_BUFFER_SIZE, 0};
+                remaining = ZSTD_compressStream2(stream->codec, &output, &input, ZSTD_e_end);
+                if (ZSTD_isError(remaining) || flush_buffer(stream, output.pos) != 0) {
+                    result = -1;
+                    break;
+                }
+            } while (remaining != 0);
+            ZSTD_freeCCtx(stream->codec);
+        } else {
+            ZSTD_freeDCtx(stream->codec);
+        }
+    }
+#endif
+    free(stream->buffer);
+    free(stream->view);
+    stream->codec = NULL;
+    stream->buffer = NULL;
+    stream->view = NULL;
+    return result;
+}
@@ -0,0 +1,84 @@
+#ifndef _ARCHIVE_STREAM_H
+#define _ARCHIVE_STREAM_H
+#include <stddef.h>
+#include <sys/types.h>
+
+// Compression formats an archive can be stored in
+typedef enum {
+    COMPRESS_NONE,
+    COMPRESS_GZIP,
+    COMPRESS_ZSTD,
+} compression_t;
+
+// A compressing writer or decompressing reader layered over a file descriptor
+// Archive code reads and writes plain tar blocks; the stream converts them to and
+// from the compressed bytes on 'fd'.
+typedef struct {
+    int fd;
+    int writing;  // 1 for a writer, 0 for a reader
+    compression_t compression;
+    void *codec;  // zlib or zstd state, NULL when uncompressed
+    unsigned char *buffer;  // compressed bytes waiting to be written, or read but not yet decoded
+    size_t buffer_len;  // number of valid bytes in 'buffer'
+    size_t buffer_pos;  // reader only: first byte of 'buffer' not yet decoded
+    int input_done;  // reader only: 'fd' reached end of input
+    int frame_done;  // reader only: the decoder finished a whole stream/frame
+    unsigned char *view;  // reader only: where stream_view decodes compressed input to, NULL until needed
+    size_t view_capacity;  // size of 'view'
+} archive_stream_t;
+
+// Start a stream that compresses everything written to it into 'fd'
+// 'level' is codec-specific (1 to compression_max_level), or -1 for the codec's default. 'num_threads' > 1 lets
+// zstd compress with that many threads (ignored for gzip).
+// Returns 0 on success or -1 if the codec is unavailable or fails to start
+int stream_open_writer(archive_stream_t *stream, int fd, compression_t compression, int level, int num_threads);
+
+// Start a stream that reads an archive from 'fd', detecting gzip or zstd
+// compression from the first bytes of input; anything else is read as is.
+// Returns 0 on success or -1 if an error occurs
+int stream_open_reader(archive_stream_t *stream, int fd);
+
+// Write all 'count' bytes of 'buf' to the stream
+// Returns 0 on success or -1 if an error occurs
+int stream_write(archive_stream_t *stream, const void *buf, size_t count);
+
+// Read up to 'count' bytes from the stream, stopping short only at end of input
+// Uncompressed input is read ahead in large chunks, except for reads at least as large.
+// Returns the number of bytes read or -1 if an error occurs
+ssize_t stream_read(archive_stream_t *stream, void *buf, size_t count);
+
+// Read up to 'count' bytes from the stream like stream_read, but point '*data' at them instead
+// of copying them: uncompressed input is left where it was read ahead, compressed input is
+// decoded into a scratch area of the stream. The bytes stay valid until the next call on the stream.
+// 'count' may not exceed STREAM_VIEW_MAX.
+// Returns the number of bytes read or -1 if an error occurs
+#define STREAM_VIEW_MAX (256 * 1024)
+ssize_t stream_view(archive_stream_t *stream, const void **data, size_t count);
+
+// Returns the number of bytes of uncompressed input read ahead from 'fd' but not consumed yet,
+// which have to be taken with stream_read or stream_view before 'fd' is read directly
+size_t stream_buffered(const archive_stream_t *stream);
+
+// Determine the compression of the seekable file open as 'fd' from its first bytes,
+// without moving its file position
+compression_t stream_detect_file(int fd);
+
+// Returns 1 if the stream passes bytes through unchanged and holds no buffered input,
+// meaning callers may read or write 'fd' directly, 0 otherwise
+int stream_is_passthrough(const archive_stream_t *stream);
+
+// Finish the stream (writers flush all remaining compressed output) and free its resources
+// Does not close 'fd'.
+// Returns 0 on success or -1 if an error occurs
+int stream_close(archive_stream_t *stream);
+
+// Name of a compression format, for messages
+const char *compression_name(compression_t compression);
+
+// Highest compression level 'compression' accepts (levels start at 1), 0 for COMPRESS_NONE
+int compression_max_level(compression_t compression);
+
+// Returns 1 if support for 'compression' was compiled in, 0 otherwise
+int compression_available(compression_t compression);
+
+#endif
@@ -0,0 +1,261 @@
+#!/usr/bin/env python3
+"""
+Benchmark harness for minitar.
+
+Generates synthetic corpora, times every archive operation on them and prints
+one JSON document with throughput (MB/s, files/s) and peak RSS per operation.
+Pass --baseline with an earlier result to fail when an operation got slower.
+
+    python3 bench/bench.py --minitar ./minitar > bench.json
+    python3 bench/bench.py --minitar ./minitar --baseline bench.json
+"""
+import argparse
+import json
+import os
+import platform
+import shutil
+import subprocess
+import sys
+import tempfile
+
+# Corpus sizes: (tiny file count, huge file count, huge file MiB, history depth)
+PROFILES = {
+    "quick": (500, 2, 16, 20),
+    "full": (20000, 3, 512, 200),
+}
+CHUNK = 1 << 20
+# Built by 'make bench' next to this script
+RUN_MEASURED = os.path.join(os.path.dirname(os.path.abspath(__file__)), "run_measured")
+
+
+def write_file(path, size, seed):
+    """Writes 'size' pseudo-random bytes, reusing one random chunk so generation stays cheap"""
+    block = os.urandom(min(size, CHUNK)) if size else b""
+    with open(path, "wb") as f:
+        remaining = size
+        while remaining > 0:
+            n = min(remaining, len(block))
+            f.write(block[:n])
+            remaining -= n
+        # make every file differ even when the chunk repeats
+        if size:
+            f.seek(0)
+            f.write(seed.to_bytes(8, "little")[:min(8, size)])
+
+
+def make_tiny(root, count):
+    os.makedirs(root)
+    names = []
+    for i in range(count):
+        name = "t%06d.dat" % i
+        write_file(os.path.join(root, name), 64 + (i * 797) % 4032, i)
+        names.append(name)
+    return names
+
+
+def make_huge(root, count, mib):
+    os.makedirs(root)
+    names = []
+    for i in range(count):
+        name = "h%d.bin" % i
+        write_file(os.path.join(root, name), mib * CHUNK, i)
+        names.append(name)
+    return names
+
+
+def corpus_bytes(root, names):
+    return sum(os.path.getsize(os.path.join(root, n)) for n in names)
+
+
+def mark_changed(root, names, step):
+    """Picks every 'step'-th file for -u to append and returns (picked names, a function marking them changed)
+
+    The files keep their contents, only their modification time moves a second past the one
+    they had when picked, so the archive's header no longer matches them.
+    """
+    picked = names[::step]
+    mtimes = {n: os.stat(os.path.join(root, n)).st_mtime_ns for n in picked}
+
+    def touch():
+        for n in picked:
+            t = mtimes[n] + 1_000_000_000
+            os.utime(os.path.join(root, n), ns=(t, t))
+    return picked, touch
+
+
+def run(minitar, args, cwd):
+    """Runs one minitar command through run_measured and returns (seconds, peak RSS in KiB)"""
+    with tempfile.NamedTemporaryFile("r", suffix=".txt") as result:
+        proc = subprocess.run([RUN_MEASURED, result.name, minitar] + args, cwd=cwd, stdout=subprocess.DEVNULL)
+        if proc.returncode != 0:
+            raise RuntimeError("minitar %s failed with status %d" % (" ".join(args[:4]), proc.returncode))
+        seconds, rss = result.read().split()
+    return float(seconds), int(rss)
+
+
+def measure(results, corpus, op, minitar, args, cwd, nbytes, nfiles, repeat, setup=None):
+    """Times an operation 'repeat' times, keeping the fastest run"""
+    best = None
+    for _ in range(repeat):
+        if setup:
+            setup()
+        seconds, rss = run(minitar, args, cwd)
+        if best is None or seconds < best[0]:
+            best = (seconds, rss)
+    seconds, rss = best
+    results.append({
+        "corpus": corpus,
+        "op": op,
+        "seconds": round(seconds, 6),
+        "bytes": nbytes,
+        "files": nfiles,
+        # an operation that moves no data (nbytes 0) has no throughput, only a time
+        "mb_per_s": round(nbytes / (1 << 20) / seconds, 2) if seconds and nbytes else None,
+        "files_per_s": round(nfiles / seconds, 1) if seconds and nfiles else None,
+        "peak_rss_kb": rss,
+    })
+    mb_per_s = results[-1]["mb_per_s"]
+    print("%-8s %-3s %9.3fs %15s %10.0f files/s %8d KiB" % (
+        corpus, op, seconds, "-" if mb_per_s is None else "%.1f MB/s" % mb_per_s, results[-1]["files_per_s"] or 0, rss),
+        file=sys.stderr)
+
+
+def bench_corpus(results, corpus, root, names, minitar, opts, repeat):
+    """Times -c, -t, -x, -a and -u on one directory of files
+
+    -u is timed twice: as "-u", with every tenth file changed, counting only the bytes and files
+    it appends; and as "-u0", a scan of the unchanged tree that appends nothing and so reports
+    no MB/s, only its time and the files it checked per second.
+    """
+    archive = os.path.abspath(os.path.join(root, "..", corpus + ".tar"))
+    out = os.path.abspath(os.path.join(root, "..", corpus + "_out"))
+    nbytes = corpus_bytes(root, names)
+    nfiles = len(names)
+
+    measure(results, corpus, "-c", minitar, ["-c"] + opts + ["-f", archive] + names, root, nbytes, nfiles, repeat)
+    measure(results, corpus, "-t", minitar, ["-t"] + opts + ["-f", archive], root, nbytes, nfiles, repeat)
+
+    def fresh_out():
+        shutil.rmtree(out, ignore_errors=True)
+        os.makedirs(out)
+    measure(results, corpus, "-x", minitar, ["-x"] + opts + ["-f", archive], out, nbytes, nfiles, repeat, fresh_out)
+    shutil.rmtree(out, ignore_errors=True)
+
+    # -a and -u each start from a copy of the freshly created archive
+    base = archive + ".base"
+    shutil.copyfile(archive, base)
+
+    def fresh_archive():
+        shutil.copyfile(base, archive)
+    measure(results, corpus, "-a", minitar, ["-a"] + opts + ["-f", archive] + names, root, nbytes, nfiles, repeat, fresh_archive)
+    measure(results, corpus, "-u0", minitar, ["-u"] + opts + ["-f", archive] + names, root, 0, nfiles, repeat, fresh_archive)
+    changed, touch = mark_changed(root, names, 10)
+
+    def fresh_update():
+        fresh_archive()
+        touch()
+    measure(results, corpus, "-u", minitar, ["-u"] + opts + ["-f", archive] + names, root, corpus_bytes(root, changed), len(changed),
+            repeat, fresh_update)
+    os.remove(base)
+    os.remove(archive)
+
+
+def bench_history(results, root, depth, minitar, opts, repeat):
+    """Builds an archive holding 'depth' versions of a few files, then times reading it"""
+    os.makedirs(root)
+    names = []
+    for i in range(8):
+        name = "v%d.txt" % i
+        write_file(os.path.join(root, name), 4096 + i * 1000, i)
+        names.append(name)
+    archive = os.path.abspath(os.path.join(root, "..", "history.tar"))
+    subprocess.run([minitar, "-c"] + opts + ["-f", archive] + names, cwd=root, check=True)
+    for version in range(1, depth):
+        for i, name in enumerate(names):
+            write_file(os.path.join(root, name), 4096 + i * 1000 + version, version * 100 + i)
+        subprocess.run([minitar, "-u"] + opts + ["-f", archive] + names, cwd=root, check=True)
+
+    members = depth * len(names)
+    nbytes = os.path.getsize(archive)
+    out = os.path.abspath(os.path.join(root, "..", "history_out"))
+
+    def fresh_out():
+        shutil.rmtree(out, ignore_errors=True)
+        os.makedirs(out)
+    measure(results, "history", "-t", minitar, ["-t"] + opts + ["-f", archive], root, nbytes, members, repeat)
+    measure(results, "history", "-x", minitar, ["-x"] + opts + ["-f", archive], out, nbytes, members, repeat, fresh_out)
+    shutil.rmtree(out, ignore_errors=True)
+
+    # The newest versions are all archived already, so -u appends only the files marked changed
+    base = archive + ".base"
+    shutil.copyfile(archive, base)
+    changed, touch = mark_changed(root, names, 4)
+
+    def fresh_update():
+        shutil.copyfile(base, archive)
+        touch()
+    measure(results, "history", "-u", minitar, ["-u"] + opts + ["-f", archive] + names, root, corpus_bytes(root, changed), len(changed),
+            repeat, fresh_update)
+    os.remove(base)
+    os.remove(archive)
+
+
+def compare(results, baseline_path, threshold):
+    """Returns the operations that got more than 'threshold' percent slower than the baseline"""
+    with open(baseline_path) as f:
+        baseline = {(r["corpus"], r["op"]): r for r in json.load(f)["results"]}
+    regressions = []
+    for r in results:
+        old = baseline.get((r["corpus"], r["op"]))
+        if old is None or not old["seconds"]:
+            continue
+        change = (r["seconds"] - old["seconds"]) / old["seconds"] * 100
+        if change > threshold:
+            regressions.append({"corpus": r["corpus"], "op": r["op"], "baseline_seconds": old["seconds"],
+                                "seconds": r["seconds"], "percent_slower": round(change, 1)})
+    return regressions
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--minitar", default="./minitar", help="minitar binary to benchmark")
+    parser.add_argument("--profile", choices=sorted(PROFILES), default="quick", help="corpus sizes")
+    parser.add_argument("--repeat", type=int, default=3, help="runs per operation, the fastest is reported")
+    parser.add_argument("--jobs", type=int, default=1, help="pass -j JOBS to minitar")
+    parser.add_argument("--workdir", help="where to generate corpora (default: a temporary directory)")
+    parser.add_argument("--baseline", help="earlier JSON output to check for regressions")
+    parser.add_argument("--threshold", type=float, default=10.0, help="percent slowdown counted as a regression")
+    args = parser.parse_args()
+
+    minitar = os.path.abspath(args.minitar)
+    opts = ["-j", str(args.jobs)] if args.jobs > 1 else []
+    tiny_count, huge_count, huge_mib, depth = PROFILES[args.profile]
+    workdir = tempfile.mkdtemp(prefix="minitar-bench-", dir=args.workdir)
+    results = []
+    try:
+        tiny = make_tiny(os.path.join(workdir, "tiny"), tiny_count)
+        bench_corpus(results, "tiny", os.path.join(workdir, "tiny"), tiny, minitar, opts, args.repeat)
+        huge = make_huge(os.path.join(workdir, "huge"), huge_count, huge_mib)
+        bench_corpus(results, "huge", os.path.join(workdir, "huge"), huge, minitar, opts, args.repeat)
+        bench_history(results, os.path.join(workdir, "history"), depth, minitar, opts, args.repeat)
+    finally:
+        shutil.rmtree(workdir, ignore_errors=True)
+
+    report = {
+        "profile": args.profile,
+        "jobs": args.jobs,
+        "host": platform.node(),
+        "kernel": platform.release(),
+        "results": results,
+    }
+    status = 0
+    if args.baseline:
+        report["regressions"] = compare(results, args.baseline, args.threshold)
+        status = 1 if report["regressions"] else 0
+    json.dump(report, sys.stdout, indent=2)
+    print()
+    return status
+
+
+if __name__ == "__main__":
+    sys.exit(main())
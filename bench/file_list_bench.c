@@ -0,0 +1,63 @@
+#define _POSIX_C_SOURCE 199309L  // for clock_gettime
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "../file_list.h"
+
+#define DEFAULT_NUM_NAMES 1000000
+#define NAME_BUFFER_LEN 32
+
+/*
+ * Microbenchmark for file_list_t: times adding N distinct names, looking each one up,
+ * looking up N absent names, and checking the list is a subset of itself.
+ * Usage: file_list_bench [N]
+ */
+
+static double seconds_since(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+int main(int argc, char **argv) {
+    int num_names = argc > 1 ? atoi(argv[1]) : DEFAULT_NUM_NAMES;
+    char name[NAME_BUFFER_LEN];
+    struct timespec start;
+    file_list_t list;
+    file_list_init(&list);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < num_names; i++) {
+        snprintf(name, NAME_BUFFER_LEN, "dir/file_%09d.dat", i);
+        if (file_list_add(&list, name) != 0) {
+            printf("Error: file_list_add failed\n");
+            file_list_clear(&list);
+            return 1;
+        }
+    }
+    printf("add       %d names: %.3f s\n", num_names, seconds_since(&start));
+
+    int found = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < num_names; i++) {
+        snprintf(name, NAME_BUFFER_LEN, "dir/file_%09d.dat", i);
+        found += file_list_contains(&list, name);
+    }
+    printf("contains  %d hits:  %.3f s (%d found)\n", num_names, seconds_since(&start), found);
+
+    found = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < num_names; i++) {
+        snprintf(name, NAME_BUFFER_LEN, "dir/miss_%09d.dat", i);
+        found += file_list_contains(&list, name);
+    }
+    printf("contains  %d misses: %.3f s (%d found)\n", num_names, seconds_since(&start), found);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int subset = file_list_is_subset(&list, &list);
+    printf("is_subset %d names: %.3f s (result %d)\n", num_names, seconds_since(&start), subset);
+
+    file_list_clear(&list);
+    return 0;
+}
@@ -0,0 +1,50 @@
+#define _GNU_SOURCE  // for wait4
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Runs a command and reports its wall time and peak resident set size, for bench.py.
+ * A process started straight from Python inherits the interpreter's RSS high-water mark
+ * across exec, so the command is started from this small program instead.
+ * Usage: run_measured RESULT_FILE COMMAND [ARG...]
+ * Writes "SECONDS PEAK_RSS_KB" to RESULT_FILE and exits with the command's status.
+ */
+
+int main(int argc, char **argv) {
+    if (argc < 3) {
+        fprintf(stderr, "Usage: %s RESULT_FILE COMMAND [ARG...]\n", argv[0]);
+        return 2;
+    }
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("fork");
+        return 2;
+    }
+    if (pid == 0) {
+        execvp(argv[2], argv + 2);
+        perror(argv[2]);
+        _exit(127);
+    }
+    int status;
+    struct rusage usage;
+    if (wait4(pid, &status, 0, &usage) == -1) {
+        perror("wait4");
+        return 2;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    FILE *result = fopen(argv[1], "w");
+    if (result == NULL) {
+        perror(argv[1]);
+        return 2;
+    }
+    fprintf(result, "%.6f %ld\n", (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9, usage.ru_maxrss);
+    fclose(result);
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
@@ -0,0 +1,155 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "dedup_index.h"
+
+// Initial number of buckets, a power of 2
+#define INITIAL_BUCKETS 64
+
+void dedup_index_init(dedup_index_t *index) {
+    index->entries = NULL;
+    index->count = 0;
+    index->capacity = 0;
+    index->size_buckets = NULL;
+    index->name_buckets = NULL;
+    index->num_buckets = 0;
+}
+
+void dedup_index_clear(dedup_index_t *index) {
+    for (int i = 0; i < index->count; i++) {
+        free(index->entries[i].name);
+    }
+    free(index->entries);
+    free(index->size_buckets);
+    free(index->name_buckets);
+    dedup_index_init(index);
+}
+
+/*
+ * Mixes the bits of 'value' so that sizes differing only in high bits land in different buckets
+ */
+static unsigned hash_size(off_t size) {
+    uint64_t value = (uint64_t)size * 0x9E3779B97F4A7C15ULL;
+    return (unsigned)(value >> 32);
+}
+
+/*
+ * FNV-1a hash of a name
+ */
+static unsigned hash_name(const char *name) {
+    unsigned hash = 2166136261u;
+    for (; *name != '\0'; name++) {
+        hash = (hash ^ (unsigned char)*name) * 16777619u;
+    }
+    return hash;
+}
+
+/*
+ * Links entry 'i' into the bucket chains
+ */
+static void link_entry(dedup_index_t *index, int i) {
+    dedup_entry_t *entry = &index->entries[i];
+    unsigned mask = index->num_buckets - 1;
+    unsigned size_bucket = hash_size(entry->size) & mask;
+    entry->next_size = index->size_buckets[size_bucket];
+    index->size_buckets[size_bucket] = i;
+    if (entry->name != NULL) {
+        unsigned name_bucket = hash_name(entry->name) & mask;
+        entry->next_name = index->name_buckets[name_bucket];
+        index->name_buckets[name_bucket] = i;
+    } else {
+        entry->next_name = -1;
+    }
+}
+
+/*
+ * Doubles the number of buckets and rebuilds the chains
+ * Returns 0 on success or -1 if memory could not be allocated
+ */
+static int grow_buckets(dedup_index_t *index) {
+    int num_buckets = index->num_buckets == 0 ? INITIAL_BUCKETS : index->num_buckets * 2;
+    int *size_buckets = malloc(num_buckets * sizeof(int));
+    int *name_buckets = malloc(num_buckets * sizeof(int));
+    if (size_buckets == NULL || name_buckets == NULL) {
+        free(size_buckets);
+        free(name_buckets);
+        return -1;
+    }
+    memset(size_buckets, 0xFF, num_buckets * sizeof(int));  // all -1
+    memset(name_buckets, 0xFF, num_buckets * sizeof(int));
+    free(index->size_buckets);
+    free(index->name_buckets);
+    index->size_buckets = size_buckets;
+    index->name_buckets = name_buckets;
+    index->num_buckets = num_buckets;
+    // Relinking in order keeps every chain newest first, as link_entry builds it
+    for (int i = 0; i < index->count; i++) {
+        link_entry(index, i);
+    }
+    return 0;
+}
+
+void dedup_index_forget(dedup_index_t *index, const char *name) {
+    if (index->num_buckets == 0) {
+        return;
+    }
+    int i = index->name_buckets[hash_name(name) & (index->num_buckets - 1)];
+    for (; i != -1; i = index->entries[i].next_name) {
+        dedup_entry_t *entry = &index->entries[i];
+        if (entry->name != NULL && strcmp(entry->name, name) == 0) {
+            free(entry->name);  // stays in its size chain, where a NULL name marks it unusable
+            entry->name = NULL;
+            return;  // a name only ever has one live entry
+        }
+    }
+}
+
+int dedup_index_add(dedup_index_t *index, const char *name, off_t size, const char *data) {
+    dedup_index_forget(index, name);
+    if (index->count == index->capacity) {  // grow the array geometrically
+        int capacity = index->capacity == 0 ? 64 : index->capacity * 2;
+        dedup_entry_t *grown = realloc(index->entries, capacity * sizeof(dedup_entry_t));
+        if (grown == NULL) {
+            return -1;
+        }
+        index->entries = grown;
+        index->capacity = capacity;
+    }
+    char *copy = strdup(name);
+    if (copy == NULL) {
+        return -1;
+    }
+    int i = index->count++;
+    index->entries[i] = (dedup_entry_t){copy, size, 0, 0, data, -1, -1};
+    if (index->count > index->num_buckets) {  // keep chains short, this relinks every entry
+        if (grow_buckets(index) != 0) {
+            index->count--;
+            free(copy);
+            return -1;
+        }
+    } else {
+        link_entry(index, i);
+    }
+    return i;
+}
+
+/*
+ * Returns entry 'i' or the first entry after it in its size chain with contents of 'size' bytes
+ */
+static int skip_other_sizes(const dedup_index_t *index, int i, off_t size) {
+    while (i != -1 && index->entries[i].size != size) {
+        i = index->entries[i].next_size;
+    }
+    return i;
+}
+
+int dedup_index_first(const dedup_index_t *index, off_t size) {
+    if (index->num_buckets == 0) {
+        return -1;
+    }
+    return skip_other_sizes(index, index->size_buckets[hash_size(size) & (index->num_buckets - 1)], size);
+}
+
+int dedup_index_next(const dedup_index_t *index, int i) {
+    return skip_other_sizes(index, index->entries[i].next_size, index->entries[i].size);
+}
@@ -0,0 +1,52 @@
+#ifndef _DEDUP_INDEX_H
+#define _DEDUP_INDEX_H
+#include <stdint.h>
+#include <sys/types.h>
+
+// A member whose contents later members with the same contents may refer to
+typedef struct {
+    char *name;  // path of the member's file, NULL once a later member of the same name replaced it
+    off_t size;
+    uint64_t digest;  // hash of the contents, valid only if 'has_digest' is set
+    int has_digest;  // digests are only computed once another member of the same size turns up
+    const char *data;  // contents already in the archive (mapped), NULL to read them from 'name'
+    int next_size;  // next entry of the same size bucket, -1 at the end
+    int next_name;  // next entry of the same name bucket, -1 at the end
+} dedup_entry_t;
+
+// Members of an archive indexed by size and by name, for finding repeated contents
+// Entries are only ever added; replacing a name just clears the old entry's 'name'.
+typedef struct {
+    dedup_entry_t *entries;
+    int count;
+    int capacity;
+    int *size_buckets;  // first entry of each size bucket, -1 for empty buckets
+    int *name_buckets;  // first entry of each name bucket, -1 for empty buckets
+    int num_buckets;  // always 0 or a power of 2
+} dedup_index_t;
+
+// Initialize a new, empty index
+void dedup_index_init(dedup_index_t *index);
+
+// Free all memory associated with an index
+void dedup_index_clear(dedup_index_t *index);
+
+// Add a member of 'size' bytes named 'name', with its contents at 'data' (or NULL, see above)
+// Any earlier entry of the same name is dropped, since a link to that name would now refer
+// to the new member.
+// Returns the new entry's position in 'entries', or -1 if memory could not be allocated
+int dedup_index_add(dedup_index_t *index, const char *name, off_t size, const char *data);
+
+// Drop the entry of the same name as a member that can't be referred to (a directory, a link...)
+void dedup_index_forget(dedup_index_t *index, const char *name);
+
+// Get the first entry with contents of 'size' bytes, newest first
+// Entries whose 'name' is NULL are included and must be skipped by the caller.
+// Returns the entry's position in 'entries', or -1 if there is none
+int dedup_index_first(const dedup_index_t *index, off_t size);
+
+// Get the entry after entry 'i' with contents of the same size
+// Returns the entry's position in 'entries', or -1 if there is none
+int dedup_index_next(const dedup_index_t *index, int i);
+
+#endif
@@ -0,0 +1,252 @@
+#include <pthread.h>
+#include <string.h>
+#if defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+
+#include "digest.h"
+
+// Primes of the XXH64 specification
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3 0x165667B19E3779F9ULL
+#define PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define PRIME64_5 0x27D4EB2F165667C5ULL
+
+static inline uint64_t rotl64(uint64_t value, int bits) {
+    return (value << bits) | (value >> (64 - bits));
+}
+
+// Words are read little-endian, whatever the byte order of the machine
+static inline uint64_t read64(const unsigned char *p) {
+    uint64_t value = 0;
+    for (int i = 7; i >= 0; i--) {
+        value = (value << 8) | p[i];
+    }
+    return value;
+}
+
+static inline uint32_t read32(const unsigned char *p) {
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static inline uint64_t xxh64_round(uint64_t acc, uint64_t input) {
+    acc += input * PRIME64_2;
+    acc = rotl64(acc, 31);
+    return acc * PRIME64_1;
+}
+
+static inline uint64_t xxh64_merge_round(uint64_t acc, uint64_t value) {
+    acc ^= xxh64_round(0, value);
+    return acc * PRIME64_1 + PRIME64_4;
+}
+
+/*
+ * Feeds whole 32-byte stripes from 'data' into the four lanes
+ * Returns the number of bytes consumed, 'len' rounded down to a multiple of 32
+ */
+static size_t consume_stripes(uint64_t acc[4], const unsigned char *data, size_t len) {
+    size_t pos = 0;
+    for (; pos + 32 <= len; pos += 32) {
+        acc[0] = xxh64_round(acc[0], read64(data + pos));
+        acc[1] = xxh64_round(acc[1], read64(data + pos + 8));
+        acc[2] = xxh64_round(acc[2], read64(data + pos + 16));
+        acc[3] = xxh64_round(acc[3], read64(data + pos + 24));
+    }
+    return pos;
+}
+
+void xxh64_init(xxh64_state_t *state, uint64_t seed) {
+    state->total_len = 0;
+    state->acc[0] = seed + PRIME64_1 + PRIME64_2;
+    state->acc[1] = seed + PRIME64_2;
+    state->acc[2] = seed;
+    state->acc[3] = seed - PRIME64_1;
+    state->buffered = 0;
+    state->seed = seed;
+}
+
+void xxh64_update(xxh64_state_t *state, const void *data, size_t len) {
+    const unsigned char *bytes = data;
+    state->total_len += len;
+    if (state->buffered + len < sizeof(state->buffer)) {  // not enough for a stripe yet
+        memcpy(state->buffer + state->buffered, bytes, len);
+        state->buffered += len;
+        return;
+    }
+    if (state->buffered > 0) {  // complete the carried-over stripe first
+        size_t fill = sizeof(state->buffer) - state->buffered;
+        memcpy(state->buffer + state->buffered, bytes, fill);
+        consume_stripes(state->acc, state->buffer, sizeof(state->buffer));
+        bytes += fill;
+        len -= fill;
+        state->buffered = 0;
+    }
+    size_t used = consume_stripes(state->acc, bytes, len);
+    memcpy(state->buffer, bytes + used, len - used);
+    state->buffered = len - used;
+}
+
+uint64_t xxh64_final(const xxh64_state_t *state) {
+    uint64_t hash;
+    if (state->total_len >= 32) {
+        const uint64_t *acc = state->acc;
+        hash = rotl64(acc[0], 1) + rotl64(acc[1], 7) + rotl64(acc[2], 12) + rotl64(acc[3], 18);
+        for (int i = 0; i < 4; i++) {
+            hash = xxh64_merge_round(hash, acc[i]);
+        }
+    } else {
+        hash = state->seed + PRIME64_5;
+    }
+    hash += state->total_len;
+
+    // The tail that didn't fill a stripe: 8 bytes, then 4, then single bytes at a time
+    const unsigned char *p = state->buffer;
+    size_t left = state->buffered;
+    for (; left >= 8; p += 8, left -= 8) {
+        hash ^= xxh64_round(0, read64(p));
+        hash = rotl64(hash, 27) * PRIME64_1 + PRIME64_4;
+    }
+    if (left >= 4) {
+        hash ^= (uint64_t)read32(p) * PRIME64_1;
+        hash = rotl64(hash, 23) * PRIME64_2 + PRIME64_3;
+        p += 4;
+        left -= 4;
+    }
+    for (; left > 0; p++, left--) {
+        hash ^= *p * PRIME64_5;
+        hash = rotl64(hash, 11) * PRIME64_1;
+    }
+
+    // Final avalanche, so every input bit affects every output bit
+    hash ^= hash >> 33;
+    hash *= PRIME64_2;
+    hash ^= hash >> 29;
+    hash *= PRIME64_3;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+uint64_t xxh64(const void *data, size_t len, uint64_t seed) {
+    xxh64_state_t state;
+    xxh64_init(&state, seed);
+    xxh64_update(&state, data, len);
+    return xxh64_final(&state);
+}
+
+// CRC32C (Castagnoli) polynomial, bit-reversed as the reflected CRC is computed
+#define CRC32C_POLY 0x82F63B78u
+
+// Tables for the software CRC32C: entry [k][b] is the CRC of byte 'b' followed by 'k' zero bytes
+static uint32_t crc32c_table[8][256];
+static int crc32c_hardware;  // nonzero if the CPU has CRC32C instructions
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+static void crc32c_setup(void) {
+    for (int b = 0; b < 256; b++) {
+        uint32_t crc = b;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+        }
+        crc32c_table[0][b] = crc;
+    }
+    for (int b = 0; b < 256; b++) {
+        for (int k = 1; k < 8; k++) {
+            uint32_t prev = crc32c_table[k - 1][b];
+            crc32c_table[k][b] = (prev >> 8) ^ crc32c_table[0][prev & 0xff];
+        }
+    }
+#if defined(__x86_64__)
+    crc32c_hardware = __builtin_cpu_supports("sse4.2");
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+    crc32c_hardware = 1;
+#endif
+}
+
+/*
+ * CRC32C of 'len' bytes at 'p' without the initial and final inversion, eight bytes at a time
+ * through the sliced tables
+ */
+static uint32_t crc32c_software(uint32_t crc, const unsigned char *p, size_t len) {
+    for (; len >= 8; p += 8, len -= 8) {
+        uint64_t word = read64(p) ^ crc;
+        crc = crc32c_table[7][word & 0xff] ^ crc32c_table[6][(word >> 8) & 0xff]
+            ^ crc32c_table[5][(word >> 16) & 0xff] ^ crc32c_table[4][(word >> 24) & 0xff]
+            ^ crc32c_table[3][(word >> 32) & 0xff] ^ crc32c_table[2][(word >> 40) & 0xff]
+            ^ crc32c_table[1][(word >> 48) & 0xff] ^ crc32c_table[0][word >> 56];
+    }
+    for (; len > 0; p++, len--) {
+        crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *p) & 0xff];
+    }
+    return crc;
+}
+
+#if defined(__x86_64__)
+/*
+ * Same as crc32c_software, with the SSE4.2 crc32 instruction (one 8-byte word per instruction)
+ */
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hardware_update(uint32_t crc, const unsigned char *p, size_t len) {
+    uint64_t crc64 = crc;
+    for (; len >= 8; p += 8, len -= 8) {
+        uint64_t word;
+        memcpy(&word, p, sizeof(word));  // x86 is little-endian, as the CRC expects
+        crc64 = __builtin_ia32_crc32di(crc64, word);
+    }
+    crc = (uint32_t)crc64;
+    for (; len > 0; p++, len--) {
+        crc = __builtin_ia32_crc32qi(crc, *p);
+    }
+    return crc;
+}
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+static uint32_t crc32c_hardware_update(uint32_t crc, const unsigned char *p, size_t len) {
+    for (; len >= 8; p += 8, len -= 8) {
+        uint64_t word;
+        memcpy(&word, p, sizeof(word));
+        crc = __crc32cd(crc, word);
+    }
+    for (; len > 0; p++, len--) {
+        crc = __crc32cb(crc, *p);
+    }
+    return crc;
+}
+#endif
+
+uint32_t crc32c_update(uint32_t crc, const void *data, size_t len) {
+    pthread_once(&crc32c_once, crc32c_setup);
+    crc = ~crc;
+#if defined(__x86_64__) || (defined(__aarch64__) && defined(__ARM_FEATURE_CRC32))
+    if (crc32c_hardware) {
+        return ~crc32c_hardware_update(crc, data, len);
+    }
+#endif
+    return ~crc32c_software(crc, data, len);
+}
+
+/*
+ * Multiplies the polynomials 'a' and 'b' modulo the CRC32C polynomial, both bit-reversed
+ */
+static uint32_t multiply_mod_poly(uint32_t a, uint32_t b) {
+    uint32_t product = 0;
+    for (uint32_t bit = 1u << 31; bit != 0; bit >>= 1) {
+        if (a & bit) {
+            product ^= b;
+        }
+        b = b & 1 ? (b >> 1) ^ CRC32C_POLY : b >> 1;
+    }
+    return product;
+}
+
+uint32_t crc32c_combine(uint32_t crc1, uint32_t crc2, uint64_t len2) {
+    // Appending 'len2' bytes multiplies the first CRC by x^(8 * len2); built from squarings of x^8
+    uint32_t power = 1u << 23;  // x^8
+    uint32_t shift = 1u << 31;  // x^0
+    for (; len2 != 0; len2 >>= 1) {
+        if (len2 & 1) {
+            shift = multiply_mod_poly(power, shift);
+        }
+        power = multiply_mod_poly(power, power);
+    }
+    return multiply_mod_poly(shift, crc1) ^ crc2;
+}
@@ -0,0 +1,36 @@
+#ifndef _DIGEST_H
+#define _DIGEST_H
+#include <stddef.h>
+#include <stdint.h>
+
+// State of an XXH64 hash computed over data that arrives in pieces
+typedef struct {
+    uint64_t total_len;
+    uint64_t acc[4];  // the four lanes, each fed every fourth 8-byte word of a 32-byte stripe
+    unsigned char buffer[32];  // bytes of an incomplete stripe carried over to the next update
+    size_t buffered;
+    uint64_t seed;
+} xxh64_state_t;
+
+// Start a new XXH64 hash with the given seed
+void xxh64_init(xxh64_state_t *state, uint64_t seed);
+
+// Add 'len' bytes of 'data' to the hash
+void xxh64_update(xxh64_state_t *state, const void *data, size_t len);
+
+// Get the hash of everything added so far; the state may be updated further afterwards
+uint64_t xxh64_final(const xxh64_state_t *state);
+
+// Get the XXH64 hash of 'len' bytes of 'data' in one call
+uint64_t xxh64(const void *data, size_t len, uint64_t seed);
+
+// Continue the CRC32C (Castagnoli) checksum 'crc' over 'len' bytes of 'data'
+// Start from 0; the CRC of a whole buffer is the same however it is split between calls.
+// Uses the CPU's CRC32C instructions (SSE4.2 on x86-64, the CRC extension on ARMv8) when it has them.
+uint32_t crc32c_update(uint32_t crc, const void *data, size_t len);
+
+// Get the CRC32C of two pieces of data back to back from 'crc1', the CRC of the first piece,
+// and 'crc2', the CRC of the second piece of 'len2' bytes, so pieces can be checked in parallel
+uint32_t crc32c_combine(uint32_t crc1, uint32_t crc2, uint64_t len2);
+
+#endif
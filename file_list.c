@@ -1,69 +1,213 @@
+#include <errno.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "file_list.h"
 
+#define MIN_CHUNK_NODES 64
+#define MAX_CHUNK_NODES 65536
+#define MIN_TABLE_CAPACITY 64
+#define MIN_BLOCK_SIZE 4096
+#define MAX_BLOCK_SIZE (1 << 20)
+
+// Each name in an arena block starts with its length, and names are padded to keep it aligned
+#define NAME_ALIGN sizeof(uint32_t)
+
+void name_arena_init(name_arena_t *arena) {
+    arena->blocks = NULL;
+}
+
+const char *name_arena_add(name_arena_t *arena, const char *name, size_t len) {
+    if (len > UINT32_MAX) {
+        errno = ENAMETOOLONG;
+        return NULL;
+    }
+    uint32_t stored_len = len;
+    size_t entry_size = (sizeof(stored_len) + len + 1 + NAME_ALIGN - 1) / NAME_ALIGN * NAME_ALIGN;
+    name_block_t *block = arena->blocks;
+    if (block == NULL || block->capacity - block->used < entry_size) {
+        // Blocks double up to a limit; a name longer than that gets a block of its own
+        size_t capacity = block == NULL ? MIN_BLOCK_SIZE : block->capacity * 2;
+        if (capacity > MAX_BLOCK_SIZE) {
+            capacity = MAX_BLOCK_SIZE;
+        }
+        if (capacity < entry_size) {
+            capacity = entry_size;
+        }
+        name_block_t *new_block = malloc(sizeof(name_block_t) + capacity);
+        if (new_block == NULL) {
+            return NULL;
+        }
+        new_block->next = block;
+        new_block->used = 0;
+        new_block->capacity = capacity;
+        arena->blocks = new_block;
+        block = new_block;
+    }
+    char *entry = block->data + block->used;
+    memcpy(entry, &stored_len, sizeof(stored_len));
+    memcpy(entry + sizeof(stored_len), name, len);
+    entry[sizeof(stored_len) + len] = '\0';
+    block->used += entry_size;
+    return entry + sizeof(stored_len);
+}
+
+void name_arena_clear(name_arena_t *arena) {
+    name_block_t *current = arena->blocks;
+    while (current != NULL) {
+        name_block_t *to_free = current;
+        current = current->next;
+        free(to_free);
+    }
+    name_arena_init(arena);
+}
+
+/*
+ * 64-bit FNV-1a hash of the 'len' bytes of a name, cheap and good enough to spread file names across the table
+ */
+static uint64_t hash_name(const char *name, size_t len) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (const unsigned char *c = (const unsigned char *)name; c < (const unsigned char *)name + len; c++) {
+        hash ^= *c;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+/*
+ * Returns the table slot holding 'name' ('len' bytes), or the empty slot where it would go
+ * Stored names carry their length, so most mismatches are found without comparing any text.
+ * The table must have at least one empty slot.
+ */
+static node_t **find_slot(node_t **table, int capacity, const char *name, size_t len) {
+    size_t mask = capacity - 1;
+    size_t i = hash_name(name, len) & mask;
+    while (table[i] != NULL && (name_arena_length(table[i]->name) != len || memcmp(table[i]->name, name, len) != 0)) {
+        i = (i + 1) & mask;  // linear probing
+    }
+    return &table[i];
+}
+
+/*
+ * Doubles the hash table (or creates it), reinserting every distinct name
+ * Returns 0 on success, 1 if memory could not be allocated
+ */
+static int grow_table(file_list_t *list) {
+    int capacity = list->table_capacity == 0 ? MIN_TABLE_CAPACITY : list->table_capacity * 2;
+    node_t **table = calloc(capacity, sizeof(node_t *));
+    if (table == NULL) {
+        return 1;
+    }
+    for (int i = 0; i < list->table_capacity; i++) {
+        if (list->table[i] != NULL) {
+            const char *name = list->table[i]->name;
+            *find_slot(table, capacity, name, name_arena_length(name)) = list->table[i];
+        }
+    }
+    free(list->table);
+    list->table = table;
+    list->table_capacity = capacity;
+    return 0;
+}
+
+/*
+ * Hands out the next unused node, starting a new, larger chunk when the current one is full
+ * Returns NULL if memory could not be allocated
+ */
+static node_t *allocate_node(file_list_t *list) {
+    node_chunk_t *chunk = list->chunks;
+    if (chunk == NULL || chunk->used == chunk->capacity) {
+        int capacity = chunk == NULL ? MIN_CHUNK_NODES : chunk->capacity * 2;
+        if (capacity > MAX_CHUNK_NODES) {
+            capacity = MAX_CHUNK_NODES;
+        }
+        node_chunk_t *new_chunk = malloc(sizeof(node_chunk_t) + capacity * sizeof(node_t));
+        if (new_chunk == NULL) {
+            return NULL;
+        }
+        new_chunk->next = chunk;
+        new_chunk->used = 0;
+        new_chunk->capacity = capacity;
+        list->chunks = new_chunk;
+        chunk = new_chunk;
+    }
+    return &chunk->nodes[chunk->used++];
+}
+
 void file_list_init(file_list_t *list) {
     list->head = NULL;
+    list->tail = NULL;
     list->size = 0;
+    list->table = NULL;
+    list->table_capacity = 0;
+    list->table_used = 0;
+    list->chunks = NULL;
+    name_arena_init(&list->names);
 }
 
 int file_list_add(file_list_t *list, const char *file_name) {
-    if (list->head == NULL) {
-        list->head = malloc(sizeof(node_t));
-        if (list->head == NULL) {
-            return 1;
-        }
-        strncpy(list->head->name, file_name, MAX_NAME_LEN);
-        list->head->next = NULL;
-        list->size = 1;
-        return 0;
+    // Keep the table at most half full so probe sequences stay short
+    if (2 * (list->table_used + 1) > list->table_capacity && grow_table(list) != 0) {
+        return 1;
     }
-
-    node_t *current = list->head;
-    while (current->next != NULL) {
-        current = current->next;
+    node_t *node = allocate_node(list);
+    if (node == NULL) {
+        return 1;
     }
-    current->next = malloc(sizeof(node_t));
-    if (current->next == NULL) {
+    size_t len = strlen(file_name);
+    node->name = name_arena_add(&list->names, file_name, len);
+    if (node->name == NULL) {
+        list->chunks->used--;  // hand the node back, it was the last one given out
         return 1;
     }
-    strncpy(current->next->name, file_name, MAX_NAME_LEN);
-    current->next->next = NULL;
+    node->next = NULL;
+
+    if (list->tail == NULL) {
+        list->head = node;
+    } else {
+        list->tail->next = node;
+    }
+    list->tail = node;
     list->size++;
+
+    node_t **slot = find_slot(list->table, list->table_capacity, node->name, len);
+    if (*slot == NULL) {  // repeated names stay in the list but are indexed only once
+        *slot = node;
+        list->table_used++;
+    }
     return 0;
 }
 
 int file_list_contains(const file_list_t *list, const char *file_name) {
-    node_t *current = list->head;
-    while (current != NULL) {
-        if (strcmp(current->name, file_name) == 0) {
-            return 1;
-        }
-        current = current->next;
+    if (list->table_capacity == 0) {
+        return 0;
     }
-    return 0;
+    return *find_slot(list->table, list->table_capacity, file_name, strlen(file_name)) != NULL;
 }
 
 int file_list_is_subset(const file_list_t *l1, const file_list_t *l2) {
-    // This approach is not particularly efficient
-    node_t *current = l1->head;
-    while (current != NULL) {
-        if (!file_list_contains(l2, current->name)) {
+    // One constant-time lookup per distinct element of l1
+    for (int i = 0; i < l1->table_capacity; i++) {
+        if (l1->table[i] == NULL) {
+            continue;
+        }
+        const char *name = l1->table[i]->name;  // its length is stored, no need to measure it again
+        if (l2->table_capacity == 0 || *find_slot(l2->table, l2->table_capacity, name, name_arena_length(name)) == NULL) {
             return 0;
         }
-        current = current->next;
     }
     return 1;
 }
 
 void file_list_clear(file_list_t *list) {
-    node_t *current = list->head;
+    node_chunk_t *current = list->chunks;
     while (current != NULL) {
-        node_t *to_free = current;
+        node_chunk_t *to_free = current;
         current = current->next;
         free(to_free);
     }
-    list->head = NULL;
-    list->size = 0;
+    free(list->table);
+    name_arena_clear(&list->names);
+    file_list_init(list);
 }
@@ -1,20 +1,69 @@
 #ifndef _FILE_LIST_H
 #define _FILE_LIST_H
 
-#define MAX_NAME_LEN 32
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+// Block of names stored back to back, each one a 32-bit length, the name and its terminator
+// (padded so the next length stays aligned)
+typedef struct name_block {
+    struct name_block *next;
+    size_t used;
+    size_t capacity;
+    char data[];
+} name_block_t;
+
+// Storage for names of any length in a few large blocks, freed all at once
+typedef struct {
+    name_block_t *blocks;  // most recently allocated block first
+} name_arena_t;
 
 //  Definition of each node in the linked list
 typedef struct node {
-    char name[MAX_NAME_LEN];
+    const char *name;  // stored in the list's name arena
     struct node *next;
 } node_t;
 
+// Block of nodes allocated together, so adding a name rarely calls malloc
+typedef struct node_chunk {
+    struct node_chunk *next;
+    int used;
+    int capacity;
+    node_t nodes[];
+} node_chunk_t;
+
 // Linked list definition
+// Nodes keep insertion order through 'head'/'next', while 'table' is an
+// open-addressed hash index over the distinct names for constant-time lookups
 typedef struct {
     node_t *head;
+    node_t *tail;  // last node, so adding doesn't walk the list
     int size;
+    node_t **table;  // first node holding each distinct name, NULL for empty slots
+    int table_capacity;  // number of slots in 'table', always 0 or a power of 2
+    int table_used;  // number of non-empty slots in 'table'
+    node_chunk_t *chunks;  // most recently allocated chunk first
+    name_arena_t names;  // the text of every name in the list
 } file_list_t;
 
+// Initialize a new, empty arena
+void name_arena_init(name_arena_t *arena);
+
+// Copy the 'len' bytes of 'name' into the arena, followed by a terminator
+// Returns the copy, which stays valid until the arena is cleared, or NULL if memory could not be allocated
+const char *name_arena_add(name_arena_t *arena, const char *name, size_t len);
+
+// Get the length of a name returned by name_arena_add, without scanning it
+static inline size_t name_arena_length(const char *name) {
+    uint32_t len;
+    memcpy(&len, name - sizeof(len), sizeof(len));
+    return len;
+}
+
+// Free every name in the arena
+void name_arena_clear(name_arena_t *arena);
+
 // Initialize a new, empty list
 void file_list_init(file_list_t *list);
 
@@ -33,4 +82,4 @@ int file_list_contains(const file_list_t *list, const char *file_name);
 // Returns 1 if l1 is a subset of l2, 0 otherwise
 int file_list_is_subset(const file_list_t *l1, const file_list_t *l2);
 
-#endif
\ No newline at end of file
+#endif
@@ -1,550 +1,4494 @@
+#define _GNU_SOURCE  // for copy_file_range
+#include <errno.h>
 #include <fcntl.h>
 #include <grp.h>
+#include <limits.h>
 #include <math.h>
+#include <pthread.h>
 #include <pwd.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
 #include <sys/stat.h>
 #include <sys/sysmacros.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#include "archive_index.h"
+#include "archive_stream.h"
+#include "dedup_index.h"
+#include "digest.h"
 #include "minitar.h"
+#include "run_stats.h"
+#include "sparse_map.h"
+#include "tree_walk.h"
+#include "uring_copy.h"
 
 #define NUM_TRAILING_BLOCKS 2
 #define MAX_MSG_LEN 512
+#define COPY_BUFFER_SIZE (1 << 20)  // fallback copy buffer, large enough to amortize read/write calls
+#define COPY_BUFFER_ALIGN 4096
+
+// Location of one member inside an archive, as found by a header-only scan
+typedef struct {
+    const char *name;  // full name, in the name arena of the scan that found the member
+    off_t header_offset;  // offset of the member's first header, its extended header if it has one
+    off_t data_offset;  // offset of the first byte of the member's contents
+    off_t size;  // size of the contents in bytes as stored in the archive, excluding padding
+    off_t real_size;  // size of the file the member extracts to, larger than 'size' for sparse members
+    int sparse;  // nonzero if the contents are a GNU sparse map (format 1.0) followed by the data runs
+    int old_sparse;  // nonzero if stored in an older GNU sparse format (typeflag 'S', or 0.0 and 0.1), which can't be extracted
+    char typeflag;  // type of the member, REGTYPE or DIRTYPE for the ones minitar writes
+    int has_crc32c;  // nonzero if an extended header recorded the CRC32C of the stored contents
+    uint32_t crc32c;
+    time_t mtime;  // modification time recorded in the header
+    int order;  // position of the member's header within the archive
+} member_t;
+
+// A read-only view of a whole archive file
+typedef struct {
+    const char *data;  // first byte of the mapping, NULL for an empty archive
+    off_t size;  // length of the archive in bytes
+} archive_map_t;
+
+archive_options_t archive_options = {1, 0, COMPRESS_NONE, -1, 0, 0, 0, 0, 0};
+
+// Offset and length of the chksum field within a header block
+#define CHKSUM_OFFSET 148
+
+// Offset of the flag saying another block of the sparse map follows, in an old GNU sparse
+// header and in each of its extension blocks
+#define GNU_SPARSE_EXTENDED_OFFSET 482
+#define GNU_SPARSE_EXTENSION_EXTENDED_OFFSET 504
+#define CHKSUM_LEN 8
+
+/*
+ * Sums the 512 bytes of a header block as unsigned values, counting the chksum field as blanks
+ * Works on eight bytes at a time: the even and odd bytes of each word are added into four
+ * 16-bit lanes, which can't overflow over the 64 words of one block (64 * 2 * 255 < 65536).
+ */
+static unsigned header_checksum(const tar_header *header) {
+    const unsigned char *bytes = (const unsigned char *)header;
+    const uint64_t low_bytes = 0x00FF00FF00FF00FFULL;
+    uint64_t lanes = 0;
+    for (int i = 0; i < BLOCK_SIZE; i += 8) {
+        uint64_t word;
+        memcpy(&word, bytes + i, sizeof(word));  // compiles to a plain (unaligned) load
+        lanes += (word & low_bytes) + ((word >> 8) & low_bytes);
+    }
+    // add up the four lanes; their total (up to 512 * 255) needs more than 16 bits
+    unsigned sum = (unsigned)((lanes & 0xFFFF) + ((lanes >> 16) & 0xFFFF) + ((lanes >> 32) & 0xFFFF) + (lanes >> 48));
+    for (int i = CHKSUM_OFFSET; i < CHKSUM_OFFSET + CHKSUM_LEN; i++) {
+        sum += ' ' - bytes[i];
+    }
+    return sum;
+}
 
 /*
  * Helper function to compute the checksum of a tar header block
  * Performs a simple sum over all bytes in the header in accordance with POSIX
- * standard for tar file structure.
+ * standard for tar file structure, treating each byte as unsigned.
  */
 void compute_checksum(tar_header *header) {
-    // Have to initially set header's checksum to "all blanks"
-    memset(header->chksum, ' ', 8);
-    unsigned sum = 0;
-    char *bytes = (char *)header;
-    for (int i = 0; i < sizeof(tar_header); i++) {
-        sum += bytes[i];
+    snprintf(header->chksum, CHKSUM_LEN, "%07o", header_checksum(header));
+}
+
+// Number of distinct owners and groups whose names are remembered during one run
+#define NAME_CACHE_SIZE 64
+
+// Remembers the names of recently seen user or group IDs, so that archiving many files
+// owned by the same user doesn't repeat a directory (NSS) lookup for every file
+typedef struct {
+    unsigned ids[NAME_CACHE_SIZE];
+    char names[NAME_CACHE_SIZE][32];
+    int count;  // number of filled slots
+    int next;  // slot reused once the cache is full
+} name_cache_t;
+
+static name_cache_t owner_cache;
+static name_cache_t group_cache;
+static pthread_mutex_t name_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Copies the user (is_group 0) or group (is_group 1) name of 'id' into 'name', a 32-byte header field
+ * Only the first lookup of each ID goes to the system's user and group databases.
+ * Returns 0 on success or -1 if no such user or group exists
+ */
+static int lookup_id_name(unsigned id, int is_group, char *name) {
+    name_cache_t *cache = is_group ? &group_cache : &owner_cache;
+    pthread_mutex_lock(&name_cache_lock);
+    for (int i = 0; i < cache->count; i++) {
+        if (cache->ids[i] == id) {
+            strncpy(name, cache->names[i], 32);
+            pthread_mutex_unlock(&name_cache_lock);
+            return 0;
+        }
+    }
+    // getpwuid and getgrgid share static buffers, so the lookup also stays under the lock
+    const char *found = NULL;
+    uint64_t start = stats_start();
+    if (is_group) {
+        struct group *grp = getgrgid(id);
+        found = grp == NULL ? NULL : grp->gr_name;
+    } else {
+        struct passwd *pwd = getpwuid(id);
+        found = pwd == NULL ? NULL : pwd->pw_name;
+    }
+    stats_add(STATS_METADATA, start, 0, 1);
+    if (found == NULL) {
+        pthread_mutex_unlock(&name_cache_lock);
+        return -1;
+    }
+    int slot = cache->count < NAME_CACHE_SIZE ? cache->count++ : cache->next++ % NAME_CACHE_SIZE;
+    cache->ids[slot] = id;
+    strncpy(cache->names[slot], found, 32);
+    strncpy(name, found, 32);
+    pthread_mutex_unlock(&name_cache_lock);
+    return 0;
+}
+
+/*
+ * Encodes 'value' into the numeric header field 'field' of 'len' bytes
+ * Writes 0-padded octal with a NUL terminator when the value fits in len - 1 digits.
+ * Larger (or negative) values use the GNU base-256 encoding understood by modern tars:
+ * the first byte is 0x80 (0xFF when negative) and the remaining bytes hold the value in
+ * big-endian two's complement. This is what lets sizes of 8 GiB and more fit in 12 bytes.
+ */
+static void format_numeric(char *field, size_t len, int64_t value) {
+    if (value >= 0 && value < (int64_t)1 << (3 * (len - 1))) {
+        snprintf(field, len, "%0*llo", (int)(len - 1), (unsigned long long)value);
+        return;
+    }
+    uint64_t bits = value;
+    for (size_t i = len - 1; i > 0; i--) {
+        field[i] = bits & 0xFF;
+        bits >>= 8;
+    }
+    field[0] = value < 0 ? 0xFF : 0x80;
+}
+
+/*
+ * Returns 1 if the member for 'file_name' gets a slash appended to its name: directory names
+ * end in a slash, as in other tar implementations
+ */
+static int needs_trailing_slash(const char *file_name, int is_dir) {
+    size_t len = strlen(file_name);
+    return is_dir && len > 0 && file_name[len - 1] != '/';
+}
+
+/*
+ * Finds where to split a member name of 'len' bytes, the first 'len' bytes of which are at
+ * 'name' (a slash may follow), between the prefix and name fields of a ustar header
+ * Returns the length of the prefix, 0 if the whole name fits the name field, or -1 if no
+ * slash leaves at most 155 bytes before it and between 1 and 100 after it
+ */
+static int split_member_name(const char *name, size_t len) {
+    const size_t name_field = sizeof(((tar_header *)0)->name);
+    const size_t prefix_field = sizeof(((tar_header *)0)->prefix);
+    if (len <= name_field) {
+        return 0;
+    }
+    // The last slash that can start the name field leaves the shortest name, so it's the only one to try;
+    // a directory's trailing slash can't be it, the name field would be left empty
+    for (size_t i = len - 2 < prefix_field ? len - 2 : prefix_field; i > 0; i--) {
+        if (name[i] == '/') {
+            return len - i - 1 <= name_field ? (int)i : -1;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Returns 1 if the name of the member for 'file_name' fits in the name and prefix fields of
+ * its header, 0 if it has to be recorded in an extended header's path record as well
+ */
+static int name_fits_header(const char *file_name, int is_dir) {
+    return split_member_name(file_name, strlen(file_name) + needs_trailing_slash(file_name, is_dir)) != -1;
+}
+
+/*
+ * Sets the name and prefix fields of 'header' to the member name for 'file_name', split at a
+ * slash if it is longer than the name field
+ * A name that doesn't fit either way is cut short; see name_fits_header.
+ */
+static void set_header_name(tar_header *header, const char *file_name, int is_dir) {
+    size_t len = strlen(file_name);
+    int slash = needs_trailing_slash(file_name, is_dir);
+    int prefix_len = split_member_name(file_name, len + slash);
+    if (prefix_len > 0) {
+        memcpy(header->prefix, file_name, prefix_len);
+        file_name += prefix_len + 1;
+        len -= prefix_len + 1;
+    }
+    if (len > sizeof(header->name)) {
+        len = sizeof(header->name);
+    }
+    memcpy(header->name, file_name, len);
+    if (slash && len < sizeof(header->name)) {
+        header->name[len] = '/';
     }
-    snprintf(header->chksum, 8, "%07o", sum);
 }
 
 /*
  * Populates a tar header block pointed to by 'header' with metadata about
- * the file identified by 'file_name'.
+ * the file identified by 'file_name', as already collected into 'stat_buf'
+ * by stat or fstat.
  * Returns 0 on success or -1 if an error occurs
  */
-int fill_tar_header(tar_header *header, const char *file_name) {
+int fill_tar_header(tar_header *header, const char *file_name, const struct stat *stat_buf) {
     memset(header, 0, sizeof(tar_header));
     char err_msg[MAX_MSG_LEN];
-    struct stat stat_buf;
-    // stat is a system call to inspect file metadata
-    if (stat(file_name, &stat_buf) != 0) {
-        snprintf(err_msg, MAX_MSG_LEN, "Failed to stat file %s", file_name);
-        perror(err_msg);
-        return -1;
+
+    int is_dir = S_ISDIR(stat_buf->st_mode);
+    set_header_name(header, file_name, is_dir); // Name of the file, split between name and prefix if it is long
+    snprintf(header->mode, 8, "%07o", stat_buf->st_mode & 07777); // Permissions for file, 0-padded octal
+
+    format_numeric(header->uid, sizeof(header->uid), stat_buf->st_uid); // Owner ID of the file, 0-padded octal
+    format_numeric(header->gid, sizeof(header->gid), stat_buf->st_gid); // Group ID of the file, 0-padded octal
+    if (!archive_options.numeric_owner) {  // with --numeric-owner, uname and gname stay empty
+        // Owner name of the file, null-terminated string
+        if (lookup_id_name(stat_buf->st_uid, 0, header->uname) != 0) {
+            snprintf(err_msg, MAX_MSG_LEN, "Failed to look up owner name of file %s", file_name);
+            perror(err_msg);
+            return -1;
+        }
+        // Group name of the file, null-terminated string
+        if (lookup_id_name(stat_buf->st_gid, 1, header->gname) != 0) {
+            snprintf(err_msg, MAX_MSG_LEN, "Failed to look up group name of file %s", file_name);
+            perror(err_msg);
+            return -1;
+        }
+    }
+
+    uint64_t start = stats_start();  // owner and group lookups count as metadata, the rest as header building
+    // File size, octal or base-256 from 8 GiB; directories have no contents of their own
+    format_numeric(header->size, sizeof(header->size), is_dir ? 0 : stat_buf->st_size);
+    format_numeric(header->mtime, sizeof(header->mtime), stat_buf->st_mtime); // Modification time, octal or base-256
+    header->typeflag = is_dir ? DIRTYPE : REGTYPE; // File type, a regular file or a directory
+    strncpy(header->magic, MAGIC, 6); // Special, standardized sequence of bytes
+    memcpy(header->version, "00", 2); // A bit weird, sidesteps null termination
+    snprintf(header->devmajor, 8, "%07o", major(stat_buf->st_dev)); // Major device number, 0-padded octal
+    snprintf(header->devminor, 8, "%07o", minor(stat_buf->st_dev)); // Minor device number, 0-padded octal
+
+    compute_checksum(header);
+    stats_add(STATS_HEADER, start, 0, 0);
+    return 0;
+}
+
+/*
+ * Appends the octal digits that start the 'len' bytes (at most 8) at 'digits' to '*value'
+ * All the bytes are checked and combined at once as one 64-bit word, without a branch per digit.
+ * Returns the number of digits appended, less than 'len' if a byte that isn't one ended them
+ */
+static size_t append_octal_digits(const char *digits, size_t len, uint64_t *value) {
+    uint64_t word = 0;
+    memcpy(&word, digits, len);  // missing bytes stay NUL, which ends the digits
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    word = __builtin_bswap64(word);  // first byte lowest, as on little-endian machines
+#endif
+    word ^= 0x3030303030303030ULL;  // '0'..'7' become 0..7, any other byte keeps a bit above the low three
+    uint64_t others = word & 0xF8F8F8F8F8F8F8F8ULL;
+    size_t count = others == 0 ? 8 : __builtin_ctzll(others) / 8;
+    if (count == 0) {
+        return 0;
+    }
+    // Drop the bytes after the digits, leaving the last digit in the top byte and zeros below
+    // the first, then merge neighbours into 6-, 12- and 24-bit values
+    word <<= 8 * (8 - count);
+    word = ((word & 0x00FF00FF00FF00FFULL) << 3) + ((word >> 8) & 0x00FF00FF00FF00FFULL);
+    word = ((word & 0x0000FFFF0000FFFFULL) << 6) + ((word >> 16) & 0x0000FFFF0000FFFFULL);
+    word = ((word & 0x00000000FFFFFFFFULL) << 12) + (word >> 32);
+    *value = (*value << (3 * count)) + word;
+    return count;
+}
+
+/*
+ * Decodes a numeric header field of 'len' bytes
+ * A field whose first byte has the high bit set is in GNU base-256 (see format_numeric).
+ * Otherwise it is 0-padded octal, and decoding stops at the first character that isn't
+ * an octal digit (NUL or space terminators). Digits are decoded 8 at a time, so the
+ * 12-byte size and time fields take two steps.
+ */
+off_t parse_octal(const char *field, size_t len) {
+    const unsigned char *bytes = (const unsigned char *)field;
+    if (bytes[0] & 0x80) {
+        // bit 6 of the first byte is the sign, extend it through the accumulator
+        uint64_t bits = (bytes[0] & 0x40) ? UINT64_MAX : 0;
+        bits = (bits << 6) | (bytes[0] & 0x3F);
+        for (size_t i = 1; i < len; i++) {
+            bits = (bits << 8) | bytes[i];
+        }
+        return (off_t)bits;
+    }
+    uint64_t value = 0;
+    size_t i = 0;
+    while (i < len && field[i] == ' ') {  // some tar implementations pad with leading spaces
+        i++;
     }
+    while (i < len) {
+        size_t chunk = len - i < 8 ? len - i : 8;
+        if (append_octal_digits(field + i, chunk, &value) < chunk) {
+            break;
+        }
+        i += chunk;
+    }
+    return (off_t)value;
+}
+
+/*
+ * Returns 1 if the chksum field of 'header' matches its contents, 0 otherwise
+ * Besides the POSIX unsigned sum, accepts the sum of signed bytes that some older tar
+ * implementations (and earlier versions of minitar) wrote for headers with non-ASCII bytes.
+ */
+int verify_checksum(const tar_header *header) {
+    unsigned stored = parse_octal(header->chksum, sizeof(header->chksum));
+    unsigned sum = header_checksum(header);
+    if (stored == sum) {
+        return 1;
+    }
+    // every byte of 0x80 or above counts 256 less when summed as a signed char
+    const unsigned char *bytes = (const unsigned char *)header;
+    for (int i = 0; i < BLOCK_SIZE; i++) {
+        if (bytes[i] >= 0x80 && (i < CHKSUM_OFFSET || i >= CHKSUM_OFFSET + CHKSUM_LEN)) {
+            sum -= 256;
+        }
+    }
+    return stored == sum;
+}
 
-    strncpy(header->name, file_name, 100); // Name of the file, null-terminated string
-    snprintf(header->mode, 8, "%07o", stat_buf.st_mode & 07777); // Permissions for file, 0-padded octal
+// Longest name a header holds by itself: the prefix field, a slash and the name field
+#define HEADER_NAME_MAX (sizeof(((tar_header *)0)->prefix) + 1 + sizeof(((tar_header *)0)->name))
 
-    snprintf(header->uid, 8, "%07o", stat_buf.st_uid); // Owner ID of the file, 0-padded octal
-    struct passwd *pwd = getpwuid(stat_buf.st_uid); // Look up name corresponding to owner ID
-    if (pwd == NULL) {
-        snprintf(err_msg, MAX_MSG_LEN, "Failed to look up owner name of file %s", file_name);
-        perror(err_msg);
+/*
+ * Copies the name recorded in 'header' to 'buf', of at least HEADER_NAME_MAX + 1 bytes: the
+ * name field, after the prefix field and a slash if the header is a POSIX ustar header with a prefix
+ * Both fields are only NUL-terminated when shorter than their full width. Other formats (such
+ * as old GNU headers) use the prefix bytes for something else, so it is only read from ustar headers.
+ * Returns the length of the name
+ */
+static size_t copy_header_name(const tar_header *header, char *buf) {
+    size_t len = 0;
+    if (memcmp(header->magic, MAGIC, sizeof(MAGIC)) == 0 && header->prefix[0] != '\0') {
+        len = strnlen(header->prefix, sizeof(header->prefix));
+        memcpy(buf, header->prefix, len);
+        buf[len++] = '/';
+    }
+    size_t name_len = strnlen(header->name, sizeof(header->name));
+    memcpy(buf + len, header->name, name_len);
+    len += name_len;
+    buf[len] = '\0';
+    return len;
+}
+
+// Extended header record holding the CRC32C of a member's stored contents, as 8 hex digits
+// Other tars skip keywords they don't know, but GNU tar prints "Ignoring unknown extended header
+// keyword" for each one (it does so for any vendor prefix, SCHILY. and LIBARCHIVE. included)
+#define CRC32C_KEY "MINITAR.crc32c"
+
+// Extended header records that change how the member after them is read
+typedef struct {
+    int sparse_major;  // GNU.sparse.major, -1 if not given
+    int sparse_minor;  // GNU.sparse.minor, -1 if not given
+    off_t real_size;  // GNU.sparse.realsize, the size of the file a sparse member extracts to; -1 if not given
+    off_t size;  // size, overriding the header's size field; -1 if not given
+    const char *name;  // GNU.sparse.name, the real name of a sparse member (not NUL-terminated); NULL if not given
+    size_t name_len;
+    int old_sparse;  // nonzero if a record only used by GNU sparse formats 0.0 and 0.1 was given
+    const char *path;  // path, the member's name when it is too long for its header (not NUL-terminated); NULL if not given
+    size_t path_len;
+    int has_crc32c;  // nonzero if MINITAR.crc32c gave the CRC32C of the member's stored contents
+    uint32_t crc32c;
+} pax_info_t;
+
+static void pax_info_init(pax_info_t *pax) {
+    pax->sparse_major = -1;
+    pax->sparse_minor = -1;
+    pax->real_size = -1;
+    pax->size = -1;
+    pax->name = NULL;
+    pax->name_len = 0;
+    pax->old_sparse = 0;
+    pax->path = NULL;
+    pax->path_len = 0;
+    pax->has_crc32c = 0;
+    pax->crc32c = 0;
+}
+
+/*
+ * Returns 1 if the member with header 'header' and extended header records 'pax' is stored in
+ * a GNU sparse format older than 1.0, whose data runs minitar can't put back in place
+ */
+static int is_old_sparse(const tar_header *header, const pax_info_t *pax) {
+    int format_1_0 = pax->sparse_major == 1 && pax->sparse_minor == 0;
+    return header->typeflag == GNUTYPE_SPARSE || pax->old_sparse || (!format_1_0 && (pax->sparse_major != -1 || pax->sparse_minor != -1));
+}
+
+/*
+ * Returns 1 if the block 'block' of an old GNU sparse member has its flag at 'flag_offset' set,
+ * saying another block of the sparse map follows it
+ */
+static int header_continues_sparse_map(const void *block, int flag_offset) {
+    return ((const char *)block)[flag_offset] != 0;
+}
+
+/*
+ * Reports that member 'name' of archive 'archive_name' is stored in an old GNU sparse format
+ * It is never extracted: its contents are packed data runs, not the file.
+ */
+static void report_old_sparse(const char *name, const char *archive_name) {
+    fprintf(stderr, "Member %s in archive %s is stored in an old GNU sparse format, which minitar can't extract\n", name, archive_name);
+}
+
+/*
+ * Decodes the 'len' characters at 'text' as a nonnegative decimal number into '*value'
+ * Returns 0 on success or -1 if the text isn't such a number (or doesn't fit an off_t)
+ */
+static int parse_decimal(const char *text, size_t len, off_t *value) {
+    off_t result = 0;
+    if (len == 0 || len > 18) {  // at most 18 digits can't overflow
         return -1;
     }
-    strncpy(header->uname, pwd->pw_name, 32); // Owner  name of the file, null-terminated string
+    for (size_t i = 0; i < len; i++) {
+        if (text[i] < '0' || text[i] > '9') {
+            return -1;
+        }
+        result = result * 10 + (text[i] - '0');
+    }
+    *value = result;
+    return 0;
+}
 
-    snprintf(header->gid, 8, "%07o", stat_buf.st_gid); // Group ID of the file, 0-padded octal
-    struct group *grp = getgrgid(stat_buf.st_gid); // Look up name corresponding to group ID
-    if (grp == NULL) {
-        snprintf(err_msg, MAX_MSG_LEN, "Failed to look up group name of file %s", file_name);
-        perror(err_msg);
+/*
+ * Decodes the 'len' characters at 'text' as a 32-bit hexadecimal number into '*value'
+ * Returns 0 on success or -1 if the text isn't exactly 8 hexadecimal digits
+ */
+static int parse_hex32(const char *text, size_t len, uint32_t *value) {
+    uint32_t result = 0;
+    if (len != 8) {
         return -1;
     }
-    strncpy(header->gname, grp->gr_name, 32); // Group name of the file, null-terminated string
+    for (size_t i = 0; i < len; i++) {
+        char c = text[i];
+        int digit = c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 : c >= 'A' && c <= 'F' ? c - 'A' + 10 : -1;
+        if (digit == -1) {
+            return -1;
+        }
+        result = result << 4 | digit;
+    }
+    *value = result;
+    return 0;
+}
 
-    snprintf(header->size, 12, "%011o", (unsigned)stat_buf.st_size); // File size, 0-padded octal
-    snprintf(header->mtime, 12, "%011o", (unsigned)stat_buf.st_mtime); // Modification time, 0-padded octal
-    header->typeflag = REGTYPE; // File type, always regular file in this project
-    strncpy(header->magic, MAGIC, 6); // Special, standardized sequence of bytes
-    memcpy(header->version, "00", 2); // A bit weird, sidesteps null termination
-    snprintf(header->devmajor, 8, "%07o", major(stat_buf.st_dev)); // Major device number, 0-padded octal
-    snprintf(header->devminor, 8, "%07o", minor(stat_buf.st_dev)); // Minor device number, 0-padded octal
+/*
+ * Returns 1 if the 'len' characters at 'key' spell out 'expected'
+ */
+static int key_is(const char *key, size_t len, const char *expected) {
+    return strlen(expected) == len && memcmp(key, expected, len) == 0;
+}
 
-    compute_checksum(header);
+/*
+ * Applies the records of an extended header, the 'len' bytes at 'data', to 'pax'
+ * Each record reads "LENGTH KEY=VALUE\n", with LENGTH counting the whole record. Keys minitar
+ * doesn't use are skipped; 'pax->name' and 'pax->path' point into 'data'.
+ * Returns 0 on success or -1 if the records are malformed
+ */
+static int parse_pax_records(const char *data, size_t len, pax_info_t *pax) {
+    size_t pos = 0;
+    while (pos < len && data[pos] != '\0') {  // the rest of the last block is zero padding
+        const char *space = memchr(data + pos, ' ', len - pos);
+        off_t record_len;
+        if (space == NULL || parse_decimal(data + pos, space - (data + pos), &record_len) != 0
+                || record_len <= space - (data + pos) || record_len > (off_t)(len - pos)
+                || data[pos + record_len - 1] != '\n') {
+            return -1;
+        }
+        const char *key = space + 1;
+        const char *end = data + pos + record_len - 1;  // the record's newline
+        const char *equals = memchr(key, '=', end - key);
+        if (equals == NULL) {
+            return -1;
+        }
+        size_t key_len = equals - key;
+        const char *value = equals + 1;
+        size_t value_len = end - value;
+        off_t number;
+        if (key_is(key, key_len, "GNU.sparse.major")) {
+            if (parse_decimal(value, value_len, &number) != 0) {
+                return -1;
+            }
+            pax->sparse_major = number > INT_MAX ? INT_MAX : number;
+        } else if (key_is(key, key_len, "GNU.sparse.minor")) {
+            if (parse_decimal(value, value_len, &number) != 0) {
+                return -1;
+            }
+            pax->sparse_minor = number > INT_MAX ? INT_MAX : number;
+        } else if (key_is(key, key_len, "GNU.sparse.realsize")) {
+            if (parse_decimal(value, value_len, &pax->real_size) != 0) {
+                return -1;
+            }
+        } else if (key_is(key, key_len, "GNU.sparse.name")) {
+            pax->name = value;
+            pax->name_len = value_len;
+        } else if (key_is(key, key_len, "GNU.sparse.size") || key_is(key, key_len, "GNU.sparse.numblocks")
+                || key_is(key, key_len, "GNU.sparse.offset") || key_is(key, key_len, "GNU.sparse.numbytes")
+                || key_is(key, key_len, "GNU.sparse.map")) {  // the map of formats 0.0 and 0.1
+            pax->old_sparse = 1;
+        } else if (key_is(key, key_len, "path")) {
+            pax->path = value;
+            pax->path_len = value_len;
+        } else if (key_is(key, key_len, "size")) {
+            if (parse_decimal(value, value_len, &pax->size) != 0) {
+                return -1;
+            }
+        } else if (key_is(key, key_len, CRC32C_KEY)) {
+            if (parse_hex32(value, value_len, &pax->crc32c) != 0) {
+                return -1;
+            }
+            pax->has_crc32c = 1;
+        }
+        pos += record_len;
+    }
+    return 0;
+}
+
+/*
+ * Appends the record "LENGTH KEY=VALUE\n" to the extended header data in 'buf'
+ * Returns 0 on success or -1 if it doesn't fit in the 'cap' bytes of 'buf'
+ */
+static int pax_add_record(char *buf, size_t cap, size_t *used, const char *key, const char *value) {
+    size_t body_len = strlen(key) + strlen(value) + 3;  // space, '=' and newline
+    size_t record_len = body_len + 1;
+    while (snprintf(NULL, 0, "%zu", record_len) + body_len != record_len) {  // LENGTH counts its own digits
+        record_len++;
+    }
+    if (*used + record_len + 1 > cap) {  // snprintf also needs room for a terminator
+        return -1;
+    }
+    *used += snprintf(buf + *used, cap - *used, "%zu %s=%s\n", record_len, key, value);
+    return 0;
+}
+
+/*
+ * Returns 1 if the file described by 'stat_buf' occupies fewer blocks than its size needs,
+ * the cheap sign that it has holes worth looking for
+ */
+static int may_have_holes(const struct stat *stat_buf) {
+    return S_ISREG(stat_buf->st_mode) && stat_buf->st_blocks * 512 < stat_buf->st_size;
+}
+
+/*
+ * Sets the name field of 'header' to 'file_name' with 'dir' inserted before its last component,
+ * the way GNU tar names the extra entries of a sparse member
+ */
+static void set_inner_name(tar_header *header, const char *file_name, const char *dir) {
+    char name[PATH_MAX + 32];
+    const char *base = strrchr(file_name, '/');
+    base = base == NULL ? file_name : base + 1;
+    snprintf(name, sizeof(name), "%.*s%s/%s", (int)(base - file_name), file_name, dir, base);
+    memset(header->name, 0, sizeof(header->name));
+    strncpy(header->name, name, sizeof(header->name));
+    memset(header->prefix, 0, sizeof(header->prefix));  // the inner name stands alone
+}
+
+/*
+ * Builds everything of a sparse member that comes before its data, in GNU sparse format 1.0:
+ * an extended header with the real name and size, the member's header, and its map of data runs
+ * The member's header is named DIR/GNUSparseFile.0/NAME, so tars without sparse support extract
+ * the stored form instead of a wrong file. Its data (after the map) is the runs in 'holes',
+ * back to back, followed by padding to a whole block.
+ * Returns a malloc'ed buffer of whole blocks with its length in '*len' and the size recorded in
+ * the member's header in '*stored_size', or NULL if an error occurs
+ */
+static char *build_sparse_headers(const char *file_name, const struct stat *stat_buf, const sparse_map_t *holes, size_t *len, off_t *stored_size) {
+    tar_header header;
+    if (fill_tar_header(&header, file_name, stat_buf) != 0) {
+        return NULL;
+    }
+    size_t map_len;
+    char *map_text = sparse_map_encode(holes, &map_len);
+    if (map_text == NULL) {
+        return NULL;
+    }
+    size_t pax_cap = strlen(file_name) + 256;
+    char *pax_data = malloc(pax_cap);
+    if (pax_data == NULL) {
+        free(map_text);
+        return NULL;
+    }
+    char real_size[32];
+    snprintf(real_size, sizeof(real_size), "%lld", (long long)stat_buf->st_size);
+    size_t pax_len = 0;
+    if (pax_add_record(pax_data, pax_cap, &pax_len, "GNU.sparse.major", "1") != 0
+            || pax_add_record(pax_data, pax_cap, &pax_len, "GNU.sparse.minor", "0") != 0
+            || pax_add_record(pax_data, pax_cap, &pax_len, "GNU.sparse.name", file_name) != 0
+            || pax_add_record(pax_data, pax_cap, &pax_len, "GNU.sparse.realsize", real_size) != 0) {
+        errno = ENAMETOOLONG;
+        free(pax_data);
+        free(map_text);
+        return NULL;
+    }
+
+    size_t pax_blocks = (pax_len + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+    size_t map_blocks = (map_len + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+    *len = BLOCK_SIZE + pax_blocks + BLOCK_SIZE + map_blocks;
+    *stored_size = map_blocks + sparse_map_data_size(holes);
+    char *blocks = calloc(1, *len);
+    if (blocks == NULL) {
+        free(pax_data);
+        free(map_text);
+        return NULL;
+    }
+    // The extended header describes the same file, under its own name and type
+    tar_header *pax_header = (tar_header *)blocks;
+    *pax_header = header;
+    set_inner_name(pax_header, file_name, "PaxHeaders.0");
+    pax_header->typeflag = XHDTYPE;
+    format_numeric(pax_header->size, sizeof(pax_header->size), pax_len);
+    compute_checksum(pax_header);
+    memcpy(blocks + BLOCK_SIZE, pax_data, pax_len);
+
+    tar_header *member_header = (tar_header *)(blocks + BLOCK_SIZE + pax_blocks);
+    *member_header = header;
+    set_inner_name(member_header, file_name, "GNUSparseFile.0");
+    format_numeric(member_header->size, sizeof(member_header->size), *stored_size);
+    compute_checksum(member_header);
+    memcpy(blocks + 2 * BLOCK_SIZE + pax_blocks, map_text, map_len);
+    free(pax_data);
+    free(map_text);
+    return blocks;
+}
+
+/*
+ * Returns 1 if 'archive_name' names standard input/output rather than a file
+ */
+int is_stdio_archive(const char *archive_name) {
+    return strcmp(archive_name, STDIO_ARCHIVE_NAME) == 0;
+}
+
+/*
+ * Writes all 'count' bytes of 'buf' to 'fd', retrying after short writes
+ * Returns 0 on success or -1 if an error occurs
+ */
+int write_all(int fd, const void *buf, size_t count) {
+    const char *bytes = buf;
+    while (count > 0) {
+        ssize_t nwritten = write(fd, bytes, count);
+        if (nwritten == -1) {
+            if (errno == EINTR) {  // interrupted before anything was written, just retry
+                continue;
+            }
+            return -1;
+        }
+        bytes += nwritten;
+        count -= nwritten;
+    }
     return 0;
 }
 
 /*
- * Removes 'nbytes' bytes from the file identified by 'file_name'
- * Returns 0 upon success, -1 upon error
- * Note: This function uses lower-level I/O syscalls (not stdio)
+ * Writes all 'count' bytes of 'buf' to 'fd' starting at 'offset', without moving the file position
+ * Returns 0 on success or -1 if an error occurs
+ */
+int pwrite_all(int fd, const void *buf, size_t count, off_t offset) {
+    const char *bytes = buf;
+    while (count > 0) {
+        ssize_t nwritten = pwrite(fd, bytes, count, offset);
+        if (nwritten == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        bytes += nwritten;
+        count -= nwritten;
+        offset += nwritten;
+    }
+    return 0;
+}
+
+/*
+ * Flushes the file open as 'fd' to disk, with fdatasync if 'data_only' is nonzero or else fsync
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int sync_file(int fd, int data_only) {
+    uint64_t start = stats_start();
+    int result = data_only ? fdatasync(fd) : fsync(fd);
+    stats_add(STATS_SYNC, start, 0, 1);
+    return result;
+}
+
+/*
+ * Returns 1 if 'err' means the kernel can't perform an in-kernel copy between
+ * the two descriptors, so the caller should fall back to a slower method
+ */
+static int copy_unsupported(int err) {
+    return err == ENOSYS || err == EINVAL || err == EXDEV || err == EOPNOTSUPP || err == EBADF;
+}
+
+/*
+ * Copies 'nbytes' bytes from 'src_fd' to 'dst_fd'
+ * If 'src_offset' is NULL, reading starts at the current position of 'src_fd' and advances it.
+ * Otherwise reading starts at '*src_offset', which is advanced instead, so several threads
+ * can safely copy out of the same source descriptor at once. 'dst_offset' works the same way
+ * for writing to 'dst_fd'.
+ * Tries copy_file_range first, then splice, then sendfile, and finally a pread/write loop through a large buffer,
+ * moving on to the next method only when the kernel refuses the previous one.
+ * '*calls' is increased by the number of system calls made.
+ * Returns 0 on success or -1 if an error occurs (including 'src_fd' ending early)
+ */
+static int copy_contents(int src_fd, off_t *src_offset, int dst_fd, off_t *dst_offset, off_t nbytes, uint64_t *calls) {
+    off_t remaining = nbytes;
+
+    while (remaining > 0) {  // in-kernel copy, data never passes through user space
+        ssize_t ncopied = copy_file_range(src_fd, src_offset, dst_fd, dst_offset, remaining, 0);
+        (*calls)++;
+        if (ncopied > 0) {
+            remaining -= ncopied;
+        } else if (ncopied == 0) {  // source ended before 'nbytes' bytes were copied
+            errno = EIO;
+            return -1;
+        } else if (errno != EINTR) {
+            if (copy_unsupported(errno)) {
+                break;  // e.g. across filesystems on older kernels, try sendfile instead
+            }
+            return -1;
+        }
+    }
+
+    while (remaining > 0 && src_offset == NULL) {  // splice moves data out of a pipe (e.g. a streamed archive) without a copy
+        ssize_t ncopied = splice(src_fd, NULL, dst_fd, dst_offset, remaining, 0);
+        (*calls)++;
+        if (ncopied > 0) {
+            remaining -= ncopied;
+        } else if (ncopied == 0) {
+            errno = EIO;
+            return -1;
+        } else if (errno != EINTR) {
+            if (copy_unsupported(errno)) {
+                break;  // neither end is a pipe
+            }
+            return -1;
+        }
+    }
+
+    while (remaining > 0 && dst_offset == NULL) {  // sendfile still avoids the copy into user space, but only writes at the file position
+        ssize_t ncopied = sendfile(dst_fd, src_fd, src_offset, remaining);
+        (*calls)++;
+        if (ncopied > 0) {
+            remaining -= ncopied;
+        } else if (ncopied == 0) {
+            errno = EIO;
+            return -1;
+        } else if (errno != EINTR) {
+            if (copy_unsupported(errno)) {
+                break;
+            }
+            return -1;
+        }
+    }
+
+    if (remaining == 0) {
+        return 0;
+    }
+    // Neither in-kernel method works for these descriptors, copy through a page-aligned buffer
+    char *buffer;
+    if (posix_memalign((void **)&buffer, COPY_BUFFER_ALIGN, COPY_BUFFER_SIZE) != 0) {
+        errno = ENOMEM;
+        return -1;
+    }
+    while (remaining > 0) {
+        size_t chunk = remaining < COPY_BUFFER_SIZE ? remaining : COPY_BUFFER_SIZE;
+        ssize_t nread;
+        if (src_offset == NULL) {
+            nread = read(src_fd, buffer, chunk);
+        } else {
+            nread = pread(src_fd, buffer, chunk, *src_offset);
+        }
+        (*calls)++;
+        if (nread == -1 && errno == EINTR) {
+            continue;
+        }
+        if (nread <= 0) {
+            if (nread == 0) {
+                errno = EIO;
+            }
+            free(buffer);
+            return -1;
+        }
+        int write_result;
+        if (dst_offset == NULL) {
+            write_result = write_all(dst_fd, buffer, nread);
+        } else {
+            write_result = pwrite_all(dst_fd, buffer, nread, *dst_offset);
+        }
+        (*calls)++;
+        if (write_result != 0) {
+            free(buffer);
+            return -1;
+        }
+        if (src_offset != NULL) {
+            *src_offset += nread;
+        }
+        if (dst_offset != NULL) {
+            *dst_offset += nread;
+        }
+        remaining -= nread;
+    }
+    free(buffer);
+    return 0;
+}
+
+/*
+ * Copies 'nbytes' bytes from 'src_fd' to 'dst_fd' with copy_contents, charging the copy to the run's stats
+ * Returns 0 on success or -1 if an error occurs (including 'src_fd' ending early)
+ */
+int copy_file_data(int src_fd, off_t *src_offset, int dst_fd, off_t *dst_offset, off_t nbytes) {
+    uint64_t start = stats_start();
+    uint64_t calls = 0;
+    int result = copy_contents(src_fd, src_offset, dst_fd, dst_offset, nbytes, &calls);
+    stats_add(STATS_COPY, start, result == 0 ? nbytes : 0, calls);
+    return result;
+}
+
+/*
+ * Writes the zero bytes that pad a member body of 'size' bytes out to a full block
+ * Returns 0 on success or -1 if an error occurs
+ */
+int write_padding(archive_stream_t *stream, off_t size) {
+    static const char zeros[BLOCK_SIZE];
+    size_t padding = (BLOCK_SIZE - size % BLOCK_SIZE) % BLOCK_SIZE;
+    if (padding == 0) {
+        return 0;
+    }
+    return stream_write(stream, zeros, padding);
+}
+
+/*
+ * Writes the first 'nbytes' bytes of the file open as 'src_fd' into 'stream'
+ * Uncompressed archives get the contents through copy_file_data, so the kernel can copy them;
+ * otherwise they are read in large chunks and handed to the compressor.
+ * Returns 0 on success or -1 if an error occurs (including the file ending early)
+ */
+int write_file_data(int src_fd, archive_stream_t *stream, off_t nbytes) {
+    if (stream_is_passthrough(stream)) {
+        return copy_file_data(src_fd, NULL, stream->fd, NULL, nbytes);
+    }
+    char *buffer = malloc(COPY_BUFFER_SIZE);
+    if (buffer == NULL) {
+        return -1;
+    }
+    uint64_t start = stats_start();
+    uint64_t calls = 0;
+    off_t total = nbytes;
+    while (nbytes > 0) {
+        size_t chunk = nbytes < COPY_BUFFER_SIZE ? nbytes : COPY_BUFFER_SIZE;
+        ssize_t nread = read(src_fd, buffer, chunk);
+        calls++;  // reads only, the compressor decides when to write
+        if (nread <= 0) {
+            if (nread == 0) {
+                errno = EIO;  // file shrank after its size was recorded
+            } else if (errno == EINTR) {
+                continue;
+            }
+            free(buffer);
+            return -1;
+        }
+        if (stream_write(stream, buffer, nread) != 0) {
+            free(buffer);
+            return -1;
+        }
+        nbytes -= nread;
+    }
+    free(buffer);
+    stats_add(STATS_COPY, start, total, calls);
+    return 0;
+}
+
+// Bytes read at a time when hashing or comparing member files for --dedup
+#define DEDUP_BUFFER_SIZE (256 * 1024)
+
+// State of --dedup while an archive is written
+typedef struct {
+    dedup_index_t index;  // every member so far that a link could refer to
+    char *buffer;  // two halves of DEDUP_BUFFER_SIZE, for reading two files side by side
+} dedup_t;
+
+/*
+ * Prepares 'dedup' for a new batch of members
+ * Returns 0 on success or -1 if memory could not be allocated
+ */
+static int dedup_start(dedup_t *dedup) {
+    dedup_index_init(&dedup->index);
+    dedup->buffer = malloc(2 * DEDUP_BUFFER_SIZE);
+    return dedup->buffer == NULL ? -1 : 0;
+}
+
+static void dedup_stop(dedup_t *dedup) {
+    dedup_index_clear(&dedup->index);
+    free(dedup->buffer);
+}
+
+/*
+ * Reads up to 'len' bytes at 'offset' of the file open as 'fd' into 'buffer', retrying
+ * after interruptions
+ * Returns the number of bytes read, 0 at the end of the file, or -1 if an error occurs
+ */
+static ssize_t pread_retry(int fd, char *buffer, size_t len, off_t offset) {
+    ssize_t nread;
+    do {
+        nread = pread(fd, buffer, len, offset);
+    } while (nread == -1 && errno == EINTR);
+    return nread;
+}
+
+/*
+ * Computes the XXH64 digest of the first 'size' bytes of the file open as 'fd'
+ * Reads with pread, so the file offset is left where it was.
+ * Returns 0 on success or -1 if an error occurs (or the file is shorter than 'size')
+ */
+static int file_digest(int fd, off_t size, char *buffer, uint64_t *digest) {
+    xxh64_state_t state;
+    xxh64_init(&state, 0);
+    for (off_t offset = 0; offset < size;) {
+        size_t chunk = size - offset < DEDUP_BUFFER_SIZE ? size - offset : DEDUP_BUFFER_SIZE;
+        ssize_t nread = pread_retry(fd, buffer, chunk, offset);
+        if (nread <= 0) {
+            if (nread == 0) {
+                errno = EIO;  // file shrank after its size was recorded
+            }
+            return -1;
+        }
+        xxh64_update(&state, buffer, nread);
+        offset += nread;
+    }
+    *digest = xxh64_final(&state);
+    return 0;
+}
+
+/*
+ * Computes (once) and returns in '*digest' the digest of the contents of entry 'i' of 'dedup'
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int entry_digest(dedup_t *dedup, int i, uint64_t *digest) {
+    dedup_entry_t *entry = &dedup->index.entries[i];
+    if (!entry->has_digest) {
+        if (entry->data != NULL) {
+            entry->digest = xxh64(entry->data, entry->size, 0);
+        } else {
+            int fd = open(entry->name, O_RDONLY);
+            int result = fd == -1 ? -1 : file_digest(fd, entry->size, dedup->buffer, &entry->digest);
+            if (fd != -1) {
+                close(fd);
+            }
+            if (result != 0) {
+                return -1;
+            }
+        }
+        entry->has_digest = 1;
+    }
+    *digest = entry->digest;
+    return 0;
+}
+
+/*
+ * Compares the first 'size' bytes of the file open as 'fd' with the contents of entry 'entry'
+ * Returns 1 if they are the same, 0 if not (or the entry's file can no longer be read the
+ * same way), or -1 if 'fd' can't be read
+ */
+static int entry_matches(dedup_t *dedup, const dedup_entry_t *entry, int fd) {
+    char *ours = dedup->buffer;
+    char *theirs = dedup->buffer + DEDUP_BUFFER_SIZE;
+    int other_fd = -1;
+    if (entry->data == NULL && (other_fd = open(entry->name, O_RDONLY)) == -1) {
+        return 0;  // gone since it was archived, so it can't be compared
+    }
+    int result = 1;
+    for (off_t offset = 0; offset < entry->size && result == 1;) {
+        size_t chunk = entry->size - offset < DEDUP_BUFFER_SIZE ? entry->size - offset : DEDUP_BUFFER_SIZE;
+        ssize_t nread = pread_retry(fd, ours, chunk, offset);
+        if (nread <= 0) {
+            result = nread == 0 ? 0 : -1;
+            break;
+        }
+        const char *stored = entry->data != NULL ? entry->data + offset : theirs;
+        if (entry->data == NULL && pread_retry(other_fd, theirs, nread, offset) != nread) {
+            result = 0;
+        } else if (memcmp(ours, stored, nread) != 0) {
+            result = 0;
+        }
+        offset += nread;
+    }
+    if (other_fd != -1) {
+        close(other_fd);
+    }
+    return result;
+}
+
+/*
+ * Turns 'header' into the header of a hard link to the member named 'target'
+ */
+static void make_link_header(tar_header *header, const char *target) {
+    header->typeflag = LNKTYPE;
+    format_numeric(header->size, sizeof(header->size), 0);  // the contents are the target's
+    strncpy(header->linkname, target, sizeof(header->linkname));
+    compute_checksum(header);
+}
+
+/*
+ * With --dedup, looks for an earlier member with the same contents as the file or directory
+ * 'name', whose metadata is 'stat_buf' and whose header is 'header', and records it in 'dedup'
+ * A regular file is only hashed once another member of the same size turns up, and a digest
+ * match is confirmed byte for byte before 'header' is turned into a link to the earlier member.
+ * 'fd' is the file open for reading, or -1 to open it here.
+ * Returns 1 if 'header' now describes a link, 0 if the member keeps its contents, or -1 if an
+ * error occurs
+ */
+static int dedup_member(dedup_t *dedup, const char *name, const struct stat *stat_buf, int fd, tar_header *header) {
+    off_t size = stat_buf->st_size;
+    if (!S_ISREG(stat_buf->st_mode) || size == 0) {  // nothing to share; a link can't point at a directory
+        dedup_index_forget(&dedup->index, name);
+        return 0;
+    }
+    int own_fd = -1;
+    if (fd == -1 && (fd = own_fd = open(name, O_RDONLY)) == -1) {
+        return -1;
+    }
+    int result = 0;
+    int have_digest = 0;
+    uint64_t digest;
+    for (int i = dedup_index_first(&dedup->index, size); i != -1 && result == 0; i = dedup_index_next(&dedup->index, i)) {
+        const dedup_entry_t *entry = &dedup->index.entries[i];
+        // Replaced, a link to itself, or a name the link's header has no room for
+        if (entry->name == NULL || strcmp(entry->name, name) == 0 || strlen(entry->name) > sizeof(header->linkname)) {
+            continue;
+        }
+        if (!have_digest) {
+            if (file_digest(fd, size, dedup->buffer, &digest) != 0) {
+                result = -1;
+                break;
+            }
+            have_digest = 1;
+        }
+        uint64_t entry_hash;
+        if (entry_digest(dedup, i, &entry_hash) != 0) {
+            continue;  // an earlier file that can't be read any more just isn't shared
+        }
+        if (entry_hash == digest && (result = entry_matches(dedup, entry, fd)) == 1) {
+            make_link_header(header, entry->name);
+        }
+    }
+    if (result == 1) {
+        dedup_index_forget(&dedup->index, name);  // a link to a link would only add a hop
+    } else if (result == 0) {
+        int i = dedup_index_add(&dedup->index, name, size, NULL);
+        if (i == -1) {
+            result = -1;
+        } else if (have_digest) {
+            dedup->index.entries[i].digest = digest;
+            dedup->index.entries[i].has_digest = 1;
+        }
+    }
+    if (own_fd != -1) {
+        close(own_fd);
+    }
+    return result;
+}
+
+// Largest buffer member contents are read through to compute their CRC32C
+#define CRC32C_BUFFER_SIZE (256 * 1024)
+
+/*
+ * Returns 1 if the member with header 'header' gets a record of its contents' CRC32C (--crc32c)
+ * Only regular members with contents do; sparse members are written without one.
+ */
+static int wants_crc32c(const tar_header *header) {
+    return archive_options.crc32c && header->typeflag == REGTYPE && parse_octal(header->size, sizeof(header->size)) > 0;
+}
+
+/*
+ * Builds the blocks in front of the contents of the file 'file_name', whose header is 'header',
+ * for a member that needs an extended header: one with a path record if the name doesn't fit
+ * the header ('long_name'), and a record of 'crc' as the CRC32C of the contents if 'with_crc32c'
+ * Returns a malloc'ed buffer of whole blocks ending with 'header', with its length in '*len' and
+ * the offset of the CRC's 8 hex digits in '*crc32c_pos' (so it can be filled in later), or NULL
+ * if memory could not be allocated
+ */
+static char *build_extended_headers(const tar_header *header, const char *file_name, int long_name, int with_crc32c, uint32_t crc,
+                                    size_t *len, size_t *crc32c_pos) {
+    size_t name_len = strlen(file_name);
+    size_t pax_cap = name_len + 64;  // the path record, with the slash of a directory, and the CRC record
+    char *pax_data = malloc(pax_cap);
+    char *path = long_name ? malloc(name_len + 2) : NULL;
+    if (pax_data == NULL || (long_name && path == NULL)) {
+        free(pax_data);
+        free(path);
+        return NULL;
+    }
+    size_t pax_len = 0;
+    char value[9];
+    if (long_name) {
+        snprintf(path, name_len + 2, "%s%s", file_name, needs_trailing_slash(file_name, header->typeflag == DIRTYPE) ? "/" : "");
+        pax_add_record(pax_data, pax_cap, &pax_len, "path", path);
+        free(path);
+    }
+    if (with_crc32c) {  // kept last, so the digits sit just before the final newline
+        snprintf(value, sizeof(value), "%08x", (unsigned)crc);
+        pax_add_record(pax_data, pax_cap, &pax_len, CRC32C_KEY, value);
+        *crc32c_pos = BLOCK_SIZE + pax_len - 1 - strlen(value);
+    }
+
+    size_t pax_blocks = (pax_len + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+    *len = BLOCK_SIZE + pax_blocks + BLOCK_SIZE;
+    char *blocks = calloc(1, *len);
+    if (blocks == NULL) {
+        free(pax_data);
+        return NULL;
+    }
+    tar_header *pax_header = (tar_header *)blocks;
+    *pax_header = *header;
+    set_inner_name(pax_header, file_name, "PaxHeaders.0");
+    pax_header->typeflag = XHDTYPE;
+    format_numeric(pax_header->size, sizeof(pax_header->size), pax_len);
+    compute_checksum(pax_header);
+    memcpy(blocks + BLOCK_SIZE, pax_data, pax_len);
+    memcpy(blocks + BLOCK_SIZE + pax_blocks, header, BLOCK_SIZE);
+    free(pax_data);
+    return blocks;
+}
+
+/*
+ * Computes the CRC32C of the first 'size' bytes of the file open as 'fd' into '*crc'
+ * Reads with pread, so the file offset is left where it was.
+ * Returns 0 on success or -1 if an error occurs (or the file is shorter than 'size')
+ */
+static int file_crc32c(int fd, off_t size, uint32_t *crc) {
+    size_t buffer_size = size < CRC32C_BUFFER_SIZE ? (size_t)size : CRC32C_BUFFER_SIZE;
+    char *buffer = malloc(buffer_size > 0 ? buffer_size : 1);
+    if (buffer == NULL) {
+        return -1;
+    }
+    *crc = 0;
+    int result = 0;
+    uint64_t start = stats_start();
+    uint64_t calls = 0;
+    for (off_t offset = 0; offset < size && result == 0; calls++) {
+        size_t len = size - offset < (off_t)buffer_size ? (size_t)(size - offset) : buffer_size;
+        ssize_t nread = pread_retry(fd, buffer, len, offset);
+        if (nread <= 0) {
+            if (nread == 0) {  // the file shrank since its size was taken
+                errno = EIO;
+            }
+            result = -1;
+        } else {
+            *crc = crc32c_update(*crc, buffer, nread);
+            offset += nread;
+        }
+    }
+    free(buffer);
+    stats_add(STATS_COPY, start, result == 0 ? size : 0, calls);
+    return result;
+}
+
+/*
+ * Copies 'size' bytes at 'src_offset' of the file open as 'src_fd' to 'dst_offset' of 'dst_fd'
+ * through 'buffer' (of 'buffer_size' bytes), computing their CRC32C into '*crc' on the way
+ * The contents have to pass through memory for the CRC anyway, so this takes one read of the
+ * file where an in-kernel copy and a second pass to checksum would take two.
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int copy_with_crc32c(int src_fd, off_t src_offset, int dst_fd, off_t dst_offset, off_t size,
+                            char *buffer, size_t buffer_size, uint32_t *crc) {
+    uint64_t start = stats_start();
+    uint64_t calls = 0;
+    *crc = 0;
+    for (off_t done = 0; done < size;) {
+        size_t len = size - done < (off_t)buffer_size ? (size_t)(size - done) : buffer_size;
+        ssize_t nread = pread_retry(src_fd, buffer, len, src_offset + done);
+        if (nread <= 0) {
+            if (nread == 0) {  // the file shrank since its size was taken
+                errno = EIO;
+            }
+            return -1;
+        }
+        if (pwrite_all(dst_fd, buffer, nread, dst_offset + done) != 0) {
+            return -1;
+        }
+        *crc = crc32c_update(*crc, buffer, nread);
+        calls += 2;
+        done += nread;
+    }
+    stats_add(STATS_COPY, start, size, calls);
+    return 0;
+}
+
+/*
+ * Opens the regular file 'name', found by a walk, for reading and replaces '*stat_buf' with
+ * the metadata of the open file, so that a header built from it describes what is copied
+ * even if the file changed after the walk saw it
+ * Returns the open descriptor, or -1 if an error occurs (including the file no longer being regular)
+ */
+static int open_member_file(const char *name, struct stat *stat_buf) {
+    int fd = open(name, O_RDONLY);
+    if (fd == -1) {
+        return -1;
+    }
+    if (fstat(fd, stat_buf) != 0 || !S_ISREG(stat_buf->st_mode)) {
+        int err = S_ISREG(stat_buf->st_mode) ? errno : EISDIR;  // e.g. replaced by a directory since the walk
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    return fd;
+}
+
+// One run of a member file's contents and its place in an archive being written in parallel
+typedef struct {
+    const char *name;  // path of the member file
+    int fd;  // the member file, opened once at layout time and shared by all of its runs
+    off_t src_offset;  // where the run starts in the file, 0 unless the file is sparse
+    off_t data_offset;  // where the run goes in the archive
+    off_t size;  // number of bytes in the run
+    off_t crc32c_offset;  // where the hex digits of the run's CRC32C go once it is copied, -1 if not recorded
+} layout_entry_t;
+
+// Work shared by the archive-writing worker threads
+typedef struct {
+    int archive_fd;
+    const char *archive_name;
+    layout_entry_t *entries;
+    int num_entries;
+    int next;  // index of the next entry nobody has claimed yet
+    int failed;  // set once any worker hits an error, so the others stop early
+    pthread_mutex_t lock;  // protects 'next' and 'failed'
+} write_job_t;
+
+/*
+ * Thread body for parallel archive writing
+ * Repeatedly claims the next member and copies its contents to their precomputed offset
+ */
+static void *write_worker(void *arg) {
+    write_job_t *job = arg;
+    char err_msg[MAX_MSG_LEN];  // stores error message for printing
+    char *buffer = NULL;  // for runs whose CRC32C is recorded, allocated when the first one turns up
+    while (1) {
+        pthread_mutex_lock(&job->lock);
+        if (job->failed || job->next == job->num_entries) {
+            pthread_mutex_unlock(&job->lock);
+            free(buffer);
+            return NULL;
+        }
+        layout_entry_t *entry = &job->entries[job->next++];
+        pthread_mutex_unlock(&job->lock);
+
+        // Every copy fails if the file ends before the size its header promises
+        int result;
+        if (entry->crc32c_offset == -1) {
+            off_t src_offset = entry->src_offset;
+            off_t dst_offset = entry->data_offset;
+            result = copy_file_data(entry->fd, &src_offset, job->archive_fd, &dst_offset, entry->size);
+            if (result != 0) {
+                snprintf(err_msg, MAX_MSG_LEN, "Failed to copy contents of %s to %s", entry->name, job->archive_name);
+                perror(err_msg);
+            }
+        } else {
+            uint32_t crc;
+            char digits[9];
+            if (buffer == NULL) {
+                buffer = malloc(CRC32C_BUFFER_SIZE);
+            }
+            result = buffer == NULL ? -1
+                     : copy_with_crc32c(entry->fd, entry->src_offset, job->archive_fd, entry->data_offset, entry->size, buffer, CRC32C_BUFFER_SIZE, &crc);
+            if (result == 0) {  // the extended header was written with a placeholder
+                snprintf(digits, sizeof(digits), "%08x", (unsigned)crc);
+                result = pwrite_all(job->archive_fd, digits, strlen(digits), entry->crc32c_offset);
+            }
+            if (result != 0) {
+                snprintf(err_msg, MAX_MSG_LEN, "Failed to copy contents of %s to %s", entry->name, job->archive_name);
+                perror(err_msg);
+            }
+        }
+        if (result != 0) {
+            pthread_mutex_lock(&job->lock);
+            job->failed = 1;
+            pthread_mutex_unlock(&job->lock);
+            free(buffer);
+            return NULL;
+        }
+    }
+}
+
+/*
+ * Copies the contents of every member laid out in 'entries' into the archive through io_uring
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int write_members_uring(int archive_fd, const char *archive_name, const layout_entry_t *entries, int count) {
+    char err_msg[MAX_MSG_LEN];  // stores error message for printing
+    uring_copy_t *copies = malloc((count > 0 ? count : 1) * sizeof(uring_copy_t));
+    if (copies == NULL) {
+        snprintf(err_msg, MAX_MSG_LEN, "Failed to allocate copy list for archive %s", archive_name);
+        perror(err_msg);
+        return -1;
+    }
+    for (int i = 0; i < count; i++) {
+        copies[i] = (uring_copy_t){NULL, NULL, entries[i].fd, entries[i].src_offset, NULL, archive_fd, entries[i].data_offset, entries[i].size};
+    }
+    int failed;
+    uint64_t start = stats_start();
+    int result = uring_copy_run(copies, count, &failed);
+    if (result != 0) {
+        if (failed == -1) {
+            snprintf(err_msg, MAX_MSG_LEN, "Failed to set up io_uring for archive %s", archive_name);
+        } else {
+            snprintf(err_msg, MAX_MSG_LEN, "Failed to copy contents of %s to %s", entries[failed].name, archive_name);
+        }
+        perror(err_msg);
+    } else if (stats_enabled) {
+        off_t total = 0;
+        for (int i = 0; i < count; i++) {
+            total += copies[i].size;
+        }
+        stats_add(STATS_COPY, start, total, 0);  // the ring batches its system calls, none per copy
+    }
+    free(copies);
+    return result;
+}
+
+/*
+ * Adds a run of 'size' bytes of the file 'name', open as 'fd', to the layout '*entries', growing it as needed
+ * 'crc32c_offset' is where the run's CRC32C goes in the archive, -1 if it isn't recorded.
+ * Returns 0 on success or -1 if memory could not be allocated
+ */
+static int layout_add(layout_entry_t **entries, int *count, int *capacity, const char *name, int fd, off_t src_offset, off_t data_offset,
+                      off_t size, off_t crc32c_offset) {
+    if (*count == *capacity) {
+        int grown_capacity = *capacity * 2;
+        layout_entry_t *grown = realloc(*entries, grown_capacity * sizeof(layout_entry_t));
+        if (grown == NULL) {
+            return -1;
+        }
+        *entries = grown;
+        *capacity = grown_capacity;
+    }
+    (*entries)[(*count)++] = (layout_entry_t){name, fd, src_offset, data_offset, size, crc32c_offset};
+    return 0;
+}
+
+/*
+ * Writes the 'len' bytes of header blocks 'blocks' at 'offset' of the archive open as 'archive_fd'
+ * If 'held' isn't NULL, the first block is copied there instead of being written (see append_members).
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int write_header_blocks(int archive_fd, const void *blocks, size_t len, off_t offset, char *held) {
+    uint64_t start = stats_start();
+    int result;
+    if (held == NULL) {
+        result = pwrite_all(archive_fd, blocks, len, offset);
+    } else {
+        memcpy(held, blocks, BLOCK_SIZE);
+        result = pwrite_all(archive_fd, (const char *)blocks + BLOCK_SIZE, len - BLOCK_SIZE, offset + BLOCK_SIZE);
+    }
+    stats_add(STATS_HEADER, start, len, 1);
+    return result;
+}
+
+/*
+ * Lays out the file or directory 'name', whose metadata is 'stat_buf', as a member starting at
+ * 'offset' of the archive open as 'archive_fd'; a regular file is open as 'fd' (-1 otherwise),
+ * which the runs of its contents keep for copying them later
+ * Writes the member's headers (and, for a sparse file, its map of data runs) at 'offset' and
+ * adds the runs of contents still to be copied to the layout. '*next_offset' is set to where
+ * the next member starts. With 'held', the first header block is kept there instead of written.
+ * With 'dedup', a file with the contents of an earlier member becomes a link to it.
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int layout_member(int archive_fd, const char *archive_name, const char *name, int fd, const struct stat *stat_buf, off_t offset,
+                         char *held, dedup_t *dedup, layout_entry_t **entries, int *count, int *capacity, off_t *next_offset) {
+    char err_msg[MAX_MSG_LEN];  // stores error message for printing
+    tar_header header;
+    sparse_map_t holes;  // data runs of the file, if it has holes
+    sparse_map_init(&holes);
+    int sparse = 0;
+    if (may_have_holes(stat_buf)) {
+        sparse = sparse_map_detect(fd, stat_buf->st_size, &holes);
+        if (sparse == -1) {
+            snprintf(err_msg, MAX_MSG_LEN, "Failed to find the holes of file %s in %s", name, archive_name);
+            perror(err_msg);
+            return -1;
+        }
+    }
+    if (sparse) {
+        size_t len;
+        off_t stored_size;
+        if (dedup != NULL) {  // sparse members are never shared
+            dedup_index_forget(&dedup->index, name);
+        }
+        char *blocks = build_sparse_headers(name, stat_buf, &holes, &len, &stored_size);
+        int result = blocks == NULL ? -1 : write_header_blocks(archive_fd, blocks, len, offset, held);
+        free(blocks);
+        off_t data_offset = offset + len;
+        for (int i = 0; i < holes.count && result == 0; i++) {
+            const sparse_segment_t *segment = &holes.segments[i];
+            if (segment->size > 0) {
+                result = layout_add(entries, count, capacity, name, fd, segment->offset, data_offset, segment->size, -1);
+            }
+            data_offset += segment->size;
+        }
+        sparse_map_clear(&holes);
+        if (result != 0) {
+            snprintf(err_msg, MAX_MSG_LEN, "Failed to write the entire tar header for %s in %s", name, archive_name);
+            perror(err_msg);
+            return -1;
+        }
+        *next_offset = offset + len + (data_offset - (offset + len) + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+        return 0;
+    }
+    if (fill_tar_header(&header, name, stat_buf) != 0) {
+        snprintf(err_msg, MAX_MSG_LEN, "Failed to fill tar header for %s in %s", name, archive_name);
+        perror(err_msg);
+        return -1;
+    }
+    if (dedup != NULL && dedup_member(dedup, name, stat_buf, fd, &header) == -1) {
+        snprintf(err_msg, MAX_MSG_LEN, "Failed to look for earlier copies of %s in %s", name, archive_name);
+        perror(err_msg);
+        return -1;
+    }
+    char *blocks = NULL;  // the extended header and the member's header, if it needs the former
+    const void *header_blocks = &header;
+    size_t header_len = BLOCK_SIZE;
+    off_t crc32c_offset = -1;
+    int long_name = !name_fits_header(name, S_ISDIR(stat_buf->st_mode));
+    int with_crc32c = wants_crc32c(&header);
+    if (long_name || with_crc32c) {  // the CRC is filled in once the contents are copied
+        size_t crc32c_pos;
+        blocks = build_extended_headers(&header, name, long_name, with_crc32c, 0, &header_len, &crc32c_pos);
+        if (blocks == NULL) {
+            snprintf(err_msg, MAX_MSG_LEN, "Failed to build the extended header for %s in %s", name, archive_name);
+            perror(err_msg);
+            return -1;
+        }
+        header_blocks = blocks;
+        crc32c_offset = with_crc32c ? offset + (off_t)crc32c_pos : -1;
+    }
+    int written = write_header_blocks(archive_fd, header_blocks, header_len, offset, held);
+    free(blocks);
+    if (written != 0) {
+        snprintf(err_msg, MAX_MSG_LEN, "Failed to write the entire tar header for %s in %s", name, archive_name);
+        perror(err_msg);
+        return -1;
+    }
+    off_t size = parse_octal(header.size, sizeof(header.size));  // exactly what the header promises
+    if (size > 0 && layout_add(entries, count, capacity, name, fd, 0, offset + header_len, size, crc32c_offset) != 0) {
+        snprintf(err_msg, MAX_MSG_LEN, "Failed to allocate layout for archive %s", archive_name);
+        perror(err_msg);
+        return -1;
+    }
+    *next_offset = offset + header_len + (size + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+    return 0;
+}
+
+/*
+ * Returns 1 if 'stat_buf' describes the archive itself, which must not be archived into itself
+ */
+static int is_archive_itself(const struct stat *stat_buf, const struct stat *archive_stat) {
+    return stat_buf->st_dev == archive_stat->st_dev && stat_buf->st_ino == archive_stat->st_ino;
+}
+
+/*
+ * Reports a failed tree_walk_next for 'path' (NULL if memory ran out) in the archive 'archive_name'
+ */
+static void report_walk_error(const char *path, const char *archive_name) {
+    char err_msg[MAX_MSG_LEN];  // stores error message for printing
+    if (path == NULL) {
+        snprintf(err_msg, MAX_MSG_LEN, "Failed to walk the files to add to %s", archive_name);
+    } else {
+        snprintf(err_msg, MAX_MSG_LEN, "Failed to stat or read %s in %s", path, archive_name);
+    }
+    perror(err_msg);
+}
+
+/*
+ * Number of threads a tree walk should use to read directories ahead of the archive writer
+ */
+static int walk_threads(void) {
+    long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return num_cpus < 2 ? 0 : num_cpus < 8 ? (int)num_cpus : 8;
+}
+
+/*
+ * Copies the contents of the 'count' runs laid out in 'entries' into the archive open as
+ * 'archive_fd', with io_uring or with 'num_threads' threads (the calling thread when it's 1)
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int copy_layout(int archive_fd, const char *archive_name, layout_entry_t *entries, int count, int num_threads) {
+    char err_msg[MAX_MSG_LEN];  // stores error message for printing
+    // One thread keeps many copies in flight instead; not for CRC32C records, which need the contents in memory
+    if (archive_options.use_io_uring && !archive_options.crc32c && uring_available()) {
+        return write_members_uring(archive_fd, archive_name, entries, count);
+    }
+    write_job_t job = {archive_fd, archive_name, entries, count, 0, 0};
+    pthread_t threads[MAX_THREADS];
+    int started = 0;
+    pthread_mutex_init(&job.lock, NULL);
+    if (num_threads > count) {  // no point starting threads that would have nothing to do
+        num_threads = count;
+    }
+    for (; num_threads > 1 && started < num_threads; started++) {
+        if (pthread_create(&threads[started], NULL, write_worker, &job) != 0) {
+            snprintf(err_msg, MAX_MSG_LEN, "Failed to start writer thread for archive %s", archive_name);
+            perror(err_msg);
+            pthread_mutex_lock(&job.lock);
+            job.failed = 1;
+            pthread_mutex_unlock(&job.lock);
+            break;
+        }
+    }
+    if (num_threads <= 1) {  // a single copier needs no thread of its own
+        write_worker(&job);
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    pthread_mutex_destroy(&job.lock);
+    return job.failed ? -1 : 0;
+}
+
+/*
+ * Number of member files write_members_parallel keeps open between laying them out and copying
+ * them, half of what the process may have open so the rest of the run still has room
+ */
+static int max_open_members(void) {
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) != 0 || limit.rlim_cur == RLIM_INFINITY || limit.rlim_cur > 2 * (rlim_t)INT_MAX) {
+        return 512;
+    }
+    int half = (int)(limit.rlim_cur / 2);
+    return half < 16 ? 16 : half;
+}
+
+// A walked file or directory laid out by write_members_parallel, whose runs point at its name and descriptor
+typedef struct {
+    char *name;  // malloc'ed path from the walk
+    int fd;  // the open file, -1 for a directory
+} laid_out_t;
+
+/*
+ * Closes and frees the first 'count' files of 'laid_out', once their contents are copied
+ */
+static void release_laid_out(laid_out_t *laid_out, int count) {
+    for (int i = 0; i < count; i++) {
+        if (laid_out[i].fd != -1) {
+            close(laid_out[i].fd);
+        }
+        free(laid_out[i].name);
+    }
+}
+
+/*
+ * Writes every file and directory found by walking 'files' into the archive open as 'archive_fd',
+ * starting at 'start_offset'; directories are only walked into if 'recursive' is set
+ * A layout pass opens each file, builds its header from the open file's metadata and, since a
+ * member takes its headers plus its stored size rounded up to whole blocks, also fixes where
+ * every member lands. Headers are written during that pass, and the archive is then sized to
+ * its final length, so padding and footer are already zero. Member contents are copied into
+ * place from the descriptors opened during layout, by 'num_threads' threads with positional
+ * writes (on the calling thread when 'num_threads' is 1); a file that ends before the size in
+ * its header fails the run. The result is byte-for-byte what the serial path in helper() produces.
+ * When as many files are open as max_open_members allows, those laid out so far are copied and
+ * closed before the layout goes on.
+ * If 'held' isn't NULL, the first header block is stored there rather than written, and
+ * '*held_used' tells whether there was a member to take it. 'dedup' is NULL without --dedup.
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int write_members_parallel(int archive_fd, const char *archive_name, const file_list_t *files, int recursive, off_t start_offset,
+                                  int num_threads, char *held, int *held_used, dedup_t *dedup) {
+    char err_msg[MAX_MSG_LEN];  // stores error message for printing
+    struct stat archive_stat;
+    if (fstat(archive_fd, &archive_stat) != 0) {
+        snprintf(err_msg, MAX_MSG_LEN, "Failed to stat archive %s", archive_name);
+        perror(err_msg);
+        return -1;
+    }
+    int max_open = max_open_members();
+    int capacity = files->size > 0 ? files->size : 1;  // grown as the walk finds more files
+    int count = 0;
+    layout_entry_t *entries = malloc(capacity * sizeof(layout_entry_t));
+    int laid_out_capacity = capacity;
+    int num_laid_out = 0;
+    int num_open = 0;  // descriptors held in 'laid_out'
+    laid_out_t *laid_out = malloc(laid_out_capacity * sizeof(laid_out_t));  // walked files, which 'entries' point into
+    tree_walk_t *walk = tree_walk_start(files, recursive, walk_threads());
+    if (entries == NULL || laid_out == NULL || walk == NULL) {
+        snprintf(err_msg, MAX_MSG_LEN, "Failed to allocate layout for archive %s", archive_name);
+        perror(err_msg);
+        free(entries);
+        free(laid_out);
+        if (walk != NULL) {
+            tree_walk_stop(walk);
+        }
+        return -1;
+    }
+
+    int result = 0;
+    off_t offset = start_offset;  // offset of the next header
+    if (held_used != NULL) {
+        *held_used = 0;
+    }
+    while (result == 0) {
+        char *name;
+        struct stat stat_buf;
+        uint64_t start = stats_start();
+        int found = tree_walk_next(walk, &name, &stat_buf);
+        stats_add(STATS_METADATA, start, 0, 1);
+        if (found != 1) {
+            if (found == -1) {
+                report_walk_error(name, archive_name);
+                free(name);
+                result = -1;
+            }
+            break;
+        }
+        if (is_archive_itself(&stat_buf, &archive_stat)) {  // the walk's metadata only decides what to archive
+            fprintf(stderr, "Skipping %s: it is the archive itself\n", name);
+            free(name);
+            continue;
+        }
+        int fd = -1;
+        if (S_ISREG(stat_buf.st_mode)) {
+            start = stats_start();
+            fd = open_member_file(name, &stat_buf);
+            stats_add(STATS_METADATA, start, 0, 2);
+            if (fd == -1) {
+                snprintf(err_msg, MAX_MSG_LEN, "Failed to open file %s in %s", name, archive_name);
+                perror(err_msg);
+                free(name);
+                result = -1;
+                break;
+            }
+        }
+        if (num_laid_out == laid_out_capacity) {
+            laid_out_capacity *= 2;
+            laid_out_t *grown = realloc(laid_out, laid_out_capacity * sizeof(laid_out_t));
+            if (grown == NULL) {
+                snprintf(err_msg, MAX_MSG_LEN, "Failed to allocate layout for archive %s", archive_name);
+                perror(err_msg);
+                if (fd != -1) {
+                    close(fd);
+                }
+                free(name);
+                result = -1;
+                break;
+            }
+            laid_out = grown;
+        }
+        laid_out[num_laid_out++] = (laid_out_t){name, fd};
+        num_open += fd != -1;
+        char *member_held = held_used != NULL && !*held_used ? held : NULL;
+        result = layout_member(archive_fd, archive_name, name, fd, &stat_buf, offset, member_held, dedup, &entries, &count, &capacity, &offset);
+        if (result == 0) {
+            stats_add_files(1);
+        }
+        if (member_held != NULL) {
+            *held_used = 1;
+        }
+        if (result == 0 && num_open == max_open) {  // out of descriptors to keep, copy what is laid out so far
+            result = copy_layout(archive_fd, archive_name, entries, count, num_threads);
+            release_laid_out(laid_out, num_laid_out);
+            count = 0;
+            num_laid_out = 0;
+            num_open = 0;
+        }
+    }
+    tree_walk_stop(walk);
+    // Growing the file zero-fills all padding and the footer blocks in one call
+    if (result == 0 && ftruncate(archive_fd, offset + BLOCK_SIZE * NUM_TRAILING_BLOCKS) != 0) {
+        snprintf(err_msg, MAX_MSG_LEN, "Failed to size archive %s", archive_name);
+        perror(err_msg);
+        result = -1;
+    }
+    if (result == 0) {
+        result = copy_layout(archive_fd, archive_name, entries, count, num_threads);
+    }
+    release_laid_out(laid_out, num_laid_out);
+    free(laid_out);
+    free(entries);
+    return result;
+}
+
+// Number of member files the metadata thread may open ahead of the copy loop
+#define PREFETCH_DEPTH 32
+
+// A member file or directory found by the walk and opened ahead of being copied into the archive
+typedef struct {
+    char *name;  // malloc'ed path from the walk, freed by whoever takes the file
+    int fd;  // open descriptor of a regular file, -1 for a directory or if a step failed
+    int err;  // errno of the failed step, 0 on success
+    int walk_failed;  // nonzero if the walk itself failed at 'name', rather than opening it
+    struct stat stat_buf;  // metadata of the open file (of the walk for a directory), used for both the header and the copy
+} prepared_file_t;
+
+// Walks the names of a list and opens the files found in order, on a separate thread when one
+// can be started, so that the next files' metadata is already gathered while the current one is copied
+typedef struct {
+    tree_walk_t *walk;
+    prepared_file_t slots[PREFETCH_DEPTH];  // ring of prepared files, indexed by count % PREFETCH_DEPTH
+    int produced;  // number of files prepared so far
+    int consumed;  // number of files handed to the copy loop so far
+    int done;  // set once the walk is over or has failed, nothing more is produced
+    int stop;  // set to make the metadata thread quit early
+    int waiting;  // nonzero while either side sleeps on 'changed', so the other knows to signal
+    int threaded;  // nonzero if the metadata thread is running
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;  // signalled whenever 'produced', 'consumed', 'done' or 'stop' changes
+} file_prefetch_t;
+
+/*
+ * Takes the next entry of the walk into 'file', opening it if it is a regular file
+ * Returns 1 if 'file' was filled in (possibly with an error), or 0 once the walk is over
+ */
+static int prepare_file(tree_walk_t *walk, prepared_file_t *file) {
+    file->fd = -1;
+    file->err = 0;
+    file->walk_failed = 0;
+    uint64_t start = stats_start();
+    int found = tree_walk_next(walk, &file->name, &file->stat_buf);
+    if (found == 0) {
+        return 0;
+    }
+    if (found == -1) {
+        file->err = errno;
+        file->walk_failed = 1;
+        return 1;
+    }
+    int is_reg = S_ISREG(file->stat_buf.st_mode);
+    if (is_reg && (file->fd = open_member_file(file->name, &file->stat_buf)) == -1) {
+        file->err = errno;
+    }
+    stats_add(STATS_METADATA, start, 0, is_reg ? 3 : 1);
+    return 1;
+}
+
+static void *prefetch_worker(void *arg) {
+    file_prefetch_t *prefetch = arg;
+    while (1) {
+        pthread_mutex_lock(&prefetch->lock);
+        while (prefetch->produced - prefetch->consumed == PREFETCH_DEPTH && !prefetch->stop) {
+            prefetch->waiting = 1;
+            pthread_cond_wait(&prefetch->changed, &prefetch->lock);
+        }
+        int stop = prefetch->stop;
+        pthread_mutex_unlock(&prefetch->lock);
+        if (stop) {
+            break;
+        }
+        // The slot is free until 'produced' is advanced, so it's filled without the lock
+        prepared_file_t *slot = &prefetch->slots[prefetch->produced % PREFETCH_DEPTH];
+        int found = prepare_file(prefetch->walk, slot);
+        pthread_mutex_lock(&prefetch->lock);
+        prefetch->produced += found;
+        prefetch->done = !found || slot->walk_failed;  // the walk can't go on past a failure
+        if (prefetch->waiting) {
+            prefetch->waiting = 0;
+            pthread_cond_broadcast(&prefetch->changed);
+        }
+        int done = prefetch->done;
+        pthread_mutex_unlock(&prefetch->lock);
+        if (done) {
+            break;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Starts walking and preparing the files of 'files' in order
+ * Without a metadata thread (one CPU, or if it can't be started) files are prepared on demand.
+ * Returns 0 on success or -1 if memory could not be allocated
+ */
+static int prefetch_start(file_prefetch_t *prefetch, const file_list_t *files) {
+    prefetch->walk = tree_walk_start(files, 1, walk_threads());
+    if (prefetch->walk == NULL) {
+        return -1;
+    }
+    prefetch->produced = 0;
+    prefetch->consumed = 0;
+    prefetch->done = 0;
+    prefetch->stop = 0;
+    prefetch->waiting = 0;
+    prefetch->threaded = 0;
+    // With one CPU there is nothing for the thread to overlap with
+    if (sysconf(_SC_NPROCESSORS_ONLN) < 2) {
+        return 0;
+    }
+    pthread_mutex_init(&prefetch->lock, NULL);
+    pthread_cond_init(&prefetch->changed, NULL);
+    if (pthread_create(&prefetch->thread, NULL, prefetch_worker, prefetch) == 0) {
+        prefetch->threaded = 1;
+    } else {
+        pthread_mutex_destroy(&prefetch->lock);
+        pthread_cond_destroy(&prefetch->changed);
+    }
+    return 0;
+}
+
+/*
+ * Hands the next file of the walk to the caller, who becomes responsible for closing 'file->fd'
+ * and freeing 'file->name'
+ * Returns 1 if a file was handed out, or 0 once the walk is over
+ */
+static int prefetch_next(file_prefetch_t *prefetch, prepared_file_t *file) {
+    if (!prefetch->threaded) {
+        int found = prepare_file(prefetch->walk, file);
+        prefetch->consumed += found;
+        return found;
+    }
+    pthread_mutex_lock(&prefetch->lock);
+    while (prefetch->consumed == prefetch->produced && !prefetch->done) {
+        prefetch->waiting = 1;
+        pthread_cond_wait(&prefetch->changed, &prefetch->lock);
+    }
+    int found = prefetch->consumed < prefetch->produced;
+    if (found) {
+        *file = prefetch->slots[prefetch->consumed % PREFETCH_DEPTH];
+        prefetch->consumed++;
+    }
+    if (prefetch->waiting) {
+        prefetch->waiting = 0;
+        pthread_cond_broadcast(&prefetch->changed);
+    }
+    pthread_mutex_unlock(&prefetch->lock);
+    return found;
+}
+
+/*
+ * Stops the metadata thread and the walk, and releases any files prepared but never handed out
+ */
+static void prefetch_stop(file_prefetch_t *prefetch) {
+    if (prefetch->threaded) {
+        pthread_mutex_lock(&prefetch->lock);
+        prefetch->stop = 1;
+        pthread_cond_broadcast(&prefetch->changed);
+        pthread_mutex_unlock(&prefetch->lock);
+        pthread_join(prefetch->thread, NULL);
+        for (int i = prefetch->consumed; i < prefetch->produced; i++) {
+            prepared_file_t *slot = &prefetch->slots[i % PREFETCH_DEPTH];
+            if (slot->fd != -1) {
+                close(slot->fd);
+            }
+            free(slot->name);
+        }
+        pthread_mutex_destroy(&prefetch->lock);
+        pthread_cond_destroy(&prefetch->changed);
+        prefetch->threaded = 0;
+    }
+    tree_walk_stop(prefetch->walk);
+}
+
+/*
+ * Writes the file 'file' into 'stream' as a sparse member whose data runs are 'holes'
+ * Only the runs are read from the file; the holes between them take no space in the archive.
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int write_sparse_member(archive_stream_t *stream, const char *archive_name, const prepared_file_t *file, const sparse_map_t *holes) {
+    char err_msg[MAX_MSG_LEN];  // stores error message for printing
+    size_t len;
+    off_t stored_size;
+    char *blocks = build_sparse_headers(file->name, &file->stat_buf, holes, &len, &stored_size);
+    if (blocks == NULL) {
+        snprintf(err_msg, MAX_MSG_LEN, "Failed to fill tar header for %s in %s", file->name, archive_name);
+        perror(err_msg);
+        return -1;
+    }
+    uint64_t start = stats_start();
+    if (stream_write(stream, blocks, len) != 0) {
+        snprintf(err_msg, MAX_MSG_LEN, "Failed to write the entire tar header for %s in %s", file->name, archive_name);
+        perror(err_msg);
+        free(blocks);
+        return -1;
+    }
+    stats_add(STATS_HEADER, start, len, 1);
+    free(blocks);
+    for (int i = 0; i < holes->count; i++) {
+        const sparse_segment_t *segment = &holes->segments[i];
+        start = stats_start();
+        off_t position = lseek(file->fd, segment->offset, SEEK_SET);
+        stats_add(STATS_SEEK, start, 0, 1);
+        if (position == -1 || write_file_data(file->fd, stream, segment->size) != 0) {
+            snprintf(err_msg, MAX_MSG_LEN, "Failed to copy contents of %s to %s", file->name, archive_name);
+            perror(err_msg);
+            return -1;
+        }
+    }
+    if (write_padding(stream, stored_size) != 0) {  // the map is whole blocks, so this pads the runs
+        snprintf(err_msg, MAX_MSG_LEN, "Failed to write the FINAL block from %s to %s", file->name, archive_name);
+        perror(err_msg);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Writes 'header', the header of the prepared file 'file', into 'stream', behind an extended
+ * header recording the file's full name if it doesn't fit the header, and the CRC32C of the
+ * file's contents if the member gets one (--crc32c)
+ * A stream can't go back to fill in the CRC, so the file is read for it before it is copied.
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int write_member_header(archive_stream_t *stream, const char *archive_name, const prepared_file_t *file, const tar_header *header) {
+    char err_msg[MAX_MSG_LEN];  // stores error message for printing
+    char *blocks = NULL;  // the extended header and the member's header, if it needs the former
+    const void *header_blocks = header;
+    size_t header_len = BLOCK_SIZE;
+    int long_name = !name_fits_header(file->name, S_ISDIR(file->stat_buf.st_mode));
+    int with_crc32c = wants_crc32c(header);
+    uint32_t crc = 0;
+    if (with_crc32c && file_crc32c(file->fd, file->stat_buf.st_size, &crc) != 0) {
+        snprintf(err_msg, MAX_MSG_LEN, "Failed to compute the checksum of %s in %s", file->name, archive_name);
+        perror(err_msg);
+        return -1;
+    }
+    if (long_name || with_crc32c) {
+        size_t crc32c_pos;
+        blocks = build_extended_headers(header, file->name, long_name, with_crc32c, crc, &header_len, &crc32c_pos);
+        if (blocks == NULL) {
+            snprintf(err_msg, MAX_MSG_LEN, "Failed to build the extended header for %s in %s", file->name, archive_name);
+            perror(err_msg);
+            return -1;
+        }
+        header_blocks = blocks;
+    }
+    uint64_t start = stats_start();
+    if (stream_write(stream, header_blocks, header_len) != 0) {  // write error check
+        snprintf(err_msg, MAX_MSG_LEN, "Failed to write the entire tar header for %s in %s", file->name, archive_name);
+        perror(err_msg);
+        free(blocks);
+        return -1;
+    }
+    stats_add(STATS_HEADER, start, header_len, 1);
+    free(blocks);
+    return 0;
+}
+
+/*
+ * Writes the prepared file or directory 'file' into 'stream' as one member and closes 'file->fd'
+ * With 'dedup', a file with the contents of an earlier member is written as a link to it.
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int write_member(archive_stream_t *stream, const char *archive_name, prepared_file_t *file, dedup_t *dedup) {
+    char err_msg[MAX_MSG_LEN];  // stores error message for printing
+    tar_header temp_header;
+    sparse_map_t holes;  // data runs of the file, if it has holes
+    sparse_map_init(&holes);
+    int sparse = may_have_holes(&file->stat_buf) ? sparse_map_detect(file->fd, file->stat_buf.st_size, &holes) : 0;
+    int result = 0;
+    int linked = 0;  // nonzero if the member is a link to an earlier one with the same contents
+    if (sparse == -1) {
+        snprintf(err_msg, MAX_MSG_LEN, "Failed to find the holes of file %s in %s", file->name, archive_name);
+        perror(err_msg);
+        result = -1;
+    } else if (sparse == 1) {  // stored as a sparse member, which is never shared
+        if (dedup != NULL) {
+            dedup_index_forget(&dedup->index, file->name);
+        }
+        result = write_sparse_member(stream, archive_name, file, &holes);
+        sparse_map_clear(&holes);
+    } else if (fill_tar_header(&temp_header, file->name, &file->stat_buf) != 0) {  // calls fill_tar_header and checks for error
+        snprintf(err_msg, MAX_MSG_LEN, "Failed to fill tar header for %s in %s", file->name, archive_name);
+        perror(err_msg);
+        result = -1;
+    } else if (dedup != NULL && (linked = dedup_member(dedup, file->name, &file->stat_buf, file->fd, &temp_header)) == -1) {
+        snprintf(err_msg, MAX_MSG_LEN, "Failed to look for earlier copies of %s in %s", file->name, archive_name);
+        perror(err_msg);
+        result = -1;
+    } else if (write_member_header(stream, archive_name, file, &temp_header) != 0) {
+        result = -1;
+    } else if (file->fd != -1 && !linked) {  // a directory or a link has a header and nothing else
+        // The size from fstat is exactly what the header promises, so it's also the number of bytes to copy
+        off_t size = file->stat_buf.st_size;
+        if (write_file_data(file->fd, stream, size) != 0) {  // copy the whole body in as few syscalls as the kernel allows
+            snprintf(err_msg, MAX_MSG_LEN, "Failed to copy contents of %s to %s", file->name, archive_name);
+            perror(err_msg);
+            result = -1;
+        } else if (write_padding(stream, size) != 0) {  // zero-fill the rest of the final block
+            snprintf(err_msg, MAX_MSG_LEN, "Failed to write the FINAL block from %s to %s", file->name, archive_name);
+            perror(err_msg);
+            result = -1;
+        }
+    }
+    if (file->fd != -1 && close(file->fd) == -1 && result == 0) {  // close file/error check
+        snprintf(err_msg, MAX_MSG_LEN, "Failed to close file %s", file->name);
+        perror(err_msg);
+        result = -1;
+    }
+    if (result == 0) {
+        stats_add_files(1);
+    }
+    return result;
+}
+
+/*
+ * Empties the existing archive open as 'archive_fd' that is about to be written anew
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int truncate_archive(int archive_fd, const char *archive_name) {
+    char err_msg[MAX_MSG_LEN];  // stores error message for printing
+    if (ftruncate(archive_fd, 0) != 0) {
+        snprintf(err_msg, MAX_MSG_LEN, "Failed to truncate archive %s", archive_name);
+        perror(err_msg);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * helper function for create_archive
+ * Creates or overwrites the archive (or writes it to standard output), with a member for every
+ * file and directory found by walking 'files'; 'dedup' is NULL without --dedup
+ */
+int helper(const char *archive_name, const file_list_t *files, dedup_t *dedup) {
+    char err_msg[MAX_MSG_LEN];  // stores error message for printing
+    int archive_fd;  // used for the archive ONLY
+    archive_stream_t stream;  // everything written to the archive goes through here, compressed or not
+    compression_t compression = archive_options.compression;
+
+    int streaming = is_stdio_archive(archive_name);
+    if (streaming) {  // the archive goes to standard output, which can only be written front to back
+        archive_fd = STDOUT_FILENO;
+    } else {  // open archive for writing, truncated only once nothing more can fail before writing it
+        archive_fd = open(archive_name, O_WRONLY | O_CREAT, 0666);
+        if (archive_fd == -1) {
+            snprintf(err_msg, MAX_MSG_LEN, "Failed to open archive %s", archive_name);
+            perror(err_msg);
+            return -1;
+        }
+    }
+
+    int parallel = archive_options.num_threads > 1 || archive_options.use_io_uring;
+    if (parallel && !streaming && compression == COMPRESS_NONE) {  // lay the archive out up front, then fill it in parallel
+        if (truncate_archive(archive_fd, archive_name) != 0) {
+            close(archive_fd);
+            return -1;
+        }
+        int result = write_members_parallel(archive_fd, archive_name, files, 1, 0, archive_options.num_threads, NULL, NULL, dedup);
+        if (close(archive_fd) != 0) {
+            snprintf(err_msg, MAX_MSG_LEN, "Failed to close archive %s", archive_name);
+            perror(err_msg);
+            return -1;
+        }
+        return result;
+    }
+
+    struct stat archive_stat;  // to keep the archive out of itself when it lies inside a walked directory
+    if (fstat(archive_fd, &archive_stat) != 0) {
+        snprintf(err_msg, MAX_MSG_LEN, "Failed to stat archive %s", archive_name);
+        perror(err_msg);
+        close(archive_fd);
+        return -1;
+    }
+    if (stream_open_writer(&stream, archive_fd, compression, archive_options.compression_level, archive_options.num_threads) != 0) {
+        snprintf(err_msg, MAX_MSG_LEN, "Failed to start %s compression for archive %s", compression_name(compression), archive_name);
+        perror(err_msg);
+        close(archive_fd);
+        return -1;
+    }
+    if (!streaming && truncate_archive(archive_fd, archive_name) != 0) {
+        stream_close(&stream);
+        close(archive_fd);
+        return -1;
+    }
+    file_prefetch_t prefetch;
+    prepared_file_t file;  // the member file being copied, opened and inspected ahead of time
+    if (prefetch_start(&prefetch, files) != 0) {
+        snprintf(err_msg, MAX_MSG_LEN, "Failed to walk the files to add to %s", archive_name);
+        perror(err_msg);
+        stream_close(&stream);
+        close(archive_fd);
+        return -1;
+    }
+    int result = 0;
+    while (result == 0 && prefetch_next(&prefetch, &file) == 1) {
+        if (file.err != 0) {  // walk/open error check
+            errno = file.err;
+            if (file.walk_failed) {
+                report_walk_error(file.name, archive_name);
+            } else {
+                snprintf(err_msg, MAX_MSG_LEN, "Failed to open file %s in %s", file.name, archive_name);
+                perror(err_msg);
+            }
+            result = -1;
+        } else if (is_archive_itself(&file.stat_buf, &archive_stat)) {
+            fprintf(stderr, "Skipping %s: it is the archive itself\n", file.name);
+            close(file.fd);
+        } else {
+            result = write_member(&stream, archive_name, &file, dedup);
+        }
+        free(file.name);
+    }  // finished file copying loop
+    prefetch_stop(&prefetch);
+    if (result != 0) {
+        stream_close(&stream);
+        close(archive_fd);
+        return -1;
+    }
+    // create footer (two 0 char blocks)
+    static const char footer[BLOCK_SIZE * NUM_TRAILING_BLOCKS];
+    if (stream_write(&stream, footer, sizeof(footer)) != 0) {
+        snprintf(err_msg, MAX_MSG_LEN, "Failed to write footer blocks for %s", archive_name);
+        perror(err_msg);
+        stream_close(&stream);
+        close(archive_fd);
+        return -1;
+    }
+    if (stream_close(&stream) != 0) {  // flushes the last compressed bytes
+        snprintf(err_msg, MAX_MSG_LEN, "Failed to finish writing archive %s", archive_name);
+        perror(err_msg);
+        close(archive_fd);
+        return -1;
+    }
+    if (close(archive_fd) != 0) {
+        snprintf(err_msg, MAX_MSG_LEN, "Failed to close archive %s after creating footer", archive_name);
+        perror(err_msg);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Releases a mapping created by map_archive below
+ */
+void unmap_archive(archive_map_t *map) {
+    if (map->data != NULL) {
+        munmap((void *)map->data, map->size);
+        map->data = NULL;
+    }
+}
+
+/*
+ * Maps the whole archive open as 'archive_fd' read-only into memory, see map_archive
+ * The mapping keeps its own reference to the file, so 'archive_fd' may be closed afterwards.
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int map_archive_fd(int archive_fd, const char *archive_name, int advice, archive_map_t *map) {
+    char err_msg[MAX_MSG_LEN];  // stores error message for printing
+    struct stat stat_buf;
+    if (fstat(archive_fd, &stat_buf) != 0) {
+        snprintf(err_msg, MAX_MSG_LEN, "Failed to stat archive %s", archive_name);
+        perror(err_msg);
+        return -1;
+    }
+    map->size = stat_buf.st_size;
+    map->data = NULL;
+    if (map->size > 0) {  // mmap rejects zero-length mappings
+        uint64_t start = stats_start();  // mapping replaces seeking through the archive
+        void *data = mmap(NULL, map->size, PROT_READ, MAP_SHARED, archive_fd, 0);
+        if (data == MAP_FAILED) {
+            snprintf(err_msg, MAX_MSG_LEN, "Failed to map archive %s", archive_name);
+            perror(err_msg);
+            return -1;
+        }
+        madvise(data, map->size, advice);  // only a hint, nothing to do if the kernel ignores it
+        stats_add(STATS_SEEK, start, 0, 2);
+        map->data = data;
+    }
+    return 0;
+}
+
+/*
+ * Maps the whole archive identified by 'archive_name' read-only into memory
+ * 'advice' is passed to madvise to tell the kernel how the mapping will be walked.
+ * An empty archive yields a NULL mapping of size 0.
+ * Returns 0 on success or -1 if an error occurs
+ */
+int map_archive(const char *archive_name, int advice, archive_map_t *map) {
+    char err_msg[MAX_MSG_LEN];  // stores error message for printing
+    int archive_fd = open(archive_name, O_RDONLY);
+    if (archive_fd == -1) {  // open error check
+        snprintf(err_msg, MAX_MSG_LEN, "Failed to open archive %s", archive_name);
+        perror(err_msg);
+        return -1;
+    }
+    if (map_archive_fd(archive_fd, archive_name, advice, map) != 0) {
+        close(archive_fd);
+        return -1;
+    }
+    // The mapping keeps its own reference to the file
+    if (close(archive_fd) != 0) {
+        snprintf(err_msg, MAX_MSG_LEN, "Failed to close archive %s", archive_name);
+        perror(err_msg);
+        unmap_archive(map);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Decodes the member whose first header is at 'offset' of the mapped archive 'map' into 'member'
+ * An extended header in front of the member is applied to it, and global extended headers
+ * are skipped. The checksum of every header is verified. The member's name is stored in 'names'.
+ * Returns 0 on success, 1 if 'offset' holds the footer (or the end of the archive),
+ * or -1 if an error occurs
+ */
+static int parse_member(const archive_map_t *map, off_t offset, const char *archive_name, name_arena_t *names, member_t *member) {
+    pax_info_t pax;  // records of the extended header in front of the member, if any
+    pax_info_init(&pax);
+    member->header_offset = offset;
+    while (1) {
+        if (offset + BLOCK_SIZE > map->size) {
+            if (offset == member->header_offset) {
+                return 1;  // an archive without a footer ends here
+            }
+            fprintf(stderr, "Archive %s is truncated after the extended header at offset %lld\n", archive_name, (long long)member->header_offset);
+            return -1;
+        }
+        const tar_header *header = (const tar_header *)(map->data + offset);
+        if (header->name[0] == '\0' && offset == member->header_offset) {  // first footer block, no more members
+            return 1;
+        }
+        if (!verify_checksum(header)) {
+            fprintf(stderr, "Header checksum mismatch at offset %lld of archive %s\n", (long long)offset, archive_name);
+            return -1;
+        }
+        off_t size = parse_octal(header->size, sizeof(header->size));
+        if (header->typeflag == XHDTYPE || header->typeflag == XGLTYPE) {
+            if (size < 0 || offset + BLOCK_SIZE + size > map->size) {
+                fprintf(stderr, "Archive %s is truncated inside the extended header at offset %lld\n", archive_name, (long long)offset);
+                return -1;
+            }
+            if (header->typeflag == XHDTYPE && parse_pax_records(map->data + offset + BLOCK_SIZE, size, &pax) != 0) {
+                fprintf(stderr, "Malformed extended header at offset %lld of archive %s\n", (long long)offset, archive_name);
+                return -1;
+            }
+            offset += BLOCK_SIZE + (size + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+            if (header->typeflag == XGLTYPE) {  // settings for the whole archive, not part of this member
+                member->header_offset = offset;
+            }
+            continue;
+        }
+        char header_name[HEADER_NAME_MAX + 1];
+        const char *name = pax.name != NULL ? pax.name : pax.path;
+        size_t name_len = pax.name != NULL ? pax.name_len : pax.path_len;
+        if (name == NULL) {
+            name_len = copy_header_name(header, header_name);
+            name = header_name;
+        }
+        member->name = name_arena_add(names, name, name_len);
+        if (member->name == NULL) {
+            perror("Failed to allocate member names");
+            return -1;
+        }
+        member->size = pax.size >= 0 ? pax.size : size;
+        member->typeflag = header->typeflag;
+        member->has_crc32c = pax.has_crc32c;
+        member->crc32c = pax.crc32c;
+        member->sparse = pax.sparse_major == 1 && pax.sparse_minor == 0;
+        member->old_sparse = is_old_sparse(header, &pax);
+        member->real_size = member->sparse ? pax.real_size : member->size;
+        member->mtime = parse_octal(header->mtime, sizeof(header->mtime));
+        member->data_offset = offset + BLOCK_SIZE;
+        // An old GNU sparse header may be followed by blocks continuing its map, which its size leaves out
+        int extended = header->typeflag == GNUTYPE_SPARSE && header_continues_sparse_map(header, GNU_SPARSE_EXTENDED_OFFSET);
+        while (extended) {
+            if (member->data_offset + BLOCK_SIZE > map->size) {
+                fprintf(stderr, "Archive %s is truncated inside the sparse map of member %s\n", archive_name, member->name);
+                return -1;
+            }
+            extended = header_continues_sparse_map(map->data + member->data_offset, GNU_SPARSE_EXTENSION_EXTENDED_OFFSET);
+            member->data_offset += BLOCK_SIZE;
+        }
+        if (member->sparse && member->real_size < 0) {
+            fprintf(stderr, "Sparse member %s in archive %s has no real size\n", member->name, archive_name);
+            return -1;
+        }
+        if (member->size < 0 || member->data_offset + member->size > map->size) {
+            fprintf(stderr, "Archive %s is truncated inside member %s\n", archive_name, member->name);
+            return -1;
+        }
+        return 0;
+    }
+}
+
+/*
+ * Walks the headers of the mapped archive 'map' in place, jumping over every member body
+ * Scanning begins with the header at 'start_offset', which must be block-aligned. On success, '*members' points to a malloc'd array of '*count' entries in archive order,
+ * which the caller must free. Scanning stops at the first all-zero block (the footer).
+ * Member names are stored in 'names', which the caller clears once done with the members, whether the scan succeeded or not.
+ * Returns 0 on success or -1 if an error occurs
+ */
+int scan_archive_members(const archive_map_t *map, off_t start_offset, const char *archive_name, name_arena_t *names, member_t **members, int *count) {
+    char err_msg[MAX_MSG_LEN];  // stores error message for printing
+    off_t offset = start_offset;  // offset of the next header
+    int capacity = 0;
+    *members = NULL;
+    *count = 0;
+
+    uint64_t start = stats_start();  // headers are parsed straight from the mapping, without syscalls
+    while (1) {
+        if (*count == capacity) {  // grow the array geometrically
+            capacity = capacity == 0 ? 64 : capacity * 2;
+            member_t *grown = realloc(*members, capacity * sizeof(member_t));
+            if (grown == NULL) {
+                snprintf(err_msg, MAX_MSG_LEN, "Failed to allocate member table for archive %s", archive_name);
+                perror(err_msg);
+                free(*members);
+                return -1;
+            }
+            *members = grown;
+        }
+        member_t *member = &(*members)[*count];
+        int status = parse_member(map, offset, archive_name, names, member);
+        if (status == 1) {
+            break;
+        }
+        if (status == -1) {
+            free(*members);
+            return -1;
+        }
+        member->order = (*count)++;
+        // body is padded out to a whole number of blocks
+        offset = member->data_offset + (member->size + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+    }
+    stats_add(STATS_HEADER, start, (off_t)*count * BLOCK_SIZE, 0);
+    return 0;
+}
+
+/*
+ * Consumes up to 'nbytes' bytes of what 'stream' has already read ahead (see stream_buffered),
+ * writing them to 'dst_fd' unless it is -1, so the rest can be taken from the stream's descriptor
+ * Returns the number of bytes consumed or -1 if an error occurs
+ */
+static off_t take_buffered(archive_stream_t *stream, off_t nbytes, int dst_fd) {
+    const void *data;
+    size_t buffered = stream_buffered(stream);
+    size_t len = nbytes < (off_t)buffered ? (size_t)nbytes : buffered;
+    if (len == 0) {
+        return 0;
+    }
+    stream_view(stream, &data, len);  // can't fail, the bytes are already there
+    if (dst_fd != -1 && write_all(dst_fd, data, len) != 0) {
+        return -1;
+    }
+    return len;
+}
+
+/*
+ * Reads and discards 'nbytes' bytes from 'stream', which may be a pipe that can't seek
+ * Bytes the stream has read ahead are skipped in its buffer; beyond them, an uncompressed
+ * regular file is skipped through with a seek.
+ * Returns 0 on success or -1 if an error occurs (including input ending early)
+ */
+int skip_bytes(archive_stream_t *stream, off_t nbytes) {
+    struct stat stat_buf;
+    nbytes -= take_buffered(stream, nbytes, -1);
+    // An uncompressed archive redirected from a regular file can be skipped through with a seek
+    if (nbytes > 0 && stream_is_passthrough(stream) && fstat(stream->fd, &stat_buf) == 0 && S_ISREG(stat_buf.st_mode)) {
+        uint64_t start = stats_start();
+        off_t offset = lseek(stream->fd, nbytes, SEEK_CUR);
+        stats_add(STATS_SEEK, start, 0, 2);  // with the fstat
+        if (offset != -1) {
+            if (offset > stat_buf.st_size) {  // the archive ends inside the skipped bytes
+                errno = EIO;
+                return -1;
+            }
+            return 0;
+        }
+    }
+    while (nbytes > 0) {  // decoded (or read from a pipe) into the stream's own buffers, never copied out
+        const void *data;
+        size_t chunk = nbytes < STREAM_VIEW_MAX ? nbytes : STREAM_VIEW_MAX;
+        ssize_t nread = stream_view(stream, &data, chunk);
+        if (nread != (ssize_t)chunk) {
+            if (nread >= 0) {
+                errno = EIO;
+            }
+            return -1;
+        }
+        nbytes -= nread;
+    }
+    return 0;
+}
+
+/*
+ * Copies 'nbytes' bytes of member contents from 'stream' to 'dst_fd'
+ * Uncompressed input goes through copy_file_data once what the stream read ahead is written,
+ * so pipes are still spliced without a copy.
+ * Returns 0 on success or -1 if an error occurs
+ */
+int copy_stream_data(archive_stream_t *stream, int dst_fd, off_t nbytes) {
+    uint64_t buffered_start = stats_start();
+    off_t taken = take_buffered(stream, nbytes, dst_fd);
+    if (taken == -1) {
+        return -1;
+    }
+    stats_add(STATS_COPY, buffered_start, taken, taken > 0);
+    nbytes -= taken;
+    if (nbytes == 0) {  // small members come entirely from the read-ahead
+        return 0;
+    }
+    if (stream_is_passthrough(stream)) {
+        return copy_file_data(stream->fd, NULL, dst_fd, NULL, nbytes);
+    }
+    char *buffer = malloc(COPY_BUFFER_SIZE);
+    if (buffer == NULL) {
+        return -1;
+    }
+    uint64_t start = stats_start();
+    uint64_t calls = 0;
+    off_t total = nbytes;
+    while (nbytes > 0) {
+        size_t chunk = nbytes < COPY_BUFFER_SIZE ? nbytes : COPY_BUFFER_SIZE;
+        ssize_t nread = stream_read(stream, buffer, chunk);
+        if (nread != (ssize_t)chunk) {
+            if (nread >= 0) {
+                errno = EIO;
+            }
+            free(buffer);
+            return -1;
+        }
+        if (write_all(dst_fd, buffer, nread) != 0) {
+            free(buffer);
+            return -1;
+        }
+        calls++;  // writes only, the decompressor decides when to read
+        nbytes -= nread;
+    }
+    free(buffer);
+    stats_add(STATS_COPY, start, total, calls);
+    return 0;
+}
+
+// Largest extended header read from a stream, far more than any records minitar uses need
+#define MAX_EXTENDED_HEADER (1 << 20)
+
+/*
+ * Reads the 'size' bytes of an extended header, whose header was at 'offset' of the archive,
+ * from 'stream' along with their padding
+ * The records are applied to 'pax' unless it is NULL; a real name found among them (the sparse
+ * name, else the path) is copied to 'name_buf', of 'name_len' bytes, and 'pax->name' set to point to it.
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int read_extended_header(archive_stream_t *stream, const char *archive_name, off_t offset, off_t size, pax_info_t *pax, char *name_buf, size_t name_len) {
+    char err_msg[MAX_MSG_LEN];  // stores error message for printing
+    if (size < 0 || size > MAX_EXTENDED_HEADER) {
+        fprintf(stderr, "Extended header at offset %lld of archive %s is too large\n", (long long)offset, archive_name);
+        return -1;
+    }
+    size_t len = (size + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+    char *data = malloc(len > 0 ? len : 1);
+    if (data == NULL) {
+        snprintf(err_msg, MAX_MSG_LEN, "Failed to allocate extended header of archive %s", archive_name);
+        perror(err_msg);
+        return -1;
+    }
+    uint64_t start = stats_start();
+    ssize_t nread = stream_read(stream, data, len);
+    stats_add(STATS_HEADER, start, len, 1);
+    if (nread != (ssize_t)len) {
+        snprintf(err_msg, MAX_MSG_LEN, "Failed to read the extended header at offset %lld of archive %s", (long long)offset, archive_name);
+        if (nread == -1) {
+            perror(err_msg);
+        } else {
+            fprintf(stderr, "%s: archive is truncated\n", err_msg);
+        }
+        free(data);
+        return -1;
+    }
+    if (pax != NULL) {
+        if (parse_pax_records(data, size, pax) != 0) {
+            fprintf(stderr, "Malformed extended header at offset %lld of archive %s\n", (long long)offset, archive_name);
+            free(data);
+            return -1;
+        }
+        if (pax->name == NULL && pax->path != NULL) {
+            pax->name = pax->path;
+            pax->name_len = pax->path_len;
+        }
+        pax->path = NULL;
+        if (pax->name != NULL && pax->name_len >= name_len) {
+            fprintf(stderr, "Member name in extended header at offset %lld of archive %s is too long\n", (long long)offset, archive_name);
+            free(data);
+            return -1;
+        }
+        if (pax->name != NULL) {  // 'data' is freed below, keep a copy
+            memcpy(name_buf, pax->name, pax->name_len);
+            name_buf[pax->name_len] = '\0';
+            pax->name = name_buf;
+        }
+    }
+    free(data);
+    return 0;
+}
+
+/*
+ * Extracts the 'size' bytes of a sparse member's contents, as they arrive on 'stream', into
+ * the file 'name' open as 'fd': the map is read first, then each data run is written at its
+ * offset, and the file is extended to 'real_size' so the holes stay holes
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int extract_sparse_stream(archive_stream_t *stream, const char *archive_name, const char *name, int fd, off_t size, off_t real_size) {
+    char err_msg[MAX_MSG_LEN];  // stores error message for printing
+    sparse_map_t holes;
+    sparse_map_init(&holes);
+    char *text = NULL;  // the map's blocks read so far
+    size_t len = 0;
+    size_t used;
+    int status = 0;
+    while (status == 0) {  // the map is only known to be complete once it decodes
+        char *grown = len + BLOCK_SIZE <= (size_t)size ? realloc(text, len + BLOCK_SIZE) : NULL;
+        if (grown == NULL) {
+            status = -1;
+            break;
+        }
+        text = grown;
+        ssize_t nread = stream_read(stream, text + len, BLOCK_SIZE);
+        if (nread != BLOCK_SIZE) {
+            snprintf(err_msg, MAX_MSG_LEN, "Failed to read member %s from archive %s", name, archive_name);
+            if (nread == -1) {
+                perror(err_msg);
+            } else {
+                fprintf(stderr, "%s: archive is truncated\n", err_msg);
+            }
+            free(text);
+            return -1;
+        }
+        len += BLOCK_SIZE;
+        status = sparse_map_decode(text, len, &holes, &used);
+    }
+    free(text);
+    const sparse_segment_t *last = holes.count > 0 ? &holes.segments[holes.count - 1] : NULL;
+    if (status != 1 || len + sparse_map_data_size(&holes) > size || (last != NULL && last->offset + last->size > real_size)) {
+        fprintf(stderr, "Malformed sparse map for member %s in archive %s\n", name, archive_name);
+        sparse_map_clear(&holes);
+        return -1;
+    }
+    off_t remaining = size - len;
+    int result = 0;
+    for (int i = 0; i < holes.count && result == 0; i++) {
+        uint64_t start = stats_start();
+        off_t position = lseek(fd, holes.segments[i].offset, SEEK_SET);
+        stats_add(STATS_SEEK, start, 0, 1);
+        if (position == -1 || copy_stream_data(stream, fd, holes.segments[i].size) != 0) {
+            result = -1;
+        }
+        remaining -= holes.segments[i].size;
+    }
+    if (result == 0) {
+        result = ftruncate(fd, real_size);
+    }
+    if (result != 0) {
+        snprintf(err_msg, MAX_MSG_LEN, "Failed to write to file %s", name);
+        perror(err_msg);
+    } else if (skip_bytes(stream, remaining) != 0) {  // anything stored past the last run
+        snprintf(err_msg, MAX_MSG_LEN, "Failed to read past member %s in archive %s", name, archive_name);
+        perror(err_msg);
+        result = -1;
+    }
+    sparse_map_clear(&holes);
+    return result;
+}
+
+/*
+ * Prints an error for every name in 'requested' that is missing from 'found'
+ */
+static void report_missing_members(const char *archive_name, const file_list_t *requested, const file_list_t *found) {
+    for (const node_t *current = requested->head; current != NULL; current = current->next) {
+        if (!file_list_contains(found, current->name)) {
+            fprintf(stderr, "%s: Not found in archive %s\n", current->name, archive_name);
+        }
+    }
+}
+
+/*
+ * Creates the directory 'path' along with any missing directories above it, like mkdir -p
+ * Directories that already exist are left as they are.
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int make_directories(const char *path) {
+    char dir_name[PATH_MAX];
+    size_t len = strlen(path);
+    if (len >= sizeof(dir_name)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    memcpy(dir_name, path, len + 1);
+    for (size_t i = 1; i <= len; i++) {  // from the top down, each component ends at a slash or the end
+        if (dir_name[i] != '/' && dir_name[i] != '\0') {
+            continue;
+        }
+        char end = dir_name[i];
+        dir_name[i] = '\0';
+        if (mkdir(dir_name, 0777) != 0 && errno != EEXIST) {
+            return -1;
+        }
+        dir_name[i] = end;
+    }
+    return 0;
+}
+
+/*
+ * Creates the directories above the file 'file_name', see make_directories
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int make_parent_directories(const char *file_name) {
+    char dir_name[PATH_MAX];
+    const char *slash = strrchr(file_name, '/');
+    if (slash == NULL || slash == file_name || (size_t)(slash - file_name) >= sizeof(dir_name)) {
+        return 0;  // in the current (or root) directory, nothing to create
+    }
+    memcpy(dir_name, file_name, slash - file_name);
+    dir_name[slash - file_name] = '\0';
+    return make_directories(dir_name);
+}
+
+/*
+ * Checks that 'name' is relative and has no ".." component, so it can't name a file outside
+ * the directory an archive is extracted into
+ * Returns 1 if so, 0 otherwise
+ */
+static int is_contained_name(const char *name) {
+    if (name[0] == '/') {
+        return 0;
+    }
+    for (const char *part = name; *part != '\0';) {
+        size_t len = strcspn(part, "/");
+        if (len == 2 && part[0] == '.' && part[1] == '.') {
+            return 0;
+        }
+        part += len;
+        part += *part == '/';
+    }
+    return 1;
+}
+
+/*
+ * Reports that member 'name' of archive 'archive_name' is not extracted, since its name would
+ * put it outside the directory the archive is extracted into
+ */
+static void report_uncontained_name(const char *name, const char *archive_name) {
+    fprintf(stderr, "Member %s in archive %s has an absolute name or a '..' component, refusing to extract it\n", name, archive_name);
+}
+
+/*
+ * Creates 'file_name' as a copy of the already extracted file 'source_name', for a hard link
+ * read from a stream; a link to itself leaves the file as it is
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int copy_extracted_file(const char *source_name, const char *file_name) {
+    if (strcmp(source_name, file_name) == 0) {
+        return 0;
+    }
+    struct stat stat_buf;
+    int src_fd = open(source_name, O_RDONLY);
+    if (src_fd == -1 || fstat(src_fd, &stat_buf) != 0) {
+        if (src_fd != -1) {
+            close(src_fd);
+        }
+        return -1;
+    }
+    int new_fd = open(file_name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (new_fd == -1 && errno == ENOENT && make_parent_directories(file_name) == 0) {
+        new_fd = open(file_name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    }
+    int result = new_fd == -1 ? -1 : copy_file_data(src_fd, NULL, new_fd, NULL, stat_buf.st_size);
+    close(src_fd);
+    if (new_fd != -1 && close(new_fd) != 0) {
+        result = -1;
+    }
+    return result;
+}
+
+/*
+ * Reads the extension blocks that follow an old GNU sparse header whose map continues, up to
+ * and including the one whose flag says it is the last
+ * Returns the number of bytes read or -1 if an error occurs (including input ending early)
+ */
+static off_t skip_sparse_extensions(archive_stream_t *stream) {
+    off_t skipped = 0;
+    int extended = 1;
+    while (extended) {
+        const void *block;
+        if (stream_view(stream, &block, BLOCK_SIZE) != BLOCK_SIZE) {
+            return -1;
+        }
+        extended = header_continues_sparse_map(block, GNU_SPARSE_EXTENSION_EXTENDED_OFFSET);
+        skipped += BLOCK_SIZE;
+    }
+    return skipped;
+}
+
+/*
+ * Computes the CRC32C of the next 'size' bytes of 'stream' into '*crc', consuming them
+ * Returns 0 on success or -1 if an error occurs (including input ending early)
+ */
+static int stream_crc32c(archive_stream_t *stream, off_t size, uint32_t *crc) {
+    size_t buffer_size = size < CRC32C_BUFFER_SIZE ? (size_t)size : CRC32C_BUFFER_SIZE;
+    char *buffer = malloc(buffer_size > 0 ? buffer_size : 1);
+    if (buffer == NULL) {
+        return -1;
+    }
+    *crc = 0;
+    uint64_t start = stats_start();
+    for (off_t done = 0; done < size;) {
+        size_t len = size - done < (off_t)buffer_size ? (size_t)(size - done) : buffer_size;
+        ssize_t nread = stream_read(stream, buffer, len);
+        if (nread != (ssize_t)len) {
+            if (nread >= 0) {
+                errno = EIO;
+            }
+            free(buffer);
+            return -1;
+        }
+        *crc = crc32c_update(*crc, buffer, len);
+        done += len;
+    }
+    free(buffer);
+    stats_add(STATS_COPY, start, size, (size + buffer_size - 1) / (buffer_size > 0 ? buffer_size : 1));
+    return 0;
+}
+
+/*
+ * Reports that the contents of member 'name' don't match the CRC32C recorded for them
+ */
+static void report_crc32c_mismatch(const char *name, const char *archive_name, uint32_t recorded, uint32_t computed) {
+    fprintf(stderr, "Checksum mismatch in member %s of archive %s: recorded %08x, contents have %08x\n",
+            name, archive_name, (unsigned)recorded, (unsigned)computed);
+}
+
+/*
+ * Reads an archive strictly front to back from 'stream', never seeking
+ * With mode 't', every member name is added to 'files' and member contents are skipped.
+ * With mode 'x', every member is written out as it arrives; a later version of a file
+ * simply overwrites an earlier one, leaving the newest version in place. If 'files' is
+ * not NULL or empty, only members named in it are written and the rest are skipped. A hard
+ * link is written as a copy of its target, which must be a member written earlier in the pass.
+ * A member to be written whose name is absolute or has a ".." component stops the pass.
+ * With mode 'd', the contents of every member with a CRC32C record are checked against it,
+ * and the names of the members that match are added to 'files'; a mismatch is reported and
+ * the rest of the archive still checked.
+ * Stops at the first all-zero block, or at end of input if the footer is missing.
+ * Returns 0 on success or -1 if an error occurs (or, with mode 'd', any contents mismatch)
+ */
+int stream_archive(archive_stream_t *stream, const char *archive_name, file_list_t *files, char mode) {
+    char err_msg[MAX_MSG_LEN];  // stores error message for printing
+    char header_name[HEADER_NAME_MAX + 1];
+    int selective = mode == 'x' && files != NULL && files->size > 0;
+    file_list_t extracted;  // names written so far when extracting, the only targets links may copy
+    file_list_init(&extracted);
+    off_t offset = 0;  // offset of the current header within the uncompressed archive
+    pax_info_t pax;  // extended header records for the next member
+    char pax_name[PATH_MAX];  // real name of the next member, if its extended header has one
+    int mismatched = 0;  // set once any member's contents fail their CRC32C
+    pax_info_init(&pax);
+    while (1) {
+        // The header is checked and decoded where it sits in the stream's buffer; it stays valid
+        // only until the next read, so the name is copied out and the contents read after that
+        const void *block;
+        uint64_t start = stats_start();
+        ssize_t nread = stream_view(stream, &block, BLOCK_SIZE);
+        stats_add(STATS_HEADER, start, nread > 0 ? nread : 0, 0);  // reads are made by the stream as its buffer runs dry
+        if (nread == 0) {  // input ended where a header could start, treat like a footer
+            break;
+        }
+        if (nread != BLOCK_SIZE) {
+            snprintf(err_msg, MAX_MSG_LEN, "Failed to read a tar_header from archive %s", archive_name);
+            if (nread == -1) {
+                perror(err_msg);
+            } else {
+                fprintf(stderr, "%s: archive is truncated\n", err_msg);
+            }
+            file_list_clear(&extracted);
+            return -1;
+        }
+        const tar_header *header = block;
+        if (header->name[0] == '\0') {  // first footer block, no more members
+            break;
+        }
+        if (!verify_checksum(header)) {
+            fprintf(stderr, "Header checksum mismatch at offset %lld of archive %s\n", (long long)offset, archive_name);
+            file_list_clear(&extracted);
+            return -1;
+        }
+        off_t size = parse_octal(header->size, sizeof(header->size));
+        if (header->typeflag == XHDTYPE || header->typeflag == XGLTYPE) {  // records for the next member, or for all
+            if (read_extended_header(stream, archive_name, offset, size, header->typeflag == XHDTYPE ? &pax : NULL, pax_name, sizeof(pax_name)) != 0) {
+                file_list_clear(&extracted);
+                return -1;
+            }
+            offset += BLOCK_SIZE + (size + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+            continue;
+        }
+        const char *name = pax.name;  // points to 'pax_name', which outlives the records
+        if (name == NULL) {
+            copy_header_name(header, header_name);
+            name = header_name;
+        }
+        if (pax.size >= 0) {
+            size = pax.size;
+        }
+        int sparse = pax.sparse_major == 1 && pax.sparse_minor == 0;
+        int old_sparse = is_old_sparse(header, &pax);
+        off_t real_size = pax.real_size;
+        int has_crc32c = pax.has_crc32c;
+        uint32_t crc32c = pax.crc32c;
+        pax_info_init(&pax);  // the records only applied to this member
+        if (size < 0 || (sparse && real_size < 0)) {
+            fprintf(stderr, "Malformed header for member %s in archive %s\n", name, archive_name);
+            file_list_clear(&extracted);
+            return -1;
+        }
+        int extracting = mode == 'x' && (!selective || file_list_contains(files, name));
+        if (extracting && old_sparse) {
+            report_old_sparse(name, archive_name);
+            file_list_clear(&extracted);
+            return -1;
+        }
+        if (extracting && !is_contained_name(name)) {  // checked before any directory above it is made
+            report_uncontained_name(name, archive_name);
+            file_list_clear(&extracted);
+            return -1;
+        }
+        if (header->typeflag == GNUTYPE_SPARSE && header_continues_sparse_map(header, GNU_SPARSE_EXTENDED_OFFSET)) {
+            // Extension blocks continuing the sparse map sit between the header and the contents; 'header' is no longer valid after them
+            off_t skipped = skip_sparse_extensions(stream);
+            if (skipped == -1) {
+                fprintf(stderr, "Failed to read the sparse map of member %s in archive %s\n", name, archive_name);
+                file_list_clear(&extracted);
+                return -1;
+            }
+            offset += skipped;
+        }
+        off_t padding = (BLOCK_SIZE - size % BLOCK_SIZE) % BLOCK_SIZE;
+
+        if (mode == 'd') {  // only contents with a recorded CRC32C can be checked
+            uint32_t crc;
+            stats_add_files(1);
+            if (!has_crc32c) {
+                padding += size;
+            } else if (stream_crc32c(stream, size, &crc) != 0) {
+                snprintf(err_msg, MAX_MSG_LEN, "Failed to read member %s of archive %s", name, archive_name);
+                perror(err_msg);
+                file_list_clear(&extracted);
+                return -1;
+            } else if (crc != crc32c) {
+                report_crc32c_mismatch(name, archive_name, crc32c, crc);
+                mismatched = 1;
+            } else if (file_list_add(files, name) != 0) {
+                snprintf(err_msg, MAX_MSG_LEN, "Failed to add file %s to file list", name);
+                perror(err_msg);
+                file_list_clear(&extracted);
+                return -1;
+            }
+        } else if (mode == 't' || (selective && !file_list_contains(files, name))) {
+            if (mode == 't' && file_list_add(files, name) != 0) {
+                snprintf(err_msg, MAX_MSG_LEN, "Failed to add file %s to file list", name);
+                perror(err_msg);
+                file_list_clear(&extracted);
+                return -1;
+            }
+            if (mode == 't') {
+                stats_add_files(1);
+            }
+            padding += size;  // skip the contents along with their padding
+        } else {
+            if (file_list_add(&extracted, name) != 0) {
+                snprintf(err_msg, MAX_MSG_LEN, "Failed to add file %s to file list", name);
+                perror(err_msg);
+                file_list_clear(&extracted);
+                return -1;
+            }
+            if (header->typeflag == DIRTYPE) {  // a directory only needs creating, it has no contents
+                if (make_directories(name) != 0) {
+                    snprintf(err_msg, MAX_MSG_LEN, "Failed to create directory %s", name);
+                    perror(err_msg);
+                    file_list_clear(&extracted);
+                    return -1;
+                }
+                padding += size;
+            } else if (header->typeflag == LNKTYPE) {  // the target came earlier in the stream, copy it
+                char link_name[sizeof(header->linkname) + 1];
+                memcpy(link_name, header->linkname, sizeof(header->linkname));
+                link_name[sizeof(header->linkname)] = '\0';  // only NUL-terminated when shorter than 100 bytes
+                // Only a file this pass wrote may be copied: never whatever happens to be on disk
+                // under that name, be it stale, outside the extraction, or not selected with -x
+                if (!is_contained_name(link_name) || !file_list_contains(&extracted, link_name)) {
+                    fprintf(stderr, "Link target %s of member %s in archive %s was not extracted\n", link_name, name, archive_name);
+                    file_list_clear(&extracted);
+                    return -1;
+                }
+                if (copy_extracted_file(link_name, name) != 0) {
+                    snprintf(err_msg, MAX_MSG_LEN, "Failed to extract %s as a copy of %s", name, link_name);
+                    perror(err_msg);
+                    file_list_clear(&extracted);
+                    return -1;
+                }
+                padding += size;
+            } else {
+                int new_fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+                if (new_fd == -1 && errno == ENOENT && make_parent_directories(name) == 0) {  // a member of a new directory
+                    new_fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+                }
+                if (new_fd == -1) {
+                    snprintf(err_msg, MAX_MSG_LEN, "Failed to open file %s in %s", name, archive_name);
+                    perror(err_msg);
+                    file_list_clear(&extracted);
+                    return -1;
+                }
+                if (sparse) {  // leaves the stream at the end of the member's contents
+                    if (extract_sparse_stream(stream, archive_name, name, new_fd, size, real_size) != 0) {
+                        close(new_fd);
+                        file_list_clear(&extracted);
+                        return -1;
+                    }
+                } else if (copy_stream_data(stream, new_fd, size) != 0) {
+                    snprintf(err_msg, MAX_MSG_LEN, "Failed to write to file %s", name);
+                    perror(err_msg);
+                    close(new_fd);
+                    file_list_clear(&extracted);
+                    return -1;
+                }
+                if (close(new_fd) != 0) {
+                    snprintf(err_msg, MAX_MSG_LEN, "Failed to close file %s", name);
+                    perror(err_msg);
+                    file_list_clear(&extracted);
+                    return -1;
+                }
+            }
+            stats_add_files(1);
+        }
+        if (skip_bytes(stream, padding) != 0) {
+            snprintf(err_msg, MAX_MSG_LEN, "Failed to read past member %s in archive %s", name, archive_name);
+            perror(err_msg);
+            file_list_clear(&extracted);
+            return -1;
+        }
+        offset += BLOCK_SIZE + (size + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+    }
+    int result = mismatched ? -1 : 0;
+    if (selective && !file_list_is_subset(files, &extracted)) {
+        report_missing_members(archive_name, files, &extracted);
+        result = -1;
+    }
+    file_list_clear(&extracted);
+    return result;
+}
+
+/*
+ * Lists, extracts or verifies (see stream_archive) the possibly compressed archive read from 'archive_fd'
+ * Returns 0 on success or -1 if an error occurs
+ */
+int read_archive_stream(int archive_fd, const char *archive_name, file_list_t *files, char mode) {
+    char err_msg[MAX_MSG_LEN];  // stores error message for printing
+    archive_stream_t stream;
+    if (stream_open_reader(&stream, archive_fd) != 0) {
+        snprintf(err_msg, MAX_MSG_LEN, "Failed to start reading archive %s", archive_name);
+        perror(err_msg);
+        return -1;
+    }
+    int result = stream_archive(&stream, archive_name, files, mode);
+    stream_close(&stream);
+    return result;
+}
+
+/*
+ * Checks whether the archive file 'archive_name' is compressed, and if so lists, extracts
+ * or verifies it through a decompressing stream, since compressed data can't be mapped
+ * Returns 1 if the archive is not compressed (nothing was done), otherwise 0 on success
+ * or -1 if an error occurs
+ */
+int read_compressed_archive(const char *archive_name, file_list_t *files, char mode) {
+    char err_msg[MAX_MSG_LEN];  // stores error message for printing
+    int archive_fd = open(archive_name, O_RDONLY);
+    if (archive_fd == -1) {  // open error check
+        snprintf(err_msg, MAX_MSG_LEN, "Failed to open archive %s", archive_name);
+        perror(err_msg);
+        return -1;
+    }
+    int result = 1;
+    if (stream_detect_file(archive_fd) != COMPRESS_NONE) {
+        result = read_archive_stream(archive_fd, archive_name, files, mode);
+    }
+    close(archive_fd);
+    return result;
+}
+
+/*
+ * Finds where the footer of the mapped archive 'map' starts, right after its last member
+ * An archive that simply ends after its last member has its footer at its end.
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int find_footer(const archive_map_t *map, const char *archive_name, off_t *footer_offset) {
+    member_t member;
+    name_arena_t names;
+    off_t offset = 0;  // offset of the next header
+    int status;
+    name_arena_init(&names);
+    while ((status = parse_member(map, offset, archive_name, &names, &member)) == 0) {
+        offset = member.data_offset + (member.size + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+    }
+    name_arena_clear(&names);
+    *footer_offset = offset;
+    return status == 1 ? 0 : -1;
+}
+
+/*
+ * Records every member of the mapped archive 'map' that a new member could link to in 'dedup'
+ * Members are taken in archive order, so each name ends up with its newest version, which is
+ * the one a link to it refers to.
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int dedup_add_members(dedup_t *dedup, const archive_map_t *map, const char *archive_name) {
+    member_t *members;
+    int count;
+    name_arena_t names;
+    name_arena_init(&names);
+    if (scan_archive_members(map, 0, archive_name, &names, &members, &count) != 0) {
+        name_arena_clear(&names);
+        return -1;
+    }
+    int result = 0;
+    for (int i = 0; i < count && result == 0; i++) {
+        const member_t *member = &members[i];
+        int regular = member->typeflag == REGTYPE || member->typeflag == AREGTYPE;
+        if (regular && !member->sparse && !member->old_sparse && member->size > 0) {
+            result = dedup_index_add(&dedup->index, member->name, member->size, map->data + member->data_offset) == -1 ? -1 : 0;
+        } else {
+            dedup_index_forget(&dedup->index, member->name);
+        }
+    }
+    if (result != 0) {
+        perror("Failed to allocate deduplication index");
+    }
+    free(members);
+    name_arena_clear(&names);
+    return result;
+}
+
+/*
+ * Appends a member for every file and directory found by walking 'files' to the archive
+ * 'archive_name', through a single read-write descriptor
+ * The new members are laid out from the old footer on (see write_members_parallel), except for
+ * their first header block: readers stop at the old footer's zero block, so the archive keeps
+ * reading as its old self until that block is written. Everything else, new footer included,
+ * is flushed with one fdatasync first, and only then is the first block written over the old
+ * footer and flushed, committing the whole batch at once. A crash leaves either the old or the
+ * new archive; anything written past the old footer without the commit is dropped by the next
+ * append, which looks for the footer by following the headers.
+ * Directories in 'files' are only walked into if 'recursive' is set.
+ * '*footer_offset' is set to where the first new member starts.
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int append_members(const char *archive_name, const file_list_t *files, int recursive, off_t *footer_offset) {
+    char err_msg[MAX_MSG_LEN];  // stores error message for printing
+    // Not O_APPEND: copy_file_range refuses to write to descriptors opened for appending
+    int archive_fd = open(archive_name, O_RDWR);
+    if (archive_fd == -1) {
+        snprintf(err_msg, MAX_MSG_LEN, "Failed to open archive %s", archive_name);
+        perror(err_msg);
+        return -1;
+    }
+    compression_t compression = stream_detect_file(archive_fd);
+    if (compression != COMPRESS_NONE) {  // compressed data can't be extended in place
+        fprintf(stderr, "Appending is not supported for %s compressed archives\n", compression_name(compression));
+        close(archive_fd);
+        return -1;
+    }
+    archive_map_t map;
+    if (map_archive_fd(archive_fd, archive_name, MADV_RANDOM, &map) != 0) {
+        close(archive_fd);
+        return -1;
+    }
+    dedup_t dedup;  // with --dedup, the newest existing members can be linked to as well
+    int result = find_footer(&map, archive_name, footer_offset);
+    if (result == 0 && archive_options.dedup) {
+        result = dedup_start(&dedup);
+        if (result != 0) {
+            perror("Failed to allocate deduplication buffers");
+        } else {
+            result = dedup_add_members(&dedup, &map, archive_name);
+        }
+    }
+    if (result != 0) {
+        if (archive_options.dedup) {
+            dedup_stop(&dedup);
+        }
+        unmap_archive(&map);
+        close(archive_fd);
+        return -1;
+    }
+
+    char held[BLOCK_SIZE];  // first header block of the new members, written last
+    int held_used;
+    int committed = 0;
+    result = write_members_parallel(archive_fd, archive_name, files, recursive, *footer_offset, archive_options.num_threads, held, &held_used,
+                                    archive_options.dedup ? &dedup : NULL);
+    if (archive_options.dedup) {
+        dedup_stop(&dedup);
+    }
+    unmap_archive(&map);  // only the existing members were read through it
+    if (result == 0 && held_used) {
+        // Everything that the held block links in must reach the disk before the block itself
+        if (sync_file(archive_fd, 1) != 0) {
+            snprintf(err_msg, MAX_MSG_LEN, "Failed to flush new members to archive %s", archive_name);
+            perror(err_msg);
+            result = -1;
+        } else if (pwrite_all(archive_fd, held, BLOCK_SIZE, *footer_offset) != 0 || sync_file(archive_fd, 1) != 0) {
+            snprintf(err_msg, MAX_MSG_LEN, "Failed to commit new members to archive %s", archive_name);
+            perror(err_msg);
+            committed = -1;  // the block may or may not have landed
+            result = -1;
+        } else {
+            committed = 1;
+        }
+    }
+    // Until the commit, the old archive ends at the old footer: cut off whatever follows it
+    // and put a clean footer back, so a failed append leaves the archive as it was
+    if (result != 0 && committed == 0
+            && (ftruncate(archive_fd, *footer_offset) != 0 || ftruncate(archive_fd, *footer_offset + BLOCK_SIZE * NUM_TRAILING_BLOCKS) != 0)) {
+        snprintf(err_msg, MAX_MSG_LEN, "Failed to restore the footer of archive %s", archive_name);
+        perror(err_msg);
+    }
+    if (close(archive_fd) != 0) {
+        snprintf(err_msg, MAX_MSG_LEN, "Failed to close archive %s", archive_name);
+        perror(err_msg);
+        return -1;
+    }
+    return result;
+}
+
+/*
+ * Brings the index file of 'archive_name' up to date after members were written to it
+ * If 'index' holds the still-valid index from before the write, only the headers from
+ * 'start_offset' onward are scanned and added to it. Otherwise the whole archive is
+ * scanned. 'index' is cleared either way.
+ * Returns 0 on success or -1 if an error occurs
+ */
+int update_archive_index(const char *archive_name, archive_index_t *index, off_t start_offset) {
+    char err_msg[MAX_MSG_LEN];  // stores error message for printing
+    archive_index_t fresh;
+    archive_map_t map;
+    member_t *members;
+    int count;
+    name_arena_t names;
+    if (index == NULL) {  // no usable index to extend, build one from scratch
+        index_init(&fresh);
+        index = &fresh;
+        start_offset = 0;
+    }
+    if (map_archive(archive_name, MADV_RANDOM, &map) != 0) {
+        index_clear(index);
+        return -1;
+    }
+    name_arena_init(&names);
+    if (scan_archive_members(&map, start_offset, archive_name, &names, &members, &count) != 0) {
+        name_arena_clear(&names);
+        unmap_archive(&map);
+        index_clear(index);
+        return -1;
+    }
+    unmap_archive(&map);
+    for (int i = 0; i < count; i++) {
+        if (index_add(index, members[i].name, members[i].header_offset, members[i].real_size, members[i].mtime) != 0) {
+            snprintf(err_msg, MAX_MSG_LEN, "Failed to add %s to the index of archive %s", members[i].name, archive_name);
+            perror(err_msg);
+            free(members);
+            name_arena_clear(&names);
+            index_clear(index);
+            return -1;
+        }
+    }
+    free(members);
+    name_arena_clear(&names);
+    if (index_number_versions(index) != 0 || index_save(archive_name, index) != 0) {
+        snprintf(err_msg, MAX_MSG_LEN, "Failed to write the index of archive %s", archive_name);
+        perror(err_msg);
+        index_clear(index);
+        return -1;
+    }
+    index_clear(index);
+    return 0;
+}
+
+int create_archive(const char *archive_name, const file_list_t *files) {
+    dedup_t dedup;  // contents written so far, with --dedup
+    if (archive_options.dedup && dedup_start(&dedup) != 0) {
+        perror("Failed to allocate deduplication buffers");
+        dedup_stop(&dedup);
+        return -1;
+    }
+    int result = helper(archive_name, files, archive_options.dedup ? &dedup : NULL);  // calls helper function
+    if (archive_options.dedup) {
+        dedup_stop(&dedup);
+    }
+    if (result != 0) { // checks for return status of helper function
+        printf("Error occured while creating %s", archive_name);
+        return -1;
+    }
+    // An index left over from an older archive of the same name is rebuilt, never left stale
+    // Compressed archives have no member offsets to index; a leftover index fails validation instead
+    if (!is_stdio_archive(archive_name) && archive_options.compression == COMPRESS_NONE
+            && (archive_options.use_index || index_exists(archive_name))) {
+        return update_archive_index(archive_name, NULL, 0);
+    }
+    return 0;  // no errors, return success
+}
+
+/*
+ * Appends the files and directories of 'files' to the archive 'archive_name' and brings its index
+ * up to date (see append_files_to_archive); directories are only walked into if 'recursive' is set
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int append_to_archive(const char *archive_name, const file_list_t *files, int recursive) {
+    if (is_stdio_archive(archive_name)) {  // there is no existing archive to append to
+        printf("Error: appending requires an archive file, not standard input/output\n");
+        return -1;
+    }
+    if (archive_options.compression != COMPRESS_NONE) {
+        fprintf(stderr, "Appending is not supported for %s compressed archives\n", compression_name(archive_options.compression));
+        return -1;
+    }
+    archive_index_t index;
+    int indexed = archive_options.use_index || index_exists(archive_name);
+    int have_index = 0;
+    off_t start_offset = 0;
+    if (indexed) {  // must be checked before the append changes the archive's size and mtime
+        have_index = index_load(archive_name, &index) == 0;
+    }
+    if (append_members(archive_name, files, recursive, &start_offset) != 0) {  // new members replace the footer
+        printf("Error occured while appending to %s", archive_name);
+        if (have_index) {
+            index_clear(&index);
+        }
+        return -1;
+    }
+    if (indexed) {
+        return update_archive_index(archive_name, have_index ? &index : NULL, start_offset);
+    }
+    return 0;  // no errors, return success
+}
+
+int append_files_to_archive(const char *archive_name, const file_list_t *files) {
+    return append_to_archive(archive_name, files, 1);
+}
+
+int append_changed_files(const char *archive_name, const file_list_t *changed) {
+    return append_to_archive(archive_name, changed, 0);
+}
+
+/*
+ * Fills '*members' with every member of the mapped archive 'map', in archive order
+ * Uses the archive's index when a valid one exists, and scans the headers otherwise.
+ * Member names are stored in 'names', as with scan_archive_members.
+ * Returns 0 on success or -1 if an error occurs
+ */
+int load_archive_members(const archive_map_t *map, const char *archive_name, name_arena_t *names, member_t **members, int *count) {
+    char err_msg[MAX_MSG_LEN];  // stores error message for printing
+    archive_index_t index;
+    if (index_load(archive_name, &index) != 0) {
+        return scan_archive_members(map, 0, archive_name, names, members, count);
+    }
+    *members = malloc((index.count > 0 ? index.count : 1) * sizeof(member_t));
+    if (*members == NULL) {
+        snprintf(err_msg, MAX_MSG_LEN, "Failed to allocate member table for archive %s", archive_name);
+        perror(err_msg);
+        index_clear(&index);
+        return -1;
+    }
+    for (int i = 0; i < index.count; i++) {
+        // The index only says where each member starts, its headers are still decoded and verified
+        int status = parse_member(map, index.records[i].header_offset, archive_name, names, &(*members)[i]);
+        if (status != 0) {
+            if (status == 1) {  // index and archive disagree
+                fprintf(stderr, "Index of archive %s points past the last member\n", archive_name);
+            }
+            free(*members);
+            index_clear(&index);
+            return -1;
+        }
+        (*members)[i].order = i;
+    }
+    *count = index.count;
+    index_clear(&index);
+    return 0;
+}
+
+int get_archive_file_list(const char *archive_name, file_list_t *files) {
+    char err_msg[MAX_MSG_LEN];  // stores error message for printing
+    archive_index_t index;
+    archive_map_t map;
+    member_t *members;
+    int count;
+    name_arena_t names;
+    if (is_stdio_archive(archive_name)) {  // read the archive as it streams in on standard input
+        return read_archive_stream(STDIN_FILENO, archive_name, files, 't');
+    }
+    int compressed = read_compressed_archive(archive_name, files, 't');
+    if (compressed != 1) {  // compressed archives can only be read as a stream
+        return compressed;
+    }
+    int indexed = index_load(archive_name, &index) == 0;
+    if (indexed && index_has_long_names(&index)) {  // names the index may have cut short are read from the headers instead
+        index_clear(&index);
+        indexed = 0;
+    }
+    if (indexed) {  // names come straight from the index, the archive isn't read at all
+        for (int i = 0; i < index.count; i++) {
+            char name[sizeof(index.records[i].name) + 1];
+            memcpy(name, index.records[i].name, sizeof(index.records[i].name));
+            name[sizeof(index.records[i].name)] = '\0';
+            if (file_list_add(files, name) != 0) {
+                snprintf(err_msg, MAX_MSG_LEN, "Failed to add file %s to file list", name);
+                perror(err_msg);
+                index_clear(&index);
+                return -1;
+            }
+        }
+        stats_add_files(index.count);
+        index_clear(&index);
+        return 0;
+    }
+    // Only headers are read, so don't let read-ahead pull in the bodies between them
+    if (map_archive(archive_name, MADV_RANDOM, &map) != 0) {
+        return -1;
+    }
+    name_arena_init(&names);
+    if (scan_archive_members(&map, 0, archive_name, &names, &members, &count) != 0) {
+        name_arena_clear(&names);
+        unmap_archive(&map);
+        return -1;
+    }
+    for (int i = 0; i < count; i++) {
+        if (file_list_add(files, members[i].name) != 0) {  // add file to list, error check
+            snprintf(err_msg, MAX_MSG_LEN, "Failed to add file %s to file list", members[i].name);
+            perror(err_msg);
+            free(members);
+            name_arena_clear(&names);
+            unmap_archive(&map);
+            return -1;
+        }
+    }
+    stats_add_files(count);
+    free(members);
+    name_arena_clear(&names);
+    unmap_archive(&map);
+    return 0;
+}
+
+/*
+ * qsort comparison placing members with the same name next to each other, oldest version first
+ */
+static int compare_members(const void *a, const void *b) {
+    const member_t *m1 = a;
+    const member_t *m2 = b;
+    int cmp = strcmp(m1->name, m2->name);
+    if (cmp != 0) {
+        return cmp;
+    }
+    return (m1->order > m2->order) - (m1->order < m2->order);
+}
+
+/*
+ * qsort comparison putting an array of member pointers back into archive order
+ */
+static int compare_member_order(const void *a, const void *b) {
+    const member_t *m1 = *(member_t *const *)a;
+    const member_t *m2 = *(member_t *const *)b;
+    return (m1->order > m2->order) - (m1->order < m2->order);
+}
+
+/*
+ * Picks the newest version of every name among the 'count' members of an archive
+ * Reorders 'members' by name; the returned plan points into it, in archive order.
+ * Returns the plan, with its length in '*plan_size', or NULL if it can't be allocated
+ */
+static member_t **plan_newest_members(member_t *members, int count, int *plan_size) {
+    // Group versions of each name together so only the newest one is kept
+    qsort(members, count, sizeof(member_t), compare_members);
+    member_t **plan = malloc((count > 0 ? count : 1) * sizeof(member_t *));
+    if (plan == NULL) {
+        return NULL;
+    }
+    *plan_size = 0;
+    for (int i = 0; i < count; i++) {
+        if (i + 1 < count && strcmp(members[i].name, members[i + 1].name) == 0) {
+            continue;  // superseded by a later version of the same file
+        }
+        plan[(*plan_size)++] = &members[i];
+    }
+    qsort(plan, *plan_size, sizeof(member_t *), compare_member_order);  // keep reads moving forward through the archive
+    return plan;
+}
+
+/*
+ * bsearch comparison finding a member_t by name alone
+ */
+static int compare_member_names(const void *a, const void *b) {
+    return strcmp(((const member_t *)a)->name, ((const member_t *)b)->name);
+}
+
+/*
+ * Finds the member the hard link 'member' refers to: the newest member of its link name that
+ * comes before it in the archive. 'members' must be sorted with compare_members.
+ * Returns the target, which may be a link itself, or NULL if there is none
+ */
+static const member_t *link_target(const archive_map_t *map, const member_t *members, int count, const member_t *member) {
+    member_t key;
+    const tar_header *header = (const tar_header *)(map->data + member->data_offset - BLOCK_SIZE);
+    char link_name[sizeof(header->linkname) + 1];
+    memcpy(link_name, header->linkname, sizeof(header->linkname));
+    link_name[sizeof(header->linkname)] = '\0';  // only NUL-terminated when shorter than 100 bytes
+    key.name = link_name;
+    const member_t *found = bsearch(&key, members, count, sizeof(member_t), compare_member_names);
+    if (found == NULL) {
+        return NULL;
+    }
+    while (found > members && strcmp(found[-1].name, key.name) == 0) {  // back to the oldest version
+        found--;
+    }
+    const member_t *target = NULL;
+    for (; found < members + count && strcmp(found->name, key.name) == 0 && found->order < member->order; found++) {
+        target = found;
+    }
+    return target;
+}
+
+/*
+ * Finds the member whose contents 'member' extracts to, following links (see link_target)
+ * Returns 'member' itself if it isn't a link, or NULL if a target can't be found
+ */
+static const member_t *resolve_link(const archive_map_t *map, const member_t *members, int count, const member_t *member) {
+    for (int hops = 0; member != NULL && member->typeflag == LNKTYPE; hops++) {
+        if (hops == count) {  // a cycle, which only a damaged archive can contain
+            return NULL;
+        }
+        member = link_target(map, members, count, member);
+    }
+    return member;
+}
+
+/*
+ * Decodes the sparse map at the start of the contents of the sparse member 'member' into 'holes'
+ * '*map_bytes' is set to the size of the map rounded up to whole blocks, which is where the
+ * member's data runs start.
+ * Returns 0 on success or -1 (with errno set to EINVAL) if the map is malformed, or doesn't fit
+ * the member or the size of the file it describes
+ */
+static int load_sparse_map(const archive_map_t *map, const member_t *member, sparse_map_t *holes, off_t *map_bytes) {
+    size_t used;
+    if (sparse_map_decode(map->data + member->data_offset, member->size, holes, &used) != 1) {
+        errno = EINVAL;
+        return -1;
+    }
+    *map_bytes = (used + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+    const sparse_segment_t *last = holes->count > 0 ? &holes->segments[holes->count - 1] : NULL;
+    if (*map_bytes + sparse_map_data_size(holes) > member->size
+            || (last != NULL && last->offset + last->size > member->real_size)) {
+        sparse_map_clear(holes);
+        errno = EINVAL;
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Checks whether the 'len' bytes at 'offset' of the file open as 'fd' equal 'stored',
+ * or are all zeros if 'stored' is NULL, reading them through 'buffer'
+ * Returns 1 if they match, 0 if they differ (or the file ends early), or -1 if an error occurs
+ */
+static int compare_file_range(int fd, char *buffer, off_t offset, off_t len, const char *stored) {
+    while (len > 0) {
+        size_t chunk = len < COPY_BUFFER_SIZE ? len : COPY_BUFFER_SIZE;
+        ssize_t nread = pread(fd, buffer, chunk, offset);
+        if (nread == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (nread == 0) {  // the file may have shrunk since it was inspected
+            return 0;
+        }
+        if (stored != NULL ? memcmp(buffer, stored, nread) != 0
+                           : buffer[0] != 0 || memcmp(buffer, buffer + 1, nread - 1) != 0) {
+            return 0;
+        }
+        if (stored != NULL) {
+            stored += nread;
+        }
+        offset += nread;
+        len -= nread;
+    }
+    return 1;
+}
+
+/*
+ * Finds the newest version of 'name' among the 'count' members sorted by compare_members
+ * A directory is found by its name with or without the trailing slash of its member.
+ * Returns the member, or NULL if the archive has no member of that name
+ */
+static const member_t *find_newest_member(const member_t *members, int count, const char *name) {
+    char dir_name[PATH_MAX];
+    member_t key;
+    key.name = name;
+    const member_t *newest = bsearch(&key, members, count, sizeof(member_t), compare_member_names);
+    size_t len = strlen(name);
+    while (len > 1 && name[len - 1] == '/') {
+        len--;
+    }
+    if (newest == NULL && len + 1 < sizeof(dir_name)) {  // "dir" and "dir/" both name the member "dir/"
+        memcpy(dir_name, name, len);
+        strcpy(dir_name + len, "/");
+        key.name = dir_name;
+        newest = bsearch(&key, members, count, sizeof(member_t), compare_member_names);
+    }
+    while (newest != NULL && newest + 1 < members + count && strcmp(newest[1].name, key.name) == 0) {
+        newest++;
+    }
+    return newest;
+}
+
+/*
+ * Checks whether the contents of the file 'file_name' are exactly the bytes stored for 'member'
+ * For a sparse member, the file must hold the member's data runs with zeros everywhere else.
+ * Returns 1 if they match, 0 if they differ, or -1 if an error occurs
+ */
+static int member_matches_file(const archive_map_t *map, const member_t *member, const char *file_name) {
+    sparse_map_t holes;  // the member's data runs, a single run unless it is sparse
+    sparse_segment_t whole = {0, member->size};
+    off_t map_bytes = 0;
+    sparse_map_init(&holes);
+    if (member->sparse && load_sparse_map(map, member, &holes, &map_bytes) != 0) {
+        return -1;
+    }
+    const sparse_segment_t *segments = member->sparse ? holes.segments : &whole;
+    int count = member->sparse ? holes.count : 1;
+
+    struct stat stat_buf;
+    int fd = open(file_name, O_RDONLY);
+    if (fd == -1 || fstat(fd, &stat_buf) != 0) {
+        if (fd != -1) {
+            close(fd);
+        }
+        sparse_map_clear(&holes);
+        return -1;
+    }
+    char *buffer = malloc(COPY_BUFFER_SIZE);
+    if (buffer == NULL) {
+        close(fd);
+        sparse_map_clear(&holes);
+        return -1;
+    }
+    const char *stored = map->data + member->data_offset + map_bytes;
+    off_t position = 0;  // end of the last range compared
+    int result = stat_buf.st_size == member->real_size;
+    for (int i = 0; i < count && result == 1; i++) {
+        result = compare_file_range(fd, buffer, position, segments[i].offset - position, NULL);
+        if (result == 1) {
+            result = compare_file_range(fd, buffer, segments[i].offset, segments[i].size, stored);
+        }
+        stored += segments[i].size;
+        position = segments[i].offset + segments[i].size;
+    }
+    if (result == 1) {  // a hole at the end of the file
+        result = compare_file_range(fd, buffer, position, member->real_size - position, NULL);
+    }
+    free(buffer);
+    close(fd);
+    sparse_map_clear(&holes);
+    return result;
+}
+
+int get_changed_files(const char *archive_name, const file_list_t *files, file_list_t *changed) {
+    char err_msg[MAX_MSG_LEN];  // stores error message for printing
+    archive_map_t map;
+    member_t *members;
+    int count;
+    struct stat archive_stat;
+    name_arena_t names;
+    if (stat(archive_name, &archive_stat) != 0) {
+        snprintf(err_msg, MAX_MSG_LEN, "Failed to stat archive %s", archive_name);
+        perror(err_msg);
+        return -1;
+    }
+    int archive_fd = open(archive_name, O_RDONLY);
+    if (archive_fd != -1) {  // a failed open is reported by map_archive below
+        compression_t compression = stream_detect_file(archive_fd);
+        close(archive_fd);
+        if (compression != COMPRESS_NONE) {
+            fprintf(stderr, "Updating is not supported for %s compressed archives\n", compression_name(compression));
+            return -1;
+        }
+    }
+    // Only headers are read to find each file's newest version, contents only if compared below
+    if (map_archive(archive_name, MADV_RANDOM, &map) != 0) {
+        return -1;
+    }
+    name_arena_init(&names);
+    if (load_archive_members(&map, archive_name, &names, &members, &count) != 0) {
+        name_arena_clear(&names);
+        unmap_archive(&map);
+        return -1;
+    }
+    qsort(members, count, sizeof(member_t), compare_members);  // versions of a name end up in archive order
+
+    int result = 0;
+    for (const node_t *current = files->head; current != NULL; current = current->next) {
+        if (find_newest_member(members, count, current->name) == NULL) {
+            result = 1;  // not in the archive at all
+            break;
+        }
+    }
+    tree_walk_t *walk = result == 0 ? tree_walk_start(files, 1, walk_threads()) : NULL;
+    if (result == 0 && walk == NULL) {
+        perror("Failed to start walking the files to update");
+        result = -1;
+    }
+    while (result == 0) {
+        char *name;
+        struct stat stat_buf;
+        uint64_t start = stats_start();
+        int found = tree_walk_next(walk, &name, &stat_buf);
+        stats_add(STATS_METADATA, start, 0, 1);
+        if (found != 1) {
+            if (found == -1) {
+                report_walk_error(name, archive_name);
+                result = -1;
+            }
+            free(name);
+            break;
+        }
+        int is_dir = S_ISDIR(stat_buf.st_mode);
+        const member_t *newest = find_newest_member(members, count, name);
+        int is_changed;
+        if (newest == NULL) {  // new below a walked directory
+            is_changed = 1;
+        } else if (is_dir || newest->typeflag == DIRTYPE) {  // a directory's size says nothing about its entries
+            is_changed = !is_dir || newest->typeflag != DIRTYPE || stat_buf.st_mtime != newest->mtime;
+        } else {
+            // A link made by --dedup keeps its own modification time, but its contents are the target's
+            const member_t *contents = resolve_link(&map, members, count, newest);
+            if (contents == NULL) {
+                fprintf(stderr, "Link target of member %s in archive %s not found\n", newest->name, archive_name);
+                free(name);
+                result = -1;
+                break;
+            }
+            // Contents in an old sparse format can't be compared, the file is stored again in one minitar reads
+            is_changed = contents->old_sparse || stat_buf.st_size != contents->real_size || stat_buf.st_mtime != newest->mtime;
+            // Headers only keep whole seconds, so a file written again in the same second the archive
+            // was last written may look unchanged: like git's "racily clean" entries, compare contents
+            int racy = stat_buf.st_mtim.tv_sec > archive_stat.st_mtim.tv_sec
+                    || (stat_buf.st_mtim.tv_sec == archive_stat.st_mtim.tv_sec && stat_buf.st_mtim.tv_nsec >= archive_stat.st_mtim.tv_nsec);
+            if (!is_changed && (archive_options.check_content || racy)) {
+                int matches = member_matches_file(&map, contents, name);
+                if (matches == -1) {
+                    snprintf(err_msg, MAX_MSG_LEN, "Failed to compare file %s with archive %s", name, archive_name);
+                    perror(err_msg);
+                    free(name);
+                    result = -1;
+                    break;
+                }
+                is_changed = !matches;
+            }
+        }
+        if (is_changed && file_list_add(changed, name) != 0) {
+            snprintf(err_msg, MAX_MSG_LEN, "Failed to add file %s to file list", name);
+            perror(err_msg);
+            result = -1;
+        }
+        free(name);
+    }
+    if (walk != NULL) {
+        tree_walk_stop(walk);
+    }
+    free(members);
+    name_arena_clear(&names);
+    unmap_archive(&map);
+    return result;
+}
+
+/*
+ * Writes the data runs of the sparse member 'member' at their offsets in the file open as 'fd',
+ * then extends the file to its full size, so its holes are holes again rather than written zeros
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int extract_sparse_data(const archive_map_t *map, const char *archive_name, const member_t *member, int fd) {
+    char err_msg[MAX_MSG_LEN];  // stores error message for printing
+    sparse_map_t holes;
+    off_t map_bytes;
+    sparse_map_init(&holes);
+    if (load_sparse_map(map, member, &holes, &map_bytes) != 0) {
+        fprintf(stderr, "Malformed sparse map for member %s in archive %s\n", member->name, archive_name);
+        return -1;
+    }
+    const char *data = map->data + member->data_offset + map_bytes;
+    int result = 0;
+    uint64_t start = stats_start();
+    for (int i = 0; i < holes.count && result == 0; i++) {
+        result = pwrite_all(fd, data, holes.segments[i].size, holes.segments[i].offset);
+        data += holes.segments[i].size;
+    }
+    stats_add(STATS_COPY, start, sparse_map_data_size(&holes), holes.count);
+    if (result == 0) {
+        result = ftruncate(fd, member->real_size);
+    }
+    if (result != 0) {
+        snprintf(err_msg, MAX_MSG_LEN, "Failed to write to file %s", member->name);
+        perror(err_msg);
+    }
+    sparse_map_clear(&holes);
+    return result;
+}
+
+/*
+ * Writes the contents of 'member' to a new file of the same name in the current directory
+ * The contents are written straight out of the mapped archive 'map', with no copy in between.
+ * Returns 0 on success or -1 if an error occurs
+ */
+int extract_member(const archive_map_t *map, const char *archive_name, const member_t *member) {
+    char err_msg[MAX_MSG_LEN];  // stores error message for printing
+    int new_fd = open(member->name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (new_fd == -1) {  // open error check
+        snprintf(err_msg, MAX_MSG_LEN, "Failed to open file %s in %s", member->name, archive_name);
+        perror(err_msg);
+        return -1;
+    }
+    uint64_t start = stats_start();
+    if (member->sparse) {  // write only the data runs, leaving holes where the file had them
+        if (extract_sparse_data(map, archive_name, member, new_fd) != 0) {
+            close(new_fd);
+            return -1;
+        }
+    } else if (write_all(new_fd, map->data + member->data_offset, member->size) != 0) {
+        snprintf(err_msg, MAX_MSG_LEN, "Failed to write to file %s", member->name);
+        perror(err_msg);
+        close(new_fd);
+        return -1;
+    } else {
+        stats_add(STATS_COPY, start, member->size, 1);
+    }
+    if (close(new_fd) != 0) {
+        snprintf(err_msg, MAX_MSG_LEN, "Failed to close file %s", member->name);
+        perror(err_msg);
+        return -1;
+    }
+    stats_add_files(1);
+    return 0;
+}
+
+// Work shared by the extraction worker threads
+typedef struct {
+    const archive_map_t *map;
+    const char *archive_name;
+    member_t **plan;  // members to write, one per file name
+    int plan_size;
+    int next;  // index of the next member nobody has claimed yet
+    int failed;  // set once any worker hits an error, so the others stop early
+    pthread_mutex_t lock;  // protects 'next' and 'failed'
+} extract_job_t;
+
+/*
+ * Thread body for parallel extraction
+ * Repeatedly claims the next unwritten member and extracts it until the plan runs out
+ */
+static void *extract_worker(void *arg) {
+    extract_job_t *job = arg;
+    while (1) {
+        pthread_mutex_lock(&job->lock);
+        if (job->failed || job->next == job->plan_size) {
+            pthread_mutex_unlock(&job->lock);
+            return NULL;
+        }
+        member_t *member = job->plan[job->next++];
+        pthread_mutex_unlock(&job->lock);
+
+        if (extract_member(job->map, job->archive_name, member) != 0) {
+            pthread_mutex_lock(&job->lock);
+            job->failed = 1;
+            pthread_mutex_unlock(&job->lock);
+            return NULL;
+        }
+    }
+}
+
+/*
+ * Extracts every member in 'plan' using 'num_threads' threads
+ * Each thread writes one whole member at a time straight from the shared mapping,
+ * so no thread holds a private copy of any member's contents.
+ * Returns 0 on success or -1 if any member failed
+ */
+static int extract_members_parallel(const archive_map_t *map, const char *archive_name, member_t **plan, int plan_size, int num_threads) {
+    char err_msg[MAX_MSG_LEN];  // stores error message for printing
+    extract_job_t job = {map, archive_name, plan, plan_size, 0, 0};
+    pthread_t threads[MAX_THREADS];
+    int started = 0;
+    pthread_mutex_init(&job.lock, NULL);
+    if (num_threads > plan_size) {  // no point starting threads that would have nothing to do
+        num_threads = plan_size;
+    }
+    for (; started < num_threads; started++) {
+        if (pthread_create(&threads[started], NULL, extract_worker, &job) != 0) {
+            snprintf(err_msg, MAX_MSG_LEN, "Failed to start extraction thread for archive %s", archive_name);
+            perror(err_msg);
+            pthread_mutex_lock(&job.lock);
+            job.failed = 1;
+            pthread_mutex_unlock(&job.lock);
+            break;
+        }
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    pthread_mutex_destroy(&job.lock);
+    return job.failed ? -1 : 0;
+}
+
+/*
+ * Extracts every member in 'plan' through io_uring, writing straight from the mapping
+ * Sparse members are extracted first, with extract_member, since only their data runs are written.
+ * Returns 0 on success or -1 if any member failed
  */
-int remove_trailing_bytes(const char *file_name, size_t nbytes) {
-    char err_msg[MAX_MSG_LEN];
-    // Note: ftruncate does not work with O_APPEND
-    int fd = open(file_name, O_WRONLY);
-    if (fd == -1) {
-        snprintf(err_msg, MAX_MSG_LEN, "Failed to open file %s", file_name);
+static int extract_members_uring(const archive_map_t *map, const char *archive_name, member_t **plan, int plan_size) {
+    char err_msg[MAX_MSG_LEN];  // stores error message for printing
+    uring_copy_t *copies = malloc((plan_size > 0 ? plan_size : 1) * sizeof(uring_copy_t));
+    member_t **copied = malloc((plan_size > 0 ? plan_size : 1) * sizeof(member_t *));  // member of each copy
+    if (copies == NULL || copied == NULL) {
+        snprintf(err_msg, MAX_MSG_LEN, "Failed to allocate copy list for archive %s", archive_name);
         perror(err_msg);
+        free(copies);
+        free(copied);
         return -1;
     }
-    //  Seek to end of file - nbytes
-    off_t current_pos = lseek(fd, -1 * nbytes, SEEK_END);
-    if (current_pos == -1) {
-        snprintf(err_msg, MAX_MSG_LEN, "Failed to seek in file %s", file_name);
-        perror(err_msg);
-        close(fd);
-        return -1;
+    int count = 0;
+    for (int i = 0; i < plan_size; i++) {
+        if (plan[i]->sparse) {
+            if (extract_member(map, archive_name, plan[i]) != 0) {
+                free(copies);
+                free(copied);
+                return -1;
+            }
+            continue;
+        }
+        copied[count] = plan[i];
+        copies[count++] = (uring_copy_t){NULL, map->data + plan[i]->data_offset, -1, 0, plan[i]->name, -1, 0, plan[i]->size};
     }
-    // Remove all contents of file past current position
-    if (ftruncate(fd, current_pos) == -1) {
-        snprintf(err_msg, MAX_MSG_LEN, "Failed to truncate file %s", file_name);
+    int failed;
+    uint64_t start = stats_start();
+    int result = uring_copy_run(copies, count, &failed);
+    if (result != 0) {
+        if (failed == -1) {
+            snprintf(err_msg, MAX_MSG_LEN, "Failed to set up io_uring for archive %s", archive_name);
+        } else {
+            snprintf(err_msg, MAX_MSG_LEN, "Failed to extract file %s from %s", copied[failed]->name, archive_name);
+        }
         perror(err_msg);
-        close(fd);
-        return -1;
+    } else if (stats_enabled) {
+        off_t total = 0;
+        for (int i = 0; i < count; i++) {
+            total += copies[i].size;
+        }
+        stats_add(STATS_COPY, start, total, 0);  // the ring batches its system calls, none per copy
+        stats_add_files(count);
     }
-    if (close(fd) == -1) {
-        snprintf(err_msg, MAX_MSG_LEN, "Failed to close file %s", file_name);
+    free(copies);
+    free(copied);
+    return result;
+}
+
+/*
+ * Replaces every hard link in 'plan' with a copy of the member it refers to, under the link's
+ * own name, so that links extract like any other member, to files of their own
+ * 'members' must be sorted with compare_members. The copies are allocated into '*resolved',
+ * for the caller to free.
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int resolve_plan_links(const archive_map_t *map, const char *archive_name, const member_t *members, int count,
+                              member_t **plan, int plan_size, member_t **resolved) {
+    char err_msg[MAX_MSG_LEN];  // stores error message for printing
+    int num_links = 0;
+    for (int i = 0; i < plan_size; i++) {
+        num_links += plan[i]->typeflag == LNKTYPE;
+    }
+    *resolved = NULL;
+    if (num_links == 0) {
+        return 0;
+    }
+    *resolved = malloc(num_links * sizeof(member_t));
+    if (*resolved == NULL) {
+        snprintf(err_msg, MAX_MSG_LEN, "Failed to allocate extraction plan for archive %s", archive_name);
         perror(err_msg);
         return -1;
     }
+    member_t *copy = *resolved;
+    for (int i = 0; i < plan_size; i++) {
+        if (plan[i]->typeflag != LNKTYPE) {
+            continue;
+        }
+        const member_t *target = resolve_link(map, members, count, plan[i]);
+        if (target == NULL) {
+            fprintf(stderr, "Link target of member %s in archive %s not found\n", plan[i]->name, archive_name);
+            return -1;
+        }
+        *copy = *target;
+        copy->name = plan[i]->name;
+        copy->order = plan[i]->order;
+        plan[i] = copy++;
+    }
     return 0;
 }
+
 /*
- * helper function for create_archive and append_archive
- * will either create/overwrite archive or append to the end of existing archive depending on mode
+ * Checks that every member of 'plan', with its links already resolved, can be extracted
+ * A member in an old GNU sparse format can't: its contents are packed data runs, not the file.
+ * Nor can a member whose name is absolute or has a ".." component, which would land outside
+ * the directory the archive is extracted into.
+ * Returns 0 if all can or -1 (after reporting the first that can't) otherwise
  */
-int helper(const char *archive_name, const file_list_t *files, char mode) {
-    // char mode helps distinguish between "a" for appending and "w" for writing
-    char buffer[MAX_MSG_LEN];
-    char err_msg[MAX_MSG_LEN];  // stores error message for printing
-    FILE *temp_ptr;  // used for individual files to move into the archive
-    FILE *archive_ptr;  // used for the archive ONLY
-    node_t *current = files->head;  // used to navigate the file_list_t *files
-    tar_header temp_header;
-
-    if (mode == 'c') {  // for creating, open archive for writing
-        archive_ptr = fopen(archive_name, "w");
-        if (archive_ptr == NULL) {
-            snprintf(err_msg, MAX_MSG_LEN, "Failed to open archive %s", archive_name);
-            perror(err_msg);
-            fclose(archive_ptr);
-            return -1;
-        }  
-    } else {  // to avoid overwriting, open archive for appending
-        archive_ptr = fopen(archive_name, "a");
-        if (archive_ptr == NULL) {
-            snprintf(err_msg, MAX_MSG_LEN, "Failed to open archive %s", archive_name);
-            perror(err_msg);
-            fclose(archive_ptr);
+static int check_plan_members(const char *archive_name, member_t *const *plan, int plan_size) {
+    for (int i = 0; i < plan_size; i++) {
+        if (plan[i]->old_sparse) {
+            report_old_sparse(plan[i]->name, archive_name);
             return -1;
         }
-        if (remove_trailing_bytes(archive_name, MAX_MSG_LEN * NUM_TRAILING_BLOCKS) != 0) {  // make sure remove_trailing_bytes doesn't return error
-            snprintf(err_msg, MAX_MSG_LEN, "Failed to remove trailing bytes from %s", archive_name);
-            perror(err_msg);
-            fclose(archive_ptr);
+        if (!is_contained_name(plan[i]->name)) {
+            report_uncontained_name(plan[i]->name, archive_name);
             return -1;
         }
     }
+    return 0;
+}
 
-    for (int i = 0; i < files->size; i++) {
-        temp_ptr = fopen(current->name, "r");
-        if (temp_ptr == NULL) {  // fopen error check
-            snprintf(err_msg, MAX_MSG_LEN, "Failed to open file %s in %s", current->name, archive_name);
-            perror(err_msg);
-            fclose(temp_ptr);
-            fclose(archive_ptr);
-            return -1;
-        }
-        if (fill_tar_header(&temp_header, current->name) != 0) {  // calls fill_tar_header and checks for error
-            snprintf(err_msg, MAX_MSG_LEN, "Failed to fill tar header for %s in %s", current->name, archive_name);
-            perror(err_msg);
-            fclose(temp_ptr);
-            fclose(archive_ptr);
-            return -1;
+/*
+ * Creates every directory member of 'plan' and the directories above every other member,
+ * then drops the directory members from the plan, leaving only files to extract
+ * Done up front, so extraction threads never race to create the same directory.
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int create_member_directories(const char *archive_name, member_t **plan, int *plan_size) {
+    char err_msg[MAX_MSG_LEN];  // stores error message for printing
+    char created[PATH_MAX] = "";  // last directory created, members in archive order mostly share it
+    int kept = 0;
+    for (int i = 0; i < *plan_size; i++) {
+        const char *name = plan[i]->name;
+        int is_dir = plan[i]->typeflag == DIRTYPE;
+        const char *slash = strrchr(name, '/');
+        size_t len = is_dir ? strlen(name) : slash == NULL ? 0 : (size_t)(slash - name);
+        while (len > 1 && name[len - 1] == '/') {  // "dir/" and the parent of "dir/file" are the same
+            len--;
         }
-        if (fwrite(&temp_header, 1, MAX_MSG_LEN, archive_ptr) < MAX_MSG_LEN) {  // fwrite error check
-            snprintf(err_msg, MAX_MSG_LEN, "Failed to write the entire tar header for %s in %s", current->name, archive_name);
+        if (len >= sizeof(created)) {
+            errno = ENAMETOOLONG;
+            snprintf(err_msg, MAX_MSG_LEN, "Failed to create directory for member %s of archive %s", name, archive_name);
             perror(err_msg);
-            fclose(temp_ptr);
-            fclose(archive_ptr);
             return -1;
         }
-        // The following (fseek, size, rewind) are used to count the remaining bytes of a file to know when we can/can't fread and fwrite a full 512 bytes
-        fseek(temp_ptr, 0L, SEEK_END);  // seek to end of temp_ptr's file
-        int size = ftell(temp_ptr);  // store the offset from beginning (aka. total bytes of the file)
-        if (size == -1) {  // error checking fseek/ftell
-            snprintf(err_msg, MAX_MSG_LEN, "Failed to seek in file %s in archive %s after successfully writing the tar header", current->name, archive_name);
-            perror(err_msg);
-            fclose(temp_ptr);
-            fclose(archive_ptr);
-            return -1;
+        if (len > 0 && (strncmp(created, name, len) != 0 || created[len] != '\0')) {
+            memcpy(created, name, len);
+            created[len] = '\0';
+            if (make_directories(created) != 0) {
+                snprintf(err_msg, MAX_MSG_LEN, "Failed to create directory %.*s for archive %s", (int)len, name, archive_name);
+                perror(err_msg);
+                return -1;
+            }
         }
-        rewind(temp_ptr);  // rewind the pointer to the start of the file
-        if (ftell(temp_ptr) != 0) {  // error checking rewind -- should point to beginning of temp_ptr's file
-            snprintf(err_msg, MAX_MSG_LEN, "Failed to rewind in file %s in archive %s after successfully writing the tar header", current->name, archive_name);
-            perror(err_msg);
-            fclose(temp_ptr);
-            fclose(archive_ptr);
-            return -1;
+        if (!is_dir) {
+            plan[kept++] = plan[i];
         }
+    }
+    stats_add_files(*plan_size - kept);  // the files are counted as they are extracted
+    *plan_size = kept;
+    return 0;
+}
 
-        while (size > 0) {  // while temp_ptr's file has bytes left to read
-            if (size >= MAX_MSG_LEN) {  // if remaining bytes exceed 512 bytes, we're good to read and write a full block
-                fread(buffer, MAX_MSG_LEN, 1, temp_ptr);
-                if (ferror(temp_ptr)) {
-                    snprintf(err_msg, MAX_MSG_LEN, "Failed to read file %s in archive %s while copying contents. ferror value: %d", current->name, archive_name, ferror(temp_ptr));
-                    perror(err_msg);
-                    fclose(temp_ptr);
-                    fclose(archive_ptr);
-                    return -1;
-                }   
-                if (fwrite(buffer, MAX_MSG_LEN, 1, archive_ptr) < 1) {
-                    snprintf(err_msg, MAX_MSG_LEN, "Failed to write a block from %s to %s", current->name, archive_name);
-                    perror(err_msg);
-                    fclose(temp_ptr);
-                    fclose(archive_ptr);
-                    return -1;
-                }
-                size -= MAX_MSG_LEN;  // update how many bytes are remaining by subtracting the block we just read/wrote
-            } else {  // if remaining bytes to read is less than a full 512 block
-                memset(buffer, 0, MAX_MSG_LEN);  // set buffer to 512 zero chars
-                fread(buffer, 1, size, temp_ptr);  // read in size (which is less than 512) bytes to buffer
-                if (ferror(temp_ptr)) {
-                    snprintf(err_msg, MAX_MSG_LEN, "Failed to read file %s in archive %s while copying contents for FINAL block. ferror value: %d", current->name, archive_name, ferror(temp_ptr));
-                    perror(err_msg);
-                    fclose(temp_ptr);
-                    fclose(archive_ptr);
-                    return -1;
-                }   
-                if (fwrite(buffer, 1, MAX_MSG_LEN, archive_ptr) < MAX_MSG_LEN) {
-                    snprintf(err_msg, MAX_MSG_LEN, "Failed to write the FINAL block from %s to %s", current->name, archive_name);
-                    perror(err_msg);
-                    fclose(temp_ptr);
-                    fclose(archive_ptr);
-                    return -1;
-                }
-                size = 0;  // already wrote final block, make sure while loop stops
-            }
-        } 
-        current = current->next;  // finished copying contents from a file to the archive, so move on to next file
-        if (fclose(temp_ptr) == -1) {  // close file/error check
-            snprintf(err_msg, MAX_MSG_LEN, "Failed to close file %s", current->name);
-            perror(err_msg);
-            fclose(archive_ptr);
-            return -1;
-        }
-    }  // finished file copying loop
-    // create footer (two 0 char blocks)
-    memset(buffer, 0, MAX_MSG_LEN);  // set buffer to all 0 chars
-    if (fwrite(buffer, MAX_MSG_LEN, 1, archive_ptr) < 1) { // write first block
-        snprintf(err_msg, MAX_MSG_LEN, "Failed to write footer blocks for %s", archive_name);
-        perror(err_msg);
-        fclose(archive_ptr);
+int extract_files_from_archive(const char *archive_name, const file_list_t *files) {
+    char err_msg[MAX_MSG_LEN];  // stores error message for printing
+    archive_map_t map;
+    member_t *members;
+    name_arena_t names;
+    int count;
+    if (is_stdio_archive(archive_name)) {  // no mapping or planning possible, extract as the archive streams in
+        return read_archive_stream(STDIN_FILENO, archive_name, (file_list_t *)files, 'x');  // only read in mode 'x'
+    }
+    int compressed = read_compressed_archive(archive_name, (file_list_t *)files, 'x');
+    if (compressed != 1) {  // compressed archives can only be read as a stream
+        return compressed;
+    }
+    // Bodies are written in archive order, so read-ahead on the mapping pays off, unless only a few
+    // members are wanted: then only their headers and contents should be read from disk
+    int selective = files != NULL && files->size > 0;
+    if (map_archive(archive_name, selective ? MADV_RANDOM : MADV_SEQUENTIAL, &map) != 0) {
         return -1;
     }
-    if (fwrite(buffer, MAX_MSG_LEN, 1, archive_ptr) < 1) { // write second block
-        snprintf(err_msg, MAX_MSG_LEN, "Failed to write footer blocks for %s", archive_name);
-        perror(err_msg);
-        fclose(archive_ptr);
+    // Plan first: one header-only pass (or the index) finds every member without touching any body
+    name_arena_init(&names);
+    if (load_archive_members(&map, archive_name, &names, &members, &count) != 0) {
+        name_arena_clear(&names);
+        unmap_archive(&map);
         return -1;
     }
-    if (fclose(archive_ptr) != 0) {
-        snprintf(err_msg, MAX_MSG_LEN, "Failed to close archive %s after creating footer", archive_name);
+    int plan_size;
+    member_t **plan = plan_newest_members(members, count, &plan_size);
+    if (plan == NULL) {
+        snprintf(err_msg, MAX_MSG_LEN, "Failed to allocate extraction plan for archive %s", archive_name);
         perror(err_msg);
+        free(members);
+        name_arena_clear(&names);
+        unmap_archive(&map);
         return -1;
     }
-    return 0;
+    if (selective) {  // narrow the plan down to the requested names
+        file_list_t found;
+        file_list_init(&found);
+        int kept = 0;
+        int result = 0;
+        for (int i = 0; i < plan_size && result == 0; i++) {
+            if (file_list_contains(files, plan[i]->name)) {
+                plan[kept++] = plan[i];
+                result = file_list_add(&found, plan[i]->name);
+            }
+        }
+        if (result == 0 && !file_list_is_subset(files, &found)) {
+            report_missing_members(archive_name, files, &found);
+            result = -1;
+        }
+        file_list_clear(&found);
+        if (result != 0) {
+            free(plan);
+            free(members);
+            name_arena_clear(&names);
+            unmap_archive(&map);
+            return -1;
+        }
+        plan_size = kept;
+    }
+
+    member_t *resolved;  // copies of the members that links in the plan refer to
+    int result = resolve_plan_links(&map, archive_name, members, count, plan, plan_size, &resolved);
+    if (result == 0) {  // before anything is written
+        result = check_plan_members(archive_name, plan, plan_size);
+    }
+    if (result == 0) {
+        result = create_member_directories(archive_name, plan, &plan_size);
+    }
+    if (result == 0 && archive_options.use_io_uring && uring_available()) {
+        result = extract_members_uring(&map, archive_name, plan, plan_size);
+    } else if (result == 0 && archive_options.num_threads > 1) {
+        result = extract_members_parallel(&map, archive_name, plan, plan_size, archive_options.num_threads);
+    } else {
+        for (int i = 0; i < plan_size && result == 0; i++) {
+            result = extract_member(&map, archive_name, plan[i]);
+        }
+    }
+    free(resolved);
+    free(plan);
+    free(members);
+    name_arena_clear(&names);
+    unmap_archive(&map);
+    return result;
 }
 
-int create_archive(const char *archive_name, const file_list_t *files) {
-    if (helper(archive_name, files, 'c') != 0) { // calls helper function with the "create" mode, checks for return status of helper function
-        printf("Error occured while creating %s", archive_name);
+/*
+ * Flushes the directory entry of 'file_name' to disk, so a rename into it survives a crash
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int sync_parent_directory(const char *file_name) {
+    char dir_name[PATH_MAX];
+    const char *slash = strrchr(file_name, '/');
+    if (slash == NULL) {
+        strcpy(dir_name, ".");
+    } else if (slash == file_name) {
+        strcpy(dir_name, "/");
+    } else {
+        snprintf(dir_name, sizeof(dir_name), "%.*s", (int)(slash - file_name), file_name);
+    }
+    int dir_fd = open(dir_name, O_RDONLY | O_DIRECTORY);
+    if (dir_fd == -1) {
         return -1;
-    }  
-    return 0;  // no errors, return success
+    }
+    int result = sync_file(dir_fd, 0);
+    close(dir_fd);
+    return result;
 }
 
-int append_files_to_archive(const char *archive_name, const file_list_t *files) {
-    if (helper(archive_name, files, 'a') != 0) {  // calls helper fucntion with the "append" mode (more accurately, NOT in "create" mode), checks for errors
-        printf("Error occured while appending to %s", archive_name);
+/*
+ * Finds the hard links in 'plan' that would lose their target in the compacted archive, because
+ * the member they refer to is superseded by a newer version of its name, and sets their entry
+ * of 'contents' to the member holding their data; the other entries are set to NULL
+ * 'members' must be sorted with compare_members.
+ * Returns 0 on success or -1 if a target can't be found or can't be copied
+ */
+static int plan_compaction_links(const archive_map_t *map, const char *archive_name, const member_t *members,
+                                 int count, member_t **plan, int plan_size, const member_t **contents) {
+    for (int i = 0; i < plan_size; i++) {
+        contents[i] = NULL;
+        if (plan[i]->typeflag != LNKTYPE) {
+            continue;
+        }
+        const member_t *target = link_target(map, members, count, plan[i]);
+        if (target != NULL && (target + 1 == members + count || strcmp(target[1].name, target->name) != 0)) {
+            continue;  // the target is kept, and still comes before the link
+        }
+        contents[i] = resolve_link(map, members, count, plan[i]);
+        if (contents[i] == NULL) {
+            fprintf(stderr, "Link target of member %s in archive %s not found\n", plan[i]->name, archive_name);
+            return -1;
+        }
+        if (contents[i]->sparse || contents[i]->old_sparse) {
+            fprintf(stderr, "Member %s in archive %s links to a replaced sparse member and can't be compacted\n",
+                    plan[i]->name, archive_name);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Writes the hard link 'link' at '*dst_offset' of 'new_fd' as a regular member holding the
+ * contents of 'target', advancing '*dst_offset' past it
+ * If 'primary' isn't NULL, an earlier member already written that way with the same contents,
+ * the link is pointed at it instead.
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int copy_link_contents(int archive_fd, int new_fd, const member_t *link, const member_t *target,
+                              const member_t *primary, off_t *dst_offset) {
+    tar_header header;
+    ssize_t nread = pread_retry(archive_fd, (char *)&header, BLOCK_SIZE, link->data_offset - BLOCK_SIZE);
+    if (nread != BLOCK_SIZE) {
+        if (nread >= 0) {  // the archive shrank since it was scanned
+            errno = EIO;
+        }
         return -1;
     }
-    return 0;  // no errors, return success
+    memset(header.linkname, 0, sizeof(header.linkname));
+    if (primary != NULL) {
+        make_link_header(&header, primary->name);
+    } else {
+        header.typeflag = REGTYPE;
+        format_numeric(header.size, sizeof(header.size), target->size);
+        compute_checksum(&header);
+    }
+    // Extended headers in front of the link carry over unchanged
+    off_t src_offset = link->header_offset;
+    if (copy_file_data(archive_fd, &src_offset, new_fd, dst_offset, link->data_offset - BLOCK_SIZE - src_offset) != 0 ||
+        pwrite_all(new_fd, &header, BLOCK_SIZE, *dst_offset) != 0) {
+        return -1;
+    }
+    *dst_offset += BLOCK_SIZE;
+    if (primary != NULL) {
+        return 0;
+    }
+    src_offset = target->data_offset;
+    return copy_file_data(archive_fd, &src_offset, new_fd, dst_offset,
+                          (target->size + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE);
 }
 
+/*
+ * Copies the newest members in 'plan' from 'archive_fd' to 'new_fd', followed by a footer
+ * Each member's header, contents and padding are one contiguous range of the archive, and runs of
+ * members that were adjacent in the old archive are copied together in a single range.
+ * Links with an entry in 'contents' (see plan_compaction_links) are written as regular members.
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int copy_live_members(int archive_fd, int new_fd, member_t **plan, const member_t **contents, int plan_size) {
+    off_t dst_offset = 0;
+    int i = 0;
+    while (i < plan_size) {
+        if (contents[i] != NULL) {
+            // The first of several links to the same replaced member gets the contents, unless its
+            // name is too long for a link's header to refer to
+            const member_t *primary = NULL;
+            for (int j = 0; j < i && primary == NULL; j++) {
+                primary = contents[j] == contents[i] && strlen(plan[j]->name) <= sizeof(((tar_header *)0)->linkname) ? plan[j] : NULL;
+            }
+            if (copy_link_contents(archive_fd, new_fd, plan[i], contents[i], primary, &dst_offset) != 0) {
+                return -1;
+            }
+            i++;
+            continue;
+        }
+        off_t start = plan[i]->header_offset;  // start of the first header
+        off_t end = start;
+        // Extend the range while the next live member starts exactly where this one ends
+        while (i < plan_size && contents[i] == NULL && plan[i]->header_offset == end) {
+            end = plan[i]->data_offset + (plan[i]->size + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+            i++;
+        }
+        if (copy_file_data(archive_fd, &start, new_fd, &dst_offset, end - start) != 0) {
+            return -1;
+        }
+    }
+    stats_add_files(plan_size);
+    static const char footer[BLOCK_SIZE * NUM_TRAILING_BLOCKS];
+    return pwrite_all(new_fd, footer, sizeof(footer), dst_offset);
+}
 
-int get_archive_file_list(const char *archive_name, file_list_t *files) {
-    tar_header header[MAX_MSG_LEN];
+int compact_archive(const char *archive_name) {
     char err_msg[MAX_MSG_LEN];  // stores error message for printing
-    int size;
-    FILE *archive_ptr = fopen(archive_name, "r");
-    if (archive_ptr == NULL) {  // fopen error check
-        snprintf(err_msg, MAX_MSG_LEN, "Failed to open archive %s", archive_name);
-        perror(err_msg);
-        fclose(archive_ptr);
+    char temp_name[PATH_MAX];
+    archive_map_t map;
+    member_t *members;
+    name_arena_t names;
+    int count;
+    if (is_stdio_archive(archive_name)) {
+        printf("Error: compacting requires an archive file, not standard input/output\n");
         return -1;
-    } 
-    fseek(archive_ptr, 0L, SEEK_END);
-    int end = ftell(archive_ptr);
-    if (end == -1) {  // error checking fseek/ftell
-        snprintf(err_msg, MAX_MSG_LEN, "Failed to seek in archive %s", archive_name);
+    }
+    int archive_fd = open(archive_name, O_RDONLY);
+    if (archive_fd == -1) {
+        snprintf(err_msg, MAX_MSG_LEN, "Failed to open archive %s", archive_name);
         perror(err_msg);
-        fclose(archive_ptr);
         return -1;
     }
-    rewind(archive_ptr);
-    if (ftell(archive_ptr) != 0) {  // error checking rewind -- should point to beginning of archive_ptr's file
-        snprintf(err_msg, MAX_MSG_LEN, "Failed to rewind in archive %s", archive_name);
-        perror(err_msg);
-        fclose(archive_ptr);
+    compression_t compression = stream_detect_file(archive_fd);
+    if (compression != COMPRESS_NONE) {
+        fprintf(stderr, "Compacting is not supported for %s compressed archives\n", compression_name(compression));
+        close(archive_fd);
         return -1;
     }
-    // read header block to get the size attribute
-    fread(header, MAX_MSG_LEN, 1, archive_ptr);
-    if (ferror(archive_ptr)) {
-        snprintf(err_msg, MAX_MSG_LEN, "Failed to read archive %s ferror value: %d", archive_name, ferror(archive_ptr));
+    struct stat archive_stat;
+    if (fstat(archive_fd, &archive_stat) != 0) {
+        snprintf(err_msg, MAX_MSG_LEN, "Failed to stat archive %s", archive_name);
         perror(err_msg);
-        fclose(archive_ptr);
+        close(archive_fd);
         return -1;
-    }   
-    sscanf(header->size, "%i", &size);  // scan the header size attribute into size variable
-    if (file_list_add(files, header->name) != 0) {  // add file to list, error check
-        snprintf(err_msg, MAX_MSG_LEN, "Failed to add file %s to file list", header->name);
-        perror(err_msg);
-        fclose(archive_ptr);
+    }
+    // The mapping is only used to find members and link names; their bytes are copied from 'archive_fd'
+    if (map_archive(archive_name, MADV_RANDOM, &map) != 0) {
+        close(archive_fd);
         return -1;
     }
-    while (ftell(archive_ptr) + size + (MAX_MSG_LEN * 2) < end) {  // while there is room left in the archive past the end of this file,...
-                                                                   // ...excluding footer blocks, then there must be another file in the archive
-        if (size <= MAX_MSG_LEN) {  // if this file's contents are contained within a single block
-            fseek(archive_ptr, MAX_MSG_LEN, SEEK_CUR);  // move pointer one block over, which should be the beginning of a tar_header
-        }
-        else if (size % MAX_MSG_LEN == 0) {  // if this file's contents align perfectly with the end of a block/ every block is full
-            fseek(archive_ptr, size, SEEK_CUR);  // seek past all of the content -- ends up at the beginning of the next tar_header
-        }
-        else {  // this file's contents don't fully fill its last block, so we can't directly seek (+size bytes) to the next tar_header
-            fseek(archive_ptr, MAX_MSG_LEN * ((size/MAX_MSG_LEN) + 1), SEEK_CUR);  // seek to the end of the final, semi-filled block
-        }
-        // archive_ptr should now be pointing at the start of another tar_header
-        fread(header, MAX_MSG_LEN, 1, archive_ptr);  // read the entire tar_header into header
-        if (ferror(archive_ptr)) {
-            snprintf(err_msg, MAX_MSG_LEN, "Failed to read archive %s after seeking to a tar_header. ferror value: %d", archive_name, ferror(archive_ptr));
-            perror(err_msg);
-            fclose(archive_ptr);
-            return -1;
-        }  
-        sscanf(header->size, "%i", &size);  // grab the size attribute of the header
-        if (file_list_add(files, header->name) != 0) {
-            snprintf(err_msg, MAX_MSG_LEN, "Failed to add file %s to file list", header->name);
-            perror(err_msg);
-            fclose(archive_ptr);
-            return -1;
-        }
+    name_arena_init(&names);
+    if (load_archive_members(&map, archive_name, &names, &members, &count) != 0) {
+        name_arena_clear(&names);
+        unmap_archive(&map);
+        close(archive_fd);
+        return -1;
     }
-    if (fclose(archive_ptr) != 0) {
-        snprintf(err_msg, MAX_MSG_LEN, "Failed to close archive %s", archive_name);
+    int plan_size;
+    member_t **plan = plan_newest_members(members, count, &plan_size);
+    const member_t **contents = malloc((count > 0 ? count : 1) * sizeof(member_t *));
+    if (plan == NULL || contents == NULL) {
+        snprintf(err_msg, MAX_MSG_LEN, "Failed to allocate compaction plan for archive %s", archive_name);
         perror(err_msg);
-        fclose(archive_ptr);
+        free(contents);
+        free(plan);
+        free(members);
+        name_arena_clear(&names);
+        unmap_archive(&map);
+        close(archive_fd);
         return -1;
     }
-    return 0;
-}
+    if (plan_compaction_links(&map, archive_name, members, count, plan, plan_size, contents) != 0) {
+        free(contents);
+        free(plan);
+        free(members);
+        name_arena_clear(&names);
+        unmap_archive(&map);
+        close(archive_fd);
+        return -1;
+    }
+    unmap_archive(&map);
 
-int extract_files_from_archive(const char *archive_name) {
-    char buffer[MAX_MSG_LEN];
-    char err_msg[MAX_MSG_LEN];  // stores error message for printing
-    tar_header header[MAX_MSG_LEN];
-    int size;
-    FILE *archive_ptr = fopen(archive_name, "r");
-    if (archive_ptr == NULL) {  // fopen error check
-        snprintf(err_msg, MAX_MSG_LEN, "Failed to open archive %s", archive_name);
+    // Build the compacted archive next to the old one, then swap it in with a single rename
+    snprintf(temp_name, sizeof(temp_name), "%s.compact.XXXXXX", archive_name);
+    int new_fd = mkstemp(temp_name);
+    if (new_fd == -1) {
+        snprintf(err_msg, MAX_MSG_LEN, "Failed to create temporary file for archive %s", archive_name);
         perror(err_msg);
-        fclose(archive_ptr);
+        free(contents);
+        free(plan);
+        free(members);
+        name_arena_clear(&names);
+        close(archive_fd);
         return -1;
-    } 
-    FILE *new_ptr;
-    fseek(archive_ptr, 0L, SEEK_END);
-    int end = ftell(archive_ptr);
-    if (end == -1) {  // error checking fseek/ftell
-        snprintf(err_msg, MAX_MSG_LEN, "Failed to seek in archive %s", archive_name);
+    }
+    int result = 0;
+    if (fchmod(new_fd, archive_stat.st_mode & 07777) != 0 || copy_live_members(archive_fd, new_fd, plan, contents, plan_size) != 0) {
+        snprintf(err_msg, MAX_MSG_LEN, "Failed to copy members of archive %s", archive_name);
         perror(err_msg);
-        fclose(archive_ptr);
-        return -1;
+        result = -1;
+    } else if (sync_file(new_fd, 0) != 0) {  // the data must be on disk before the rename makes it the archive
+        snprintf(err_msg, MAX_MSG_LEN, "Failed to flush compacted archive %s to disk", archive_name);
+        perror(err_msg);
+        result = -1;
+    }
+    if (close(new_fd) != 0 && result == 0) {
+        snprintf(err_msg, MAX_MSG_LEN, "Failed to close compacted archive %s", archive_name);
+        perror(err_msg);
+        result = -1;
     }
-    rewind(archive_ptr);
-    if (ftell(archive_ptr) != 0) {  // error checking rewind -- should point to beginning of archive_ptr's file
-        snprintf(err_msg, MAX_MSG_LEN, "Failed to rewind in archive %s", archive_name);
+    close(archive_fd);
+    free(contents);
+    free(plan);
+    free(members);
+    name_arena_clear(&names);
+    if (result == 0 && rename(temp_name, archive_name) != 0) {
+        snprintf(err_msg, MAX_MSG_LEN, "Failed to replace archive %s with its compacted version", archive_name);
         perror(err_msg);
-        fclose(archive_ptr);
+        result = -1;
+    }
+    if (result != 0) {
+        unlink(temp_name);  // the original archive is untouched
         return -1;
     }
-    fread(header, MAX_MSG_LEN, 1, archive_ptr);
-    if (ferror(archive_ptr)) {
-        snprintf(err_msg, MAX_MSG_LEN, "Failed to read archive %s ferror value: %d", archive_name, ferror(archive_ptr));
+    if (sync_parent_directory(archive_name) != 0) {
+        snprintf(err_msg, MAX_MSG_LEN, "Failed to flush the directory of archive %s", archive_name);
         perror(err_msg);
-        fclose(archive_ptr);
         return -1;
-    }   
-    sscanf(header->size, "%i", &size);
-    while (ftell(archive_ptr) + size + (MAX_MSG_LEN * 2) < end) {  // while there is room left in the archive past the end of this file,...
-                                                                   // ...excluding footer blocks, then there must be another file in the archive
-        new_ptr = fopen(header->name, "w");
-        if (new_ptr == NULL) {  // fopen error check
-            snprintf(err_msg, MAX_MSG_LEN, "Failed to open file %s in %s", header->name, archive_name);
-            perror(err_msg);
-            fclose(new_ptr);
-            fclose(archive_ptr);
-            return -1;
-        }
-        if (size < MAX_MSG_LEN) {  // if this file's contents are contained within a single block
-            fread(buffer, 1, size, archive_ptr);  // read size bytes into buffer
-            if (ferror(archive_ptr)) {
-                snprintf(err_msg, MAX_MSG_LEN, "Failed to read archive %s ferror value: %d", archive_name, ferror(archive_ptr));
-                perror(err_msg);
-                fclose(new_ptr);
-                fclose(archive_ptr);
-                return -1;
-            }
-            if (fwrite(buffer, 1, size, new_ptr) < size) {  // write buffer into new_ptr's file
-                snprintf(err_msg, MAX_MSG_LEN, "Failed to write to file %s", header->name);
-                perror(err_msg);
-                fclose(new_ptr);
-                fclose(archive_ptr);
-                return -1;
-            }
-            fseek(archive_ptr, -size, SEEK_CUR);  // seek back to the start of the tar_header
-            int err = ftell(archive_ptr);
-            if (err % MAX_MSG_LEN != 0) {
-                snprintf(err_msg, MAX_MSG_LEN, "Failed to seek back to the start of a tar_header in archive %s", archive_name);
-                perror(err_msg);
-                fclose(new_ptr);
-                fclose(archive_ptr);
-                return -1;
-            }
-            fseek(archive_ptr, MAX_MSG_LEN, SEEK_CUR);  // seek past the tar_header
-            if (ftell(archive_ptr) == err) {
-                snprintf(err_msg, MAX_MSG_LEN, "Failed to seek past a tar_header in archive %s", archive_name);
-                perror(err_msg);
-                fclose(new_ptr);
-                fclose(archive_ptr);
-                return -1;
-            }
-        }
-        else if (size % MAX_MSG_LEN == 0) {  // if this file's contents align perfectly with the end of a block/ every block is full
-            for (int i = 0; i < (size/MAX_MSG_LEN); i++) {  // for each block of the file in the archive
-                fread(buffer, 1, MAX_MSG_LEN, archive_ptr);  // read a block into buffer
-                if (ferror(archive_ptr)) {
-                    snprintf(err_msg, MAX_MSG_LEN, "Failed to read a block from archive %s ferror value: %d", archive_name, ferror(archive_ptr));
-                    perror(err_msg);
-                    fclose(new_ptr);
-                    fclose(archive_ptr);
-                    return -1;
-                }
-                if (fwrite(buffer, 1, MAX_MSG_LEN, new_ptr) < MAX_MSG_LEN) {  // write buffer into new_ptr's file
-                    snprintf(err_msg, MAX_MSG_LEN, "Failed to fully write a block from archive to file");
-                    perror(err_msg);
-                    fclose(new_ptr);
-                    fclose(archive_ptr);
-                    return -1;
-                }
-            }
-            fseek(archive_ptr, -size, SEEK_CUR);  // seek back to the tar_header
-            int err = ftell(archive_ptr);  // get offset of tar_header
-            if (err % MAX_MSG_LEN != 0) {  // if the offset doesn't align with the start of a block, error
-                snprintf(err_msg, MAX_MSG_LEN, "Failed to seek back to the start of a tar_header in archive %s", archive_name);
-                perror(err_msg);
-                fclose(new_ptr);
-                fclose(archive_ptr);
-                return -1;
-            }
-            fseek(archive_ptr, MAX_MSG_LEN * (size/MAX_MSG_LEN), SEEK_CUR);  // seek to the next tar_header
-            if (ftell(archive_ptr) == err) {  // failed to seek past file
-                snprintf(err_msg, MAX_MSG_LEN, "Failed to seek to the next tar_header in archive %s", archive_name);
-                perror(err_msg);
-                fclose(new_ptr);
-                fclose(archive_ptr);
-                return -1;
-            }
-        }
-        else {  // this file's contents don't fully fill its last block, so we can't directly seek (+size bytes) to the next tar_header
-            for (int i = 0; i < (size/MAX_MSG_LEN); i++) {  // for each FULL block of the file in the archive
-                fread(buffer, 1, MAX_MSG_LEN, archive_ptr);
-                if (ferror(archive_ptr)) {
-                    snprintf(err_msg, MAX_MSG_LEN, "Failed to read a block from archive %s ferror value: %d", archive_name, ferror(archive_ptr));
-                    perror(err_msg);
-                    fclose(new_ptr);
-                    fclose(archive_ptr);
-                    return -1;
-                }
-                if (fwrite(buffer, 1, MAX_MSG_LEN, new_ptr) < MAX_MSG_LEN) {  // write buffer into new_ptr's file, check error
-                    snprintf(err_msg, MAX_MSG_LEN, "Failed to fully write a block from archive to file");
-                    perror(err_msg);
-                    fclose(new_ptr);
-                    fclose(archive_ptr);
-                    return -1;
-                }
-            }
-            // still have to read the not-full block
-            fread(buffer, 1, (size % MAX_MSG_LEN), archive_ptr);  // read ONLY the data bytes from the FINAL block into buffer
-            if (ferror(archive_ptr)) {
-                snprintf(err_msg, MAX_MSG_LEN, "Failed to read FINAL block of a file from archive %s ferror value: %d", archive_name, ferror(archive_ptr));
-                perror(err_msg);
-                fclose(new_ptr);
-                fclose(archive_ptr);
-                return -1;
-            }
-            if (fwrite(buffer, 1, (size % MAX_MSG_LEN), new_ptr) < (size % MAX_MSG_LEN)) {  // write ONLY the data bytes from buffer into new_ptr's file, check error
-                snprintf(err_msg, MAX_MSG_LEN, "Failed to fully write the data of the block from archive to file");
-                perror(err_msg);
-                fclose(new_ptr);
-                fclose(archive_ptr);
-                return -1;
-            }
-            fseek(archive_ptr, -size, SEEK_CUR);  // seek back to the start of the tar_header
-            int err = ftell(archive_ptr);  // get offset of tar_header
-            if (err % MAX_MSG_LEN != 0) {  // if the offset doesn't align with the start of a block, error
-                snprintf(err_msg, MAX_MSG_LEN, "Failed to seek back to the start of a tar_header in archive %s", archive_name);
-                perror(err_msg);
-                fclose(new_ptr);
-                fclose(archive_ptr);
-                return -1;
-            }
-            fseek(archive_ptr, MAX_MSG_LEN * ((size/MAX_MSG_LEN) + 1), SEEK_CUR);  // seek to the next tar_header
-            if (ftell(archive_ptr) == err) {  // failed to seek past file
-                snprintf(err_msg, MAX_MSG_LEN, "Failed to seek to the next tar_header in archive %s", archive_name);
-                perror(err_msg);
-                fclose(new_ptr);
-                fclose(archive_ptr);
-                return -1;
-            }
+    }
+    // Member offsets all moved, so an existing index is rebuilt from scratch
+    if (archive_options.use_index || index_exists(archive_name)) {
+        return update_archive_index(archive_name, NULL, 0);
+    }
+    return 0;
+}
+
+// Most contents a verifier thread checks in one go; larger members are split into pieces like this
+#define VERIFY_CHUNK_SIZE (16 << 20)
+
+// A piece of a member's contents to check, and its CRC32C once checked
+typedef struct {
+    const member_t *member;
+    off_t offset;  // start of the piece within the member's contents
+    off_t size;
+    uint32_t crc;
+} verify_chunk_t;
+
+// Work shared by the verifier threads
+typedef struct {
+    const archive_map_t *map;
+    verify_chunk_t *chunks;
+    int num_chunks;
+    int next;  // index of the next chunk nobody has claimed yet
+    pthread_mutex_t lock;  // protects 'next'
+} verify_job_t;
+
+/*
+ * Thread body for parallel verification
+ * Repeatedly claims the next chunk and computes its CRC32C straight from the shared mapping
+ */
+static void *verify_worker(void *arg) {
+    verify_job_t *job = arg;
+    while (1) {
+        pthread_mutex_lock(&job->lock);
+        if (job->next == job->num_chunks) {
+            pthread_mutex_unlock(&job->lock);
+            return NULL;
         }
-        fread(header, MAX_MSG_LEN, 1, archive_ptr);
-        if (ferror(archive_ptr)) {
-            snprintf(err_msg, MAX_MSG_LEN, "Failed to read tar_header from archive %s into header. ferror value: %d", archive_name, ferror(archive_ptr));
+        verify_chunk_t *chunk = &job->chunks[job->next++];
+        pthread_mutex_unlock(&job->lock);
+        uint64_t start = stats_start();
+        chunk->crc = crc32c_update(0, job->map->data + chunk->member->data_offset + chunk->offset, chunk->size);
+        stats_add(STATS_COPY, start, chunk->size, 0);  // read through the mapping, no system calls
+    }
+}
+
+/*
+ * Computes the CRC32C of every chunk in 'chunks' using 'num_threads' threads (the calling
+ * thread alone when 'num_threads' is 1)
+ * If threads can't be started, the calling thread checks whatever they didn't get to.
+ */
+static void verify_chunks_parallel(const archive_map_t *map, const char *archive_name, verify_chunk_t *chunks, int num_chunks, int num_threads) {
+    char err_msg[MAX_MSG_LEN];  // stores error message for printing
+    verify_job_t job = {map, chunks, num_chunks, 0};
+    pthread_t threads[MAX_THREADS];
+    int started = 0;
+    pthread_mutex_init(&job.lock, NULL);
+    if (num_threads > num_chunks) {  // no point starting threads that would have nothing to do
+        num_threads = num_chunks;
+    }
+    for (; num_threads > 1 && started < num_threads; started++) {
+        if (pthread_create(&threads[started], NULL, verify_worker, &job) != 0) {
+            snprintf(err_msg, MAX_MSG_LEN, "Failed to start verification thread for archive %s", archive_name);
             perror(err_msg);
-            fclose(new_ptr);
-            fclose(archive_ptr);
-            return -1;
+            break;
         }
-        sscanf(header->size, "%i", &size);  // grab size from header to reevaluate loop condition
     }
-    if (fclose(new_ptr) != 0) {
-        snprintf(err_msg, MAX_MSG_LEN, "Failed to close archive %s", archive_name);
-        perror(err_msg);
-        fclose(archive_ptr);
+    if (started < num_threads || num_threads <= 1) {
+        verify_worker(&job);
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    pthread_mutex_destroy(&job.lock);
+}
+
+int verify_archive(const char *archive_name, file_list_t *verified) {
+    char err_msg[MAX_MSG_LEN];  // stores error message for printing
+    archive_map_t map;
+    member_t *members;
+    name_arena_t names;
+    int count;
+    if (is_stdio_archive(archive_name)) {
+        return read_archive_stream(STDIN_FILENO, archive_name, verified, 'd');
+    }
+    int compressed = read_compressed_archive(archive_name, verified, 'd');
+    if (compressed != 1) {  // 0 or -1: it was compressed and has been verified through a stream
+        return compressed;
+    }
+    if (map_archive(archive_name, MADV_SEQUENTIAL, &map) != 0) {
         return -1;
     }
-    if (fclose(archive_ptr) != 0) {
-        snprintf(err_msg, MAX_MSG_LEN, "Failed to close archive %s", archive_name);
+    // Every header is checked against its checksum as the members are found
+    name_arena_init(&names);
+    if (scan_archive_members(&map, 0, archive_name, &names, &members, &count) != 0) {
+        name_arena_clear(&names);
+        unmap_archive(&map);
+        return -1;
+    }
+    stats_add_files(count);
+    int num_chunks = 0;
+    for (int i = 0; i < count; i++) {
+        if (members[i].has_crc32c) {
+            num_chunks += members[i].size == 0 ? 1 : (members[i].size + VERIFY_CHUNK_SIZE - 1) / VERIFY_CHUNK_SIZE;
+        }
+    }
+    verify_chunk_t *chunks = malloc((num_chunks > 0 ? num_chunks : 1) * sizeof(verify_chunk_t));
+    if (chunks == NULL) {
+        snprintf(err_msg, MAX_MSG_LEN, "Failed to allocate verification plan for archive %s", archive_name);
         perror(err_msg);
-        // new_ptr should be closed by now, archive_ptr failed to close, no close calls necessary here
+        free(members);
+        name_arena_clear(&names);
+        unmap_archive(&map);
         return -1;
     }
-    return 0;  // success
+    int next = 0;
+    for (int i = 0; i < count; i++) {
+        if (!members[i].has_crc32c) {
+            continue;
+        }
+        off_t offset = 0;
+        do {  // a member without contents still gets one (empty) piece
+            off_t size = members[i].size - offset < VERIFY_CHUNK_SIZE ? members[i].size - offset : VERIFY_CHUNK_SIZE;
+            chunks[next++] = (verify_chunk_t){&members[i], offset, size, 0};
+            offset += size;
+        } while (offset < members[i].size);
+    }
+    verify_chunks_parallel(&map, archive_name, chunks, num_chunks, archive_options.num_threads);
+
+    // Put each member's CRC back together from its pieces, which are in order
+    int result = 0;
+    int mismatched = 0;  // a mismatch is reported, and the other members still checked
+    for (int i = 0; i < num_chunks && result == 0;) {
+        const member_t *member = chunks[i].member;
+        uint32_t crc = chunks[i].crc;
+        for (i++; i < num_chunks && chunks[i].member == member; i++) {
+            crc = crc32c_combine(crc, chunks[i].crc, chunks[i].size);
+        }
+        if (crc != member->crc32c) {
+            report_crc32c_mismatch(member->name, archive_name, member->crc32c, crc);
+            mismatched = 1;
+        } else if (file_list_add(verified, member->name) != 0) {
+            snprintf(err_msg, MAX_MSG_LEN, "Failed to add file %s to file list", member->name);
+            perror(err_msg);
+            result = -1;
+        }
+    }
+    free(chunks);
+    free(members);
+    name_arena_clear(&names);
+    unmap_archive(&map);
+    return result == 0 && !mismatched ? 0 : -1;
 }
@@ -1,5 +1,6 @@
 #ifndef _MINITAR_H
 #define _MINITAR_H
+#include "archive_stream.h"
 #include "file_list.h"
 
 #define BLOCK_SIZE 512
@@ -22,7 +23,7 @@ typedef struct {
     char chksum[8];
     // File type (use constants defined below)
     char typeflag;
-    // Unused for this project
+    // Name of the member a hard link (LNKTYPE) refers to, null-terminated only when shorter than 100 bytes
     char linkname[100];
     // Indicates which tar standard we are using
     char magic[6];
@@ -45,9 +46,48 @@ typedef struct {
 #define MAGIC "ustar"
 
 // Constants to represent different file types
-// We'll only use regular files in this project
 #define REGTYPE '0'
+#define AREGTYPE '\0'  // regular file, as written by pre-POSIX tars
+// Hard link: no contents, the member extracts to the same contents as the member named by 'linkname'
+#define LNKTYPE '1'
 #define DIRTYPE '5'
+// Old GNU sparse file, whose map of data runs fills the end of the header and any extension blocks after it
+#define GNUTYPE_SPARSE 'S'
+// Extended (PAX) header applying to the next member, and to all members that follow
+#define XHDTYPE 'x'
+#define XGLTYPE 'g'
+
+// Archive name meaning "write the archive to standard output" when creating,
+// or "read the archive from standard input" when listing or extracting
+#define STDIO_ARCHIVE_NAME "-"
+
+// Upper limit on worker threads requested with -j
+#define MAX_THREADS 64
+
+// Settings that apply to every archive operation, filled in from the command line
+typedef struct {
+    // Number of threads used to copy member contents, 1 means everything runs on the calling thread
+    int num_threads;
+    // Nonzero to create and maintain an index file next to the archive (-i)
+    int use_index;
+    // Compression used when creating an archive (-z, --zstd); archives being read are detected
+    compression_t compression;
+    // Codec-specific compression level (--level), -1 for the codec's default
+    int compression_level;
+    // Nonzero to record only numeric user and group IDs, skipping name lookups (--numeric-owner)
+    int numeric_owner;
+    // Nonzero to move member contents with io_uring when the kernel allows it (--io-uring)
+    int use_io_uring;
+    // Nonzero to compare contents, not just size and modification time, when deciding what -u appends (--check-content)
+    int check_content;
+    // Nonzero to store repeated file contents once, as links to the first member holding them (--dedup)
+    int dedup;
+    // Nonzero to record the CRC32C of each new member's contents in an extended header (--crc32c)
+    // GNU tar warns once per such member that it ignores the record, whenever it lists or extracts the archive
+    int crc32c;
+} archive_options_t;
+
+extern archive_options_t archive_options;
 
 /*
  * Create a new archive file with the name 'archive_name'.
@@ -56,6 +96,10 @@ typedef struct {
  * You may also assume that all the elements of 'files' exist.
  * If an archive of the specified name already exists, you should overwrite it
  * with the result of this operation.
+ * If 'archive_name' is STDIO_ARCHIVE_NAME, the archive is streamed to standard output instead.
+ * With archive_options.num_threads > 1, member contents are copied by that many threads at once.
+ * With archive_options.use_index set, or if the archive already has an index file,
+ * the index file is rewritten to match the new archive.
  * This function should return 0 upon success or -1 if an error occurred
  */
 int create_archive(const char *archive_name, const file_list_t *files);
@@ -64,15 +108,41 @@ int create_archive(const char *archive_name, const file_list_t *files);
  * Append each file specified in 'files' to the archive with the name 'archive_name'.
  * You can assume in this project that at least one new file to append is specified.
  * You may also assume that all files to be appended exist.
+ * An existing index file is extended with the new members (or created, with archive_options.use_index).
  * This function should return 0 upon success or -1 if an error occurred.
  */
 int append_files_to_archive(const char *archive_name, const file_list_t *files);
 
+/*
+ * Add to 'changed' the name of each file in 'files' that differs from its newest version in
+ * the archive identified by 'archive_name', so that updating appends only those files.
+ * A directory in 'files' is walked, and each file and directory below it is checked the same
+ * way; those that aren't in the archive yet count as changed.
+ * A file differs if its size or modification time doesn't match the member's header; with
+ * archive_options.check_content, or if the file was modified no earlier than the archive
+ * itself (within the one-second resolution of headers), its contents are compared as well.
+ * A directory differs if its member isn't a directory or has another modification time.
+ * Members are found with one scan of the archive's headers, or from its index file.
+ * This function should return 0 upon success, 1 if any file in 'files' is not in the
+ * archive, or -1 if an error occurred.
+ */
+int get_changed_files(const char *archive_name, const file_list_t *files, file_list_t *changed);
+
+/*
+ * Append each file and directory in 'changed', as found by get_changed_files, to the archive
+ * with the name 'archive_name', like append_files_to_archive except that a directory is
+ * appended by itself: whatever changed below it is already listed in 'changed'.
+ * This function should return 0 upon success or -1 if an error occurred.
+ */
+int append_changed_files(const char *archive_name, const file_list_t *changed);
+
 /*
  * Add the name of each file contained in the archive identified by 'archive_name'
  * to the 'files' list.
  * NOTE: This function is most obviously relevant to implementing minitar's list
  * operation, but think about how you can reuse it for the update operation.
+ * If the archive has an up-to-date index file, names are read from it without scanning the archive.
+ * If 'archive_name' is STDIO_ARCHIVE_NAME, the archive is read once, front to back, from standard input.
  * This function should return 0 upon success or -1 if an error occurred.
  */
 int get_archive_file_list(const char *archive_name, file_list_t *files);
@@ -83,8 +153,40 @@ int get_archive_file_list(const char *archive_name, file_list_t *files);
  * If there are multiple versions of the same file present in the archive,
  * then only the most recently added version should be present as a new file
  * at the end of the extraction process.
+ * If 'files' is not NULL or empty, only the members it names are extracted; the other
+ * members' contents are never read, and it is an error if a name is not in the archive.
+ * With archive_options.num_threads > 1, files are written by that many threads at once.
+ * If 'archive_name' is STDIO_ARCHIVE_NAME, the archive is read once, front to back, from standard input,
+ * and every version of each file is written in turn.
+ * It is an error to extract a member whose name is absolute or has a ".." component; nothing
+ * is created for it, not even its parent directories.
  * This function should return 0 upon success or -1 if an error occurred.
  */
-int extract_files_from_archive(const char *archive_name);
+int extract_files_from_archive(const char *archive_name, const file_list_t *files);
+
+/*
+ * Rewrite the archive identified by 'archive_name' so that it holds only the newest
+ * version of each member, in the order those versions appear in the archive.
+ * Members are copied straight from the old archive (source files are not read again)
+ * into a temporary file next to it, which is flushed to disk and then renamed over the
+ * archive, so the archive is always either the old or the compacted version.
+ * An existing index file is rebuilt (or created, with archive_options.use_index).
+ * This function should return 0 upon success or -1 if an error occurred.
+ */
+int compact_archive(const char *archive_name);
+
+/*
+ * Check the archive identified by 'archive_name' without extracting it.
+ * Every header is checked against its checksum, and the contents of every member whose
+ * extended header records a CRC32C (see archive_options.crc32c) against that CRC; the
+ * name of each member whose contents were confirmed is added to 'verified'.
+ * The contents are checked by archive_options.num_threads threads at once, with members
+ * split into pieces so that even a single huge member keeps every thread busy.
+ * Compressed archives, and the archive read from standard input if 'archive_name' is
+ * STDIO_ARCHIVE_NAME, are checked front to back on one thread.
+ * This function should return 0 if everything checked matches, or -1 if anything doesn't
+ * (after reporting each mismatched member) or an error occurred.
+ */
+int verify_archive(const char *archive_name, file_list_t *verified);
 
 #endif
@@ -1,19 +1,102 @@
+#include <limits.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "file_list.h"
 #include "minitar.h"
+#include "run_stats.h"
+
+#define USAGE "Usage: %s -c|a|t|u|x|k|d [-j THREADS] [-i] [-z|--zstd] [--level N] [--numeric-owner] [--io-uring] [--check-content] [--dedup] [--crc32c] [--stats[=json]] -f ARCHIVE [FILE...]\n"
+
+static const char *stats_operation;  // the operation flag, for the --stats report
+static int stats_json;  // nonzero for --stats=json
+
+// Prints the --stats report when minitar exits, whether the operation succeeded or not
+static void report_stats(void) {
+    stats_report(stderr, stats_operation, stats_json);
+}
 
 int main(int argc, char **argv) {
     if (argc < 4) {
-        printf("Usage: %s -c|a|t|u|x -f ARCHIVE [FILE...]\n", argv[0]);
+        printf(USAGE, argv[0]);
         return 0;
     }
+    // options sit between the operation and '-f ARCHIVE', everything after the archive name is a file
+    int arg = 2;
+    while (arg < argc && strcmp(argv[arg], "-f") != 0) {
+        if (strcmp(argv[arg], "-j") == 0 && arg + 1 < argc) {  // number of worker threads
+            char *end;
+            long num_threads = strtol(argv[arg + 1], &end, 10);
+            if (*end != '\0' || num_threads < 1 || num_threads > MAX_THREADS) {
+                printf("Error: -j expects a thread count between 1 and %d\n", MAX_THREADS);
+                return 1;
+            }
+            archive_options.num_threads = num_threads;
+            arg += 2;
+        } else if (strcmp(argv[arg], "-i") == 0) {  // keep an index file next to the archive
+            archive_options.use_index = 1;
+            arg++;
+        } else if (strcmp(argv[arg], "-z") == 0 || strcmp(argv[arg], "--zstd") == 0) {  // compress a new archive
+            archive_options.compression = argv[arg][1] == 'z' ? COMPRESS_GZIP : COMPRESS_ZSTD;
+            if (!compression_available(archive_options.compression)) {
+                printf("Error: this minitar was built without %s support\n", compression_name(archive_options.compression));
+                return 1;
+            }
+            arg++;
+        } else if (strcmp(argv[arg], "--check-content") == 0) {  // -u compares contents too
+            archive_options.check_content = 1;
+            arg++;
+        } else if (strcmp(argv[arg], "--dedup") == 0) {  // store repeated contents once, as links
+            archive_options.dedup = 1;
+            arg++;
+        } else if (strcmp(argv[arg], "--crc32c") == 0) {  // record a checksum of each member's contents, which GNU tar warns it ignores
+            archive_options.crc32c = 1;
+            arg++;
+        } else if (strcmp(argv[arg], "--io-uring") == 0) {  // asynchronous copies, if the kernel has io_uring
+            archive_options.use_io_uring = 1;
+            arg++;
+        } else if (strcmp(argv[arg], "--stats") == 0 || strcmp(argv[arg], "--stats=json") == 0) {  // report time per phase
+            stats_json = argv[arg][7] == '=';
+            stats_operation = argv[1];
+            if (!stats_enabled) {
+                stats_enable();
+                atexit(report_stats);
+            }
+            arg++;
+        } else if (strcmp(argv[arg], "--numeric-owner") == 0) {  // don't look up owner and group names
+            archive_options.numeric_owner = 1;
+            arg++;
+        } else if (strcmp(argv[arg], "--level") == 0 && arg + 1 < argc) {  // compression level
+            char *end;
+            long level = strtol(argv[arg + 1], &end, 10);
+            if (*end != '\0' || end == argv[arg + 1] || level < 1 || level > INT_MAX) {  // checked against the codec below
+                printf("Error: --level expects a positive compression level\n");
+                return 1;
+            }
+            archive_options.compression_level = level;
+            arg += 2;
+        } else {
+            printf(USAGE, argv[0]);
+            return 1;
+        }
+    }
+    if (arg + 1 >= argc) {  // no '-f ARCHIVE' found
+        printf(USAGE, argv[0]);
+        return 1;
+    }
+    int max_level = compression_max_level(archive_options.compression);
+    if (max_level > 0 && archive_options.compression_level > max_level) {  // the codec is only known once all options are parsed
+        printf("Error: --level expects a %s compression level between 1 and %d\n", compression_name(archive_options.compression), max_level);
+        return 1;
+    }
+    const char *archive_name = argv[arg + 1];
+
     file_list_t files;
     file_list_init(&files);
     // parse command-line arguments and invoke functions from 'minitar.h'
     // to execute archive operations
-    for (int i = 4; i < argc; i++) {  // iterate through all of the file_name_i arguments
+    for (int i = arg + 2; i < argc; i++) {  // iterate through all of the file_name_i arguments
         if (file_list_add(&files, argv[i]) != 0) {
             printf("Error: file_list_add failed in main");
             file_list_clear(&files);
@@ -22,19 +105,19 @@ int main(int argc, char **argv) {
     }
 
     if (strcmp(argv[1], "-c") == 0) {  // create mode to call create_archive
-        if (create_archive(argv[3], &files) != 0) {
+        if (create_archive(archive_name, &files) != 0) {
             printf("Error: create_archive failed in main");
             file_list_clear(&files);
             return 1;
         }
     } else if (strcmp(argv[1], "-a") == 0) {  // append mode to call append_files_to_archive
-        if (append_files_to_archive(argv[3], &files) != 0) {
+        if (append_files_to_archive(archive_name, &files) != 0) {
             printf("Error: append_files_to_archive failed in main");
             file_list_clear(&files);
             return 1;
         }
     } else if (strcmp(argv[1], "-t") == 0) {  // list mode to call get_archive_file_list
-        if (get_archive_file_list(argv[3], &files) != 0) {
+        if (get_archive_file_list(archive_name, &files) != 0) {
             printf("Error: get_archive_file_list failed in main");
             file_list_clear(&files);
             return 1;
@@ -45,39 +128,54 @@ int main(int argc, char **argv) {
             current = current->next;
         }
     } else if (strcmp(argv[1], "-u") == 0) {  // update mode to append updated versions of files to the archive
-        int checker = 0;
-        file_list_t new_list;
-        file_list_init(&new_list);
-        node_t *current = files.head;
-        if (get_archive_file_list(argv[3], &new_list) != 0) {  // load file names into new_list
-            printf("Error: get_archive_file_list failed in main");
-            file_list_clear(&new_list);
+        if (strcmp(archive_name, STDIO_ARCHIVE_NAME) == 0) {  // would need to both read and append to the stream
+            printf("Error: updating requires an archive file, not standard input/output\n");
             file_list_clear(&files);
             return 1;
         }
-        for(int i = 0; i <= files.size - 1; i++){  // check to see that every supplied file name is already in the archive
-            if (file_list_contains(&new_list, current->name) == 0) {  // current->name is not in the archive
-                printf("Error: One or more of the specified files is not already present in archive");
-                checker = 1;
-                break;  // all files must be inthe archive already. current->name isn't. break
-            }
-            current = current->next;
+        file_list_t changed;
+        file_list_init(&changed);
+        int status = get_changed_files(archive_name, &files, &changed);  // one header scan finds what changed
+        if (status == -1) {
+            printf("Error: get_changed_files failed in main");
+            file_list_clear(&changed);
+            file_list_clear(&files);
+            return 1;
         }
-        if (checker == 0) {  // if all supplied file names exist in the archive
-            if (append_files_to_archive(argv[3], &files) != 0) {  // appends the new files to the end of the archive
-                printf("Error: append_files_to_archive failed in main");
-                file_list_clear(&new_list);
+        if (status == 1) {  // every supplied file name must already be in the archive
+            printf("Error: One or more of the specified files is not already present in archive");
+        } else if (changed.size > 0) {  // unchanged files are not appended again
+            if (append_changed_files(archive_name, &changed) != 0) {  // appends the changed files to the end of the archive
+                printf("Error: append_changed_files failed in main");
+                file_list_clear(&changed);
                 file_list_clear(&files);
                 return 1;
             }
         }
-        file_list_clear(&new_list);  // void, no need to error check
+        file_list_clear(&changed);  // void, no need to error check
     } else if (strcmp(argv[1], "-x") == 0) {
-        if (extract_files_from_archive(argv[3]) != 0) {
+        if (extract_files_from_archive(archive_name, &files) != 0) {
             printf("Error: extract_files_from_archive failed in main");
             file_list_clear(&files);
             return 1;
         }
+    } else if (strcmp(argv[1], "-k") == 0) {  // compact mode to drop superseded versions of members
+        if (compact_archive(archive_name) != 0) {
+            printf("Error: compact_archive failed in main");
+            file_list_clear(&files);
+            return 1;
+        }
+    } else if (strcmp(argv[1], "-d") == 0) {  // verify mode to check headers and contents without extracting
+        file_list_t verified;
+        file_list_init(&verified);
+        if (verify_archive(archive_name, &verified) != 0) {
+            printf("Error: verify_archive failed in main");
+            file_list_clear(&verified);
+            file_list_clear(&files);
+            return 1;
+        }
+        printf("All headers verified, contents of %d members verified against their CRC32C\n", verified.size);
+        file_list_clear(&verified);
     }
     file_list_clear(&files);
     return 0;
@@ -0,0 +1,69 @@
+#include <time.h>
+
+#include "run_stats.h"
+
+int stats_enabled = 0;
+
+// Totals of one phase, updated with relaxed atomic adds since any thread may contribute
+typedef struct {
+    uint64_t nanoseconds;
+    uint64_t bytes;
+    uint64_t calls;
+} phase_totals_t;
+
+static const char *phase_names[STATS_NUM_PHASES] = {"metadata", "header", "copy", "sync", "seek"};
+static phase_totals_t totals[STATS_NUM_PHASES];
+static uint64_t files;
+static uint64_t run_start;  // when stats_enable was called
+
+uint64_t stats_clock(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+void stats_enable(void) {
+    run_start = stats_clock();
+    stats_enabled = 1;
+}
+
+void stats_record(stats_phase_t phase, uint64_t start, uint64_t bytes, uint64_t calls) {
+    phase_totals_t *total = &totals[phase];
+    __atomic_fetch_add(&total->nanoseconds, stats_clock() - start, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&total->bytes, bytes, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&total->calls, calls, __ATOMIC_RELAXED);
+}
+
+void stats_record_files(uint64_t count) {
+    __atomic_fetch_add(&files, count, __ATOMIC_RELAXED);
+}
+
+/*
+ * Returns 'amount' per second over 'nanoseconds', 0 if no time was measured
+ */
+static double per_second(double amount, uint64_t nanoseconds) {
+    return nanoseconds == 0 ? 0 : amount * 1e9 / nanoseconds;
+}
+
+void stats_report(FILE *out, const char *operation, int json) {
+    uint64_t wall = stats_clock() - run_start;
+    if (json) {
+        fprintf(out, "{\"operation\": \"%s\", \"seconds\": %.6f, \"files\": %llu, \"files_per_second\": %.1f, \"phases\": {",
+                operation, wall / 1e9, (unsigned long long)files, per_second(files, wall));
+        for (int i = 0; i < STATS_NUM_PHASES; i++) {
+            const phase_totals_t *total = &totals[i];
+            fprintf(out, "%s\"%s\": {\"seconds\": %.6f, \"bytes\": %llu, \"syscalls\": %llu, \"mb_per_second\": %.1f}",
+                    i == 0 ? "" : ", ", phase_names[i], total->nanoseconds / 1e9, (unsigned long long)total->bytes,
+                    (unsigned long long)total->calls, per_second(total->bytes / 1e6, total->nanoseconds));
+        }
+        fprintf(out, "}}\n");
+        return;
+    }
+    fprintf(out, "%s: %llu files in %.3f s (%.1f files/s)\n", operation, (unsigned long long)files, wall / 1e9, per_second(files, wall));
+    fprintf(out, "%-10s %12s %16s %10s %10s\n", "phase", "seconds", "bytes", "syscalls", "MB/s");
+    for (int i = 0; i < STATS_NUM_PHASES; i++) {
+        const phase_totals_t *total = &totals[i];
+        fprintf(out, "%-10s %12.6f %16llu %10llu %10.1f\n", phase_names[i], total->nanoseconds / 1e9, (unsigned long long)total->bytes,
+                (unsigned long long)total->calls, per_second(total->bytes / 1e6, total->nanoseconds));
+    }
+}
@@ -0,0 +1,58 @@
+#ifndef _RUN_STATS_H
+#define _RUN_STATS_H
+#include <stdint.h>
+#include <stdio.h>
+
+// Phases of an archive operation that time, bytes and system calls are charged to
+typedef enum {
+    STATS_METADATA,  // walking directories, stat'ing files and looking up owner and group names
+    STATS_HEADER,  // building, writing, reading and parsing member headers
+    STATS_COPY,  // moving member contents between files and the archive
+    STATS_SYNC,  // flushing files and directories to disk
+    STATS_SEEK,  // seeking in and mapping the archive
+    STATS_NUM_PHASES
+} stats_phase_t;
+
+// Nonzero once stats_enable was called; read on every stats_start, so it is a plain int
+extern int stats_enabled;
+
+// Start collecting stats for the rest of the run, and its wall-clock time from now
+void stats_enable(void);
+
+// Current time in nanoseconds on the monotonic clock
+uint64_t stats_clock(void);
+
+// Add one measurement to 'phase', see stats_add
+void stats_record(stats_phase_t phase, uint64_t start, uint64_t bytes, uint64_t calls);
+
+// Get the start time of a measurement for stats_add
+// With stats off this is a single test of 'stats_enabled', the clock isn't read.
+static inline uint64_t stats_start(void) {
+    return stats_enabled ? stats_clock() : 0;
+}
+
+// Charge the time since 'start' (from stats_start), 'bytes' bytes and 'calls' system calls to 'phase'
+// Safe to call from any thread; does nothing with stats off.
+static inline void stats_add(stats_phase_t phase, uint64_t start, uint64_t bytes, uint64_t calls) {
+    if (stats_enabled) {
+        stats_record(phase, start, bytes, calls);
+    }
+}
+
+// Add 'count' to the members written, extracted, listed or verified, see stats_add_files
+void stats_record_files(uint64_t count);
+
+// Count 'count' more members written, extracted, listed or verified; does nothing with stats off
+static inline void stats_add_files(uint64_t count) {
+    if (stats_enabled) {
+        stats_record_files(count);
+    }
+}
+
+// Print what was collected for the operation named 'operation' to 'out', as a table or
+// (with 'json') as one JSON object
+// Phase times are summed over all threads, so with several threads they can add up to
+// more than the wall-clock time.
+void stats_report(FILE *out, const char *operation, int json);
+
+#endif
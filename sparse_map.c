@@ -0,0 +1,177 @@
+#define _GNU_SOURCE  // for SEEK_DATA and SEEK_HOLE
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "sparse_map.h"
+
+// Longest decimal form of an off_t, plus its newline
+#define MAX_NUMBER_LEN 21
+// Most digits accepted when decoding, few enough that the value can't overflow an off_t
+#define MAX_DECODE_DIGITS 18
+
+void sparse_map_init(sparse_map_t *map) {
+    map->segments = NULL;
+    map->count = 0;
+    map->capacity = 0;
+}
+
+void sparse_map_clear(sparse_map_t *map) {
+    free(map->segments);
+    sparse_map_init(map);
+}
+
+/*
+ * Add a run to the end of 'map'
+ * Returns 0 on success or -1 if memory could not be allocated
+ */
+static int sparse_map_add(sparse_map_t *map, off_t offset, off_t size) {
+    if (map->count == map->capacity) {  // grow the array geometrically
+        int capacity = map->capacity == 0 ? 16 : map->capacity * 2;
+        sparse_segment_t *grown = realloc(map->segments, capacity * sizeof(sparse_segment_t));
+        if (grown == NULL) {
+            return -1;
+        }
+        map->segments = grown;
+        map->capacity = capacity;
+    }
+    map->segments[map->count].offset = offset;
+    map->segments[map->count].size = size;
+    map->count++;
+    return 0;
+}
+
+/*
+ * Finds the data runs of the file open as 'fd', see sparse_map_detect
+ */
+static int detect_runs(int fd, off_t size, sparse_map_t *map) {
+    off_t data = 0;
+    while (data < size) {
+        data = lseek(fd, data, SEEK_DATA);
+        if (data == -1) {
+            if (errno == ENXIO) {  // only a hole from here to the end of the file
+                break;
+            }
+            if (errno == EINVAL) {  // no SEEK_DATA support, treat the file as all data
+                sparse_map_clear(map);
+                return 0;
+            }
+            return -1;
+        }
+        if (data >= size) {  // the file grew since its size was taken
+            break;
+        }
+        off_t hole = lseek(fd, data, SEEK_HOLE);
+        if (hole == -1) {
+            return -1;
+        }
+        if (hole > size) {
+            hole = size;
+        }
+        if (sparse_map_add(map, data, hole - data) != 0) {
+            return -1;
+        }
+        data = hole;
+    }
+    if (map->count == 1 && map->segments[0].offset == 0 && map->segments[0].size == size) {
+        sparse_map_clear(map);  // one run covering everything, nothing to gain
+        return 0;
+    }
+    const sparse_segment_t *last = map->count > 0 ? &map->segments[map->count - 1] : NULL;
+    if (last == NULL || last->offset + last->size < size) {  // mark where the trailing hole ends
+        if (sparse_map_add(map, size, 0) != 0) {
+            return -1;
+        }
+    }
+    return 1;
+}
+
+int sparse_map_detect(int fd, off_t size, sparse_map_t *map) {
+    int result = detect_runs(fd, size, map);
+    if (lseek(fd, 0, SEEK_SET) == -1) {
+        result = -1;
+    }
+    if (result != 1) {
+        sparse_map_clear(map);
+    }
+    return result;
+}
+
+off_t sparse_map_data_size(const sparse_map_t *map) {
+    off_t total = 0;
+    for (int i = 0; i < map->count; i++) {
+        total += map->segments[i].size;
+    }
+    return total;
+}
+
+char *sparse_map_encode(const sparse_map_t *map, size_t *len) {
+    size_t capacity = MAX_NUMBER_LEN * (2 * (size_t)map->count + 1);
+    char *text = malloc(capacity);
+    if (text == NULL) {
+        return NULL;
+    }
+    size_t used = snprintf(text, capacity, "%d\n", map->count);
+    for (int i = 0; i < map->count; i++) {
+        used += snprintf(text + used, capacity - used, "%lld\n%lld\n",
+                         (long long)map->segments[i].offset, (long long)map->segments[i].size);
+    }
+    *len = used;
+    return text;
+}
+
+/*
+ * Reads one newline-terminated decimal number from 'data' at '*pos', advancing '*pos' past it
+ * Returns 1 on success, 0 if 'data' ends first, or -1 if the text isn't a number
+ */
+static int decode_number(const char *data, size_t len, size_t *pos, off_t *value) {
+    off_t result = 0;
+    size_t i = *pos;
+    for (; i < len && data[i] != '\n'; i++) {
+        if (data[i] < '0' || data[i] > '9' || i - *pos >= MAX_DECODE_DIGITS) {
+            return -1;
+        }
+        result = result * 10 + (data[i] - '0');
+    }
+    if (i == len) {
+        return 0;
+    }
+    if (i == *pos) {  // an empty line
+        return -1;
+    }
+    *pos = i + 1;
+    *value = result;
+    return 1;
+}
+
+int sparse_map_decode(const char *data, size_t len, sparse_map_t *map, size_t *used) {
+    size_t pos = 0;
+    off_t count;
+    off_t end = 0;  // end of the previous run, runs may not overlap or go backwards
+    sparse_map_clear(map);
+    int status = decode_number(data, len, &pos, &count);
+    for (off_t i = 0; status == 1 && i < count; i++) {
+        off_t offset;
+        off_t size;
+        status = decode_number(data, len, &pos, &offset);
+        if (status == 1) {
+            status = decode_number(data, len, &pos, &size);
+        }
+        if (status == 1 && (offset < end || size > INT64_MAX - offset)) {
+            status = -1;
+        }
+        if (status == 1 && sparse_map_add(map, offset, size) != 0) {
+            status = -1;
+        }
+        end = offset + size;
+    }
+    if (status != 1) {
+        sparse_map_clear(map);
+        return status;
+    }
+    *used = pos;
+    return 1;
+}
@@ -0,0 +1,45 @@
+#ifndef _SPARSE_MAP_H
+#define _SPARSE_MAP_H
+#include <stddef.h>
+#include <sys/types.h>
+
+// One run of data in a sparse file; everything between runs reads as zeros
+typedef struct {
+    off_t offset;  // where the run starts in the file
+    off_t size;  // number of bytes in the run
+} sparse_segment_t;
+
+// The data runs of a sparse file, in increasing offset order
+// Follows GNU tar: a file that ends in a hole gets a final run of size 0 at its end.
+typedef struct {
+    sparse_segment_t *segments;
+    int count;
+    int capacity;
+} sparse_map_t;
+
+// Initialize a new, empty map
+void sparse_map_init(sparse_map_t *map);
+
+// Free all memory associated with a map
+void sparse_map_clear(sparse_map_t *map);
+
+// Find the data runs of the first 'size' bytes of the file open as 'fd' with SEEK_DATA/SEEK_HOLE
+// Leaves the file offset of 'fd' at the start of the file.
+// Returns 1 if the file has holes and 'map' now describes its data, 0 if it has none (or the
+// file system can't tell), or -1 if an error occurs
+int sparse_map_detect(int fd, off_t size, sparse_map_t *map);
+
+// Total number of data bytes described by 'map'
+off_t sparse_map_data_size(const sparse_map_t *map);
+
+// Encode 'map' in the text form of the GNU sparse format 1.0: the number of runs and then
+// the offset and size of each run, all in decimal and each followed by a newline
+// Returns a malloc'ed, unterminated buffer with its length in '*len', or NULL if out of memory
+char *sparse_map_encode(const sparse_map_t *map, size_t *len);
+
+// Decode the text form of a map from the first 'len' bytes of 'data' into 'map'
+// Returns 1 with the number of text bytes used in '*used' if the whole map was decoded,
+// 0 if 'data' ends before the map does, or -1 if the map is malformed or out of memory
+int sparse_map_decode(const char *data, size_t len, sparse_map_t *map, size_t *used);
+
+#endif
@@ -0,0 +1,436 @@
+#define _GNU_SOURCE  // for syscall
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "tree_walk.h"
+
+// Upper limit on walker threads
+#define MAX_WALK_THREADS 16
+// Directories the threads may list ahead of the caller before waiting for it to catch up
+#define MAX_LISTED_AHEAD 256
+// Buffer for one getdents64 call
+#define DIRENT_BUFFER_SIZE (64 * 1024)
+
+// Layout of the records returned by getdents64, which glibc doesn't declare
+struct linux_dirent64 {
+    ino64_t d_ino;
+    off64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+// Listing progress of a directory
+typedef enum {
+    DIR_PENDING,  // not listed yet, whoever needs it first lists it
+    DIR_LISTING,  // being listed by a thread
+    DIR_LISTED,  // 'children' (or 'err') is final
+} dir_state_t;
+
+struct walk_dir;
+
+// One entry of a listed directory
+typedef struct {
+    char *name;
+    struct stat stat_buf;
+    struct walk_dir *dir;  // listing of the entry, for subdirectories; NULL otherwise
+} walk_child_t;
+
+// A directory found during the walk
+typedef struct walk_dir {
+    char *path;  // path of the directory, the prefix of its entries' paths
+    dir_state_t state;
+    int err;  // errno of a failed listing, 0 on success
+    walk_child_t *children;  // entries sorted by name
+    int count;
+    int next;  // index of the next entry to hand to the caller
+    int by_thread;  // nonzero if a walker thread (not the caller) listed it
+    int queued;  // nonzero while the directory is in the work queue
+    int retired;  // set once the directory is no longer needed, for the queue to free it
+    struct walk_dir *next_queued;  // next directory in the work queue
+} walk_dir_t;
+
+struct tree_walk {
+    const node_t *next_root;  // next command-line name to walk
+    int recursive;  // nonzero to walk below directory roots
+    walk_dir_t **stack;  // directories being walked, innermost last
+    int depth;
+    int stack_capacity;
+    int max_threads;  // 0 if directories are only listed by the caller
+    int num_threads;  // threads started so far
+    int stop;  // set to make the threads quit
+    int listed_ahead;  // directories listed by threads and not yet finished by the caller
+    walk_dir_t *queue_head;  // directories for the threads to list, in the order found
+    walk_dir_t *queue_tail;
+    pthread_t threads[MAX_WALK_THREADS];
+    pthread_mutex_t lock;  // protects the queue, the counters and every directory's state
+    pthread_cond_t changed;  // signalled whenever a listing finishes, work arrives or the caller moves on
+};
+
+static walk_dir_t *new_dir(char *path) {
+    walk_dir_t *dir = calloc(1, sizeof(walk_dir_t));
+    if (dir == NULL) {
+        free(path);
+        return NULL;
+    }
+    dir->path = path;
+    dir->state = DIR_PENDING;
+    return dir;
+}
+
+/*
+ * Returns a malloc'ed "DIR/NAME", or NULL if out of memory
+ */
+static char *join_path(const char *dir, const char *name) {
+    size_t dir_len = strlen(dir);
+    size_t name_len = strlen(name);
+    int slash = dir_len > 0 && dir[dir_len - 1] != '/';  // "/" already ends in one
+    char *path = malloc(dir_len + slash + name_len + 1);
+    if (path == NULL) {
+        return NULL;
+    }
+    memcpy(path, dir, dir_len);
+    if (slash) {
+        path[dir_len] = '/';
+    }
+    memcpy(path + dir_len + slash, name, name_len + 1);
+    return path;
+}
+
+static int compare_children(const void *a, const void *b) {
+    return strcmp(((const walk_child_t *)a)->name, ((const walk_child_t *)b)->name);
+}
+
+/*
+ * Frees the listing of 'dir' and then 'dir' itself, unless the work queue still holds it
+ * Subdirectories the caller never reached are retired along with it. Called with the lock held.
+ */
+static void retire_dir(tree_walk_t *walk, walk_dir_t *dir) {
+    for (int i = 0; i < dir->count; i++) {
+        if (i >= dir->next && dir->children[i].dir != NULL) {
+            retire_dir(walk, dir->children[i].dir);
+        }
+        free(dir->children[i].name);
+    }
+    free(dir->children);
+    dir->children = NULL;
+    dir->count = 0;
+    if (dir->by_thread) {  // let the threads list another one in its place
+        dir->by_thread = 0;
+        walk->listed_ahead--;
+        pthread_cond_broadcast(&walk->changed);
+    }
+    if (dir->queued) {
+        dir->retired = 1;
+    } else {
+        free(dir->path);
+        free(dir);
+    }
+}
+
+/*
+ * Reads the entries of 'dir' with getdents64 and stats each one relative to the open directory
+ * Subdirectories get a walk_dir_t of their own, which is queued for the threads when there are any.
+ * Sets 'dir->children' or 'dir->err'; called without the lock held.
+ */
+static void list_directory(tree_walk_t *walk, walk_dir_t *dir) {
+    int fd = openat(AT_FDCWD, dir->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    char *buffer = malloc(DIRENT_BUFFER_SIZE);
+    int capacity = 0;
+    int err = 0;
+    if (fd == -1 || buffer == NULL) {
+        err = fd == -1 ? errno : ENOMEM;
+    }
+    while (err == 0) {
+        long nread = syscall(SYS_getdents64, fd, buffer, DIRENT_BUFFER_SIZE);
+        if (nread <= 0) {
+            if (nread == -1) {
+                err = errno;
+            }
+            break;
+        }
+        for (long pos = 0; pos < nread && err == 0;) {
+            struct linux_dirent64 *entry = (struct linux_dirent64 *)(buffer + pos);
+            pos += entry->d_reclen;
+            const char *name = entry->d_name;
+            if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+                continue;
+            }
+            if (dir->count == capacity) {  // grow the array geometrically
+                int grown_capacity = capacity == 0 ? 32 : capacity * 2;
+                walk_child_t *grown = realloc(dir->children, grown_capacity * sizeof(walk_child_t));
+                if (grown == NULL) {
+                    err = ENOMEM;
+                    break;
+                }
+                dir->children = grown;
+                capacity = grown_capacity;
+            }
+            walk_child_t *child = &dir->children[dir->count];
+            if (fstatat(fd, name, &child->stat_buf, AT_SYMLINK_NOFOLLOW) != 0) {
+                if (errno != ENOENT) {  // an entry deleted since it was listed is simply left out
+                    err = errno;
+                }
+                continue;
+            }
+            child->name = strdup(name);
+            child->dir = NULL;
+            if (child->name == NULL) {
+                err = ENOMEM;
+                break;
+            }
+            dir->count++;
+        }
+    }
+    free(buffer);
+    if (fd != -1) {
+        close(fd);
+    }
+    if (err == 0) {
+        qsort(dir->children, dir->count, sizeof(walk_child_t), compare_children);
+        for (int i = 0; i < dir->count && err == 0; i++) {
+            walk_child_t *child = &dir->children[i];
+            if (S_ISDIR(child->stat_buf.st_mode)) {
+                char *path = join_path(dir->path, child->name);
+                child->dir = path == NULL ? NULL : new_dir(path);
+                if (child->dir == NULL) {
+                    err = ENOMEM;
+                }
+            }
+        }
+    }
+    pthread_mutex_lock(&walk->lock);
+    if (err != 0) {  // drop the partial listing, 'dir' itself stays on the caller's stack
+        dir->err = err;
+        for (int i = 0; i < dir->count; i++) {
+            if (dir->children[i].dir != NULL) {
+                retire_dir(walk, dir->children[i].dir);
+            }
+            free(dir->children[i].name);
+        }
+        free(dir->children);
+        dir->children = NULL;
+        dir->count = 0;
+    } else if (walk->max_threads > 0) {
+        for (int i = 0; i < dir->count; i++) {  // hand the subdirectories to the threads, in order
+            walk_dir_t *sub = dir->children[i].dir;
+            if (sub == NULL) {
+                continue;
+            }
+            sub->queued = 1;
+            if (walk->queue_tail == NULL) {
+                walk->queue_head = sub;
+            } else {
+                walk->queue_tail->next_queued = sub;
+            }
+            walk->queue_tail = sub;
+        }
+    }
+    dir->state = DIR_LISTED;
+    pthread_cond_broadcast(&walk->changed);
+    pthread_mutex_unlock(&walk->lock);
+}
+
+static void *walk_worker(void *arg) {
+    tree_walk_t *walk = arg;
+    pthread_mutex_lock(&walk->lock);
+    while (1) {
+        while (!walk->stop && (walk->queue_head == NULL || walk->listed_ahead >= MAX_LISTED_AHEAD)) {
+            pthread_cond_wait(&walk->changed, &walk->lock);
+        }
+        if (walk->stop) {
+            break;
+        }
+        walk_dir_t *dir = walk->queue_head;
+        walk->queue_head = dir->next_queued;
+        if (walk->queue_head == NULL) {
+            walk->queue_tail = NULL;
+        }
+        dir->queued = 0;
+        if (dir->retired) {
+            free(dir->path);
+            free(dir);
+            continue;
+        }
+        if (dir->state != DIR_PENDING) {  // the caller got to it first
+            continue;
+        }
+        dir->state = DIR_LISTING;
+        dir->by_thread = 1;
+        walk->listed_ahead++;
+        pthread_mutex_unlock(&walk->lock);
+        list_directory(walk, dir);
+        pthread_mutex_lock(&walk->lock);
+    }
+    pthread_mutex_unlock(&walk->lock);
+    return NULL;
+}
+
+tree_walk_t *tree_walk_start(const file_list_t *roots, int recursive, int num_threads) {
+    tree_walk_t *walk = calloc(1, sizeof(tree_walk_t));
+    if (walk == NULL) {
+        return NULL;
+    }
+    walk->next_root = roots->head;
+    walk->recursive = recursive;
+    walk->max_threads = num_threads < MAX_WALK_THREADS ? num_threads : MAX_WALK_THREADS;
+    pthread_mutex_init(&walk->lock, NULL);
+    pthread_cond_init(&walk->changed, NULL);
+    return walk;
+}
+
+/*
+ * Waits until 'dir' is listed, listing it on this thread if nobody has started yet
+ * The threads are started the first time a listing finds subdirectories to work on.
+ */
+static void ensure_listed(tree_walk_t *walk, walk_dir_t *dir) {
+    pthread_mutex_lock(&walk->lock);
+    if (dir->state == DIR_PENDING) {
+        dir->state = DIR_LISTING;
+        pthread_mutex_unlock(&walk->lock);
+        list_directory(walk, dir);
+        pthread_mutex_lock(&walk->lock);
+    }
+    while (dir->state != DIR_LISTED) {
+        pthread_cond_wait(&walk->changed, &walk->lock);
+    }
+    int start_threads = walk->num_threads < walk->max_threads && walk->queue_head != NULL;
+    pthread_mutex_unlock(&walk->lock);
+    for (; start_threads && walk->num_threads < walk->max_threads; walk->num_threads++) {
+        if (pthread_create(&walk->threads[walk->num_threads], NULL, walk_worker, walk) != 0) {
+            break;  // the caller lists whatever the threads don't
+        }
+    }
+}
+
+/*
+ * Pushes 'dir' onto the walk's stack
+ * Returns 0 on success or -1 if memory could not be allocated
+ */
+static int push_dir(tree_walk_t *walk, walk_dir_t *dir) {
+    if (walk->depth == walk->stack_capacity) {
+        int capacity = walk->stack_capacity == 0 ? 16 : walk->stack_capacity * 2;
+        walk_dir_t **grown = realloc(walk->stack, capacity * sizeof(walk_dir_t *));
+        if (grown == NULL) {
+            return -1;
+        }
+        walk->stack = grown;
+        walk->stack_capacity = capacity;
+    }
+    walk->stack[walk->depth++] = dir;
+    return 0;
+}
+
+/*
+ * Removes the innermost directory from the stack once all its entries were handed out
+ */
+static void pop_dir(tree_walk_t *walk) {
+    walk_dir_t *dir = walk->stack[--walk->depth];
+    pthread_mutex_lock(&walk->lock);
+    retire_dir(walk, dir);
+    pthread_mutex_unlock(&walk->lock);
+}
+
+/*
+ * Starts the walk of the next root, returning it as the next entry (see tree_walk_next)
+ */
+static int next_root(tree_walk_t *walk, char **path, struct stat *stat_buf) {
+    const char *name = walk->next_root->name;
+    walk->next_root = walk->next_root->next;
+    size_t len = strlen(name);
+    while (len > 1 && name[len - 1] == '/') {  // "dir/" is archived as "dir"
+        len--;
+    }
+    *path = strndup(name, len);
+    if (*path == NULL) {
+        return -1;
+    }
+    if (stat(*path, stat_buf) != 0) {
+        return -1;
+    }
+    if (walk->recursive && S_ISDIR(stat_buf->st_mode)) {
+        char *dir_path = strdup(*path);
+        walk_dir_t *dir = dir_path == NULL ? NULL : new_dir(dir_path);
+        if (dir == NULL || push_dir(walk, dir) != 0) {
+            free(dir == NULL ? NULL : dir->path);
+            free(dir);
+            errno = ENOMEM;
+            return -1;
+        }
+    }
+    return 1;
+}
+
+int tree_walk_next(tree_walk_t *walk, char **path, struct stat *stat_buf) {
+    *path = NULL;
+    while (1) {
+        if (walk->depth == 0) {
+            return walk->next_root == NULL ? 0 : next_root(walk, path, stat_buf);
+        }
+        walk_dir_t *dir = walk->stack[walk->depth - 1];
+        ensure_listed(walk, dir);
+        if (dir->err != 0) {
+            *path = strdup(dir->path);
+            errno = dir->err;
+            return -1;
+        }
+        if (dir->next == dir->count) {
+            pop_dir(walk);
+            continue;
+        }
+        walk_child_t *child = &dir->children[dir->next++];
+        *path = join_path(dir->path, child->name);
+        if (*path == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+        if (!S_ISREG(child->stat_buf.st_mode) && !S_ISDIR(child->stat_buf.st_mode)) {
+            fprintf(stderr, "Skipping %s: not a regular file or directory\n", *path);
+            free(*path);
+            *path = NULL;
+            continue;
+        }
+        *stat_buf = child->stat_buf;
+        if (child->dir != NULL && push_dir(walk, child->dir) != 0) {
+            dir->next--;  // still owned by 'dir', so freed with it
+            free(*path);
+            *path = NULL;
+            errno = ENOMEM;
+            return -1;
+        }
+        return 1;
+    }
+}
+
+void tree_walk_stop(tree_walk_t *walk) {
+    pthread_mutex_lock(&walk->lock);
+    walk->stop = 1;
+    pthread_cond_broadcast(&walk->changed);
+    pthread_mutex_unlock(&walk->lock);
+    for (int i = 0; i < walk->num_threads; i++) {
+        pthread_join(walk->threads[i], NULL);
+    }
+    // Only this thread is left, but retire_dir expects the lock
+    pthread_mutex_lock(&walk->lock);
+    while (walk->depth > 0) {
+        retire_dir(walk, walk->stack[--walk->depth]);
+    }
+    while (walk->queue_head != NULL) {  // everything still queued was retired above
+        walk_dir_t *dir = walk->queue_head;
+        walk->queue_head = dir->next_queued;
+        free(dir->path);
+        free(dir);
+    }
+    pthread_mutex_unlock(&walk->lock);
+    pthread_mutex_destroy(&walk->lock);
+    pthread_cond_destroy(&walk->changed);
+    free(walk->stack);
+    free(walk);
+}
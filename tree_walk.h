@@ -0,0 +1,29 @@
+#ifndef _TREE_WALK_H
+#define _TREE_WALK_H
+#include <sys/stat.h>
+
+#include "file_list.h"
+
+typedef struct tree_walk tree_walk_t;
+
+// Start walking the names in 'roots', in order
+// With 'recursive' set, a root that is a directory is followed by everything below it, in
+// depth-first order with the entries of each directory sorted by name, so the order never
+// depends on timing; otherwise only the roots themselves are returned.
+// Up to 'num_threads' threads list and stat directories ahead of the caller once the first
+// subdirectory turns up; with 0, directories are listed on the caller's thread when reached.
+// Returns the walk, or NULL if memory could not be allocated
+tree_walk_t *tree_walk_start(const file_list_t *roots, int recursive, int num_threads);
+
+// Get the next file or directory of the walk
+// '*path' is set to a malloc'ed path for the caller to free, and '*stat_buf' to its metadata
+// (from stat for roots, from fstatat without following symbolic links below them).
+// Entries below a root that are neither regular files nor directories are skipped with a warning.
+// Returns 1 if an entry was found, 0 once the walk is over, or -1 with errno set if a root
+// can't be inspected or a directory can't be read; '*path' is then the offending path.
+int tree_walk_next(tree_walk_t *walk, char **path, struct stat *stat_buf);
+
+// Stop the walk's threads and free everything it holds
+void tree_walk_stop(tree_walk_t *walk);
+
+#endif
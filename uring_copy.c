@@ -0,0 +1,470 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "uring_copy.h"
+
+// Number of chunks kept in flight at once, also the number of registered buffers
+#define URING_QUEUE_DEPTH 64
+// Largest piece of a file moved by one read or write
+#define URING_CHUNK_SIZE (256 * 1024)
+
+// There is no liburing here, so the ring is driven with raw system calls
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *params) {
+    return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int sys_io_uring_enter(int ring_fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int ring_fd, unsigned opcode, void *arg, unsigned nr_args) {
+    return syscall(__NR_io_uring_register, ring_fd, opcode, arg, nr_args);
+}
+
+// A submission and completion queue pair shared with the kernel
+typedef struct {
+    int fd;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;  // same as 'sq_ring' when the kernel maps both queues together
+    size_t cq_ring_size;
+    size_t sqes_size;
+    unsigned pending;  // entries queued but not yet passed to io_uring_enter
+} ring_t;
+
+/*
+ * Creates a ring with room for 'entries' submissions and maps its queues
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int ring_init(ring_t *ring, unsigned entries) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = sys_io_uring_setup(entries, &params);
+    if (ring->fd == -1) {
+        return -1;
+    }
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    int single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap && ring->cq_ring_size > ring->sq_ring_size) {
+        ring->sq_ring_size = ring->cq_ring_size;
+    }
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED) {
+        close(ring->fd);
+        return -1;
+    }
+    if (single_mmap) {
+        ring->cq_ring = ring->sq_ring;
+    } else {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED) {
+            munmap(ring->sq_ring, ring->sq_ring_size);
+            close(ring->fd);
+            return -1;
+        }
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        if (!single_mmap) {
+            munmap(ring->cq_ring, ring->cq_ring_size);
+        }
+        munmap(ring->sq_ring, ring->sq_ring_size);
+        close(ring->fd);
+        return -1;
+    }
+    char *sq = ring->sq_ring;
+    char *cq = ring->cq_ring;
+    ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sq_mask = *(unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sq_entries = params.sq_entries;
+    ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+    ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cq_mask = *(unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    return 0;
+}
+
+static void ring_free(ring_t *ring) {
+    munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ring != ring->sq_ring) {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->fd);
+}
+
+/*
+ * Claims the next free submission queue entry, cleared and ready to fill in
+ * Returns NULL if the submission queue is full
+ */
+static struct io_uring_sqe *ring_get_sqe(ring_t *ring) {
+    unsigned tail = *ring->sq_tail;  // only this process moves the tail
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (tail - head == ring->sq_entries) {
+        return NULL;
+    }
+    unsigned index = tail & ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[index] = index;
+    return sqe;
+}
+
+// Publishes the entry returned by the last ring_get_sqe to the kernel
+static void ring_push(ring_t *ring) {
+    __atomic_store_n(ring->sq_tail, *ring->sq_tail + 1, __ATOMIC_RELEASE);
+    ring->pending++;
+}
+
+/*
+ * Submits everything queued and waits until at least 'wait_for' completions are available
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int ring_submit(ring_t *ring, unsigned wait_for) {
+    while (1) {
+        int submitted = sys_io_uring_enter(ring->fd, ring->pending, wait_for, wait_for > 0 ? IORING_ENTER_GETEVENTS : 0);
+        if (submitted == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        ring->pending -= submitted;
+        return 0;
+    }
+}
+
+// What a buffer slot is currently doing
+enum {
+    SLOT_FREE,
+    SLOT_READING,  // reading a chunk of a source file into the slot's buffer
+    SLOT_WRITING,  // writing the chunk to the destination
+};
+
+// One chunk of a copy moving through the ring
+typedef struct {
+    int state;
+    int copy;  // index of the copy this chunk belongs to
+    off_t offset;  // offset of the chunk within its copy
+    size_t length;  // length of the chunk
+    size_t done;  // bytes of the current read or write already completed
+    char *buffer;  // registered buffer, holds the chunk for file sources
+} slot_t;
+
+// Progress of one copy
+typedef struct {
+    int src_fd;  // -1 when copying from memory
+    int dst_fd;
+    off_t issued;  // bytes handed to slots so far
+    off_t completed;  // bytes written to the destination so far
+} copy_state_t;
+
+// Everything uring_copy_run keeps track of
+typedef struct {
+    ring_t ring;
+    const uring_copy_t *copies;
+    copy_state_t *states;
+    slot_t slots[URING_QUEUE_DEPTH];
+    int fixed;  // nonzero if the slot buffers are registered with the ring
+    int next_copy;  // first copy that still has bytes to issue
+    int oldest_open;  // first copy that may still have files open
+    int in_flight;  // slots not free
+    int failed;  // index of the failed copy, or -1
+    int err;  // errno of the failure
+} copier_t;
+
+int uring_available(void) {
+    static int available = -1;  // probed once per run
+    if (available == -1) {
+        ring_t ring;
+        available = ring_init(&ring, 1) == 0;
+        if (available) {
+            ring_free(&ring);
+        }
+    }
+    return available;
+}
+
+// Records the first failure; later failures are side effects of it
+static void copier_fail(copier_t *copier, int copy, int err) {
+    if (copier->failed == -1) {
+        copier->failed = copy;
+        copier->err = err;
+    }
+}
+
+/*
+ * Closes the files of a copy, reporting a failed close of its destination
+ */
+static void close_copy(copier_t *copier, int copy) {
+    copy_state_t *state = &copier->states[copy];
+    if (copier->copies[copy].src_name != NULL && state->src_fd != -1) {
+        close(state->src_fd);
+        state->src_fd = -1;
+    }
+    if (copier->copies[copy].dst_name != NULL && state->dst_fd != -1) {
+        if (close(state->dst_fd) != 0) {
+            copier_fail(copier, copy, errno);
+        }
+        state->dst_fd = -1;
+    }
+}
+
+/*
+ * Opens the files of copy 'copy' before its first chunk is issued
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int open_copy(copier_t *copier, int copy) {
+    const uring_copy_t *spec = &copier->copies[copy];
+    copy_state_t *state = &copier->states[copy];
+    state->src_fd = spec->src_data == NULL ? spec->src_fd : -1;
+    state->dst_fd = spec->dst_fd;
+    if (spec->src_name != NULL) {
+        state->src_fd = open(spec->src_name, O_RDONLY);
+        if (state->src_fd == -1) {
+            copier_fail(copier, copy, errno);
+            return -1;
+        }
+    }
+    if (spec->dst_name != NULL) {
+        state->dst_fd = open(spec->dst_name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        if (state->dst_fd == -1) {
+            copier_fail(copier, copy, errno);
+            close_copy(copier, copy);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Queues the remaining part of slot 'index''s current read or write
+ * Returns 0 on success or -1 if the submission queue is full
+ */
+static int queue_slot(copier_t *copier, int index) {
+    slot_t *slot = &copier->slots[index];
+    const uring_copy_t *spec = &copier->copies[slot->copy];
+    copy_state_t *state = &copier->states[slot->copy];
+    struct io_uring_sqe *sqe = ring_get_sqe(&copier->ring);
+    if (sqe == NULL) {
+        return -1;
+    }
+    if (slot->state == SLOT_READING) {
+        sqe->opcode = copier->fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+        sqe->fd = state->src_fd;
+        sqe->off = spec->src_offset + slot->offset + slot->done;
+        sqe->addr = (unsigned long)(slot->buffer + slot->done);
+    } else {
+        // From memory the bytes go out directly; from a file they come from the slot's buffer
+        int from_buffer = spec->src_data == NULL;
+        sqe->opcode = from_buffer && copier->fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+        sqe->fd = state->dst_fd;
+        sqe->off = spec->dst_offset + slot->offset + slot->done;
+        sqe->addr = (unsigned long)((from_buffer ? slot->buffer : spec->src_data + slot->offset) + slot->done);
+    }
+    sqe->len = slot->length - slot->done;
+    sqe->buf_index = index;  // ignored by the unregistered opcodes
+    sqe->user_data = index;
+    ring_push(&copier->ring);
+    return 0;
+}
+
+/*
+ * Hands the next chunk of work to free slot 'index'
+ * Returns 1 if a chunk was queued, 0 if there is nothing left to start (or a copy failed)
+ */
+static int start_chunk(copier_t *copier, int index, int count) {
+    while (copier->failed == -1 && copier->next_copy < count) {
+        int copy = copier->next_copy;
+        const uring_copy_t *spec = &copier->copies[copy];
+        copy_state_t *state = &copier->states[copy];
+        if (state->issued == 0 && open_copy(copier, copy) != 0) {
+            return 0;
+        }
+        if (state->issued == spec->size) {  // only empty copies get here, nothing to transfer
+            close_copy(copier, copy);
+            copier->next_copy++;
+            continue;
+        }
+        slot_t *slot = &copier->slots[index];
+        slot->copy = copy;
+        slot->offset = state->issued;
+        slot->length = spec->size - state->issued < URING_CHUNK_SIZE ? spec->size - state->issued : URING_CHUNK_SIZE;
+        slot->done = 0;
+        slot->state = spec->src_data == NULL ? SLOT_READING : SLOT_WRITING;
+        state->issued += slot->length;
+        if (state->issued == spec->size) {
+            copier->next_copy++;
+        }
+        if (queue_slot(copier, index) != 0) {  // can't happen: the queue is as deep as the slot count
+            copier_fail(copier, copy, EAGAIN);
+            slot->state = SLOT_FREE;
+            return 0;
+        }
+        copier->in_flight++;
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Handles the completion of slot 'index''s read or write, with result 'res'
+ */
+static void complete_slot(copier_t *copier, int index, int res) {
+    slot_t *slot = &copier->slots[index];
+    copy_state_t *state = &copier->states[slot->copy];
+    if (res < 0 || (res == 0 && slot->state == SLOT_READING)) {  // a source that ends early is an error too
+        copier_fail(copier, slot->copy, res < 0 ? -res : EIO);
+        slot->state = SLOT_FREE;
+        copier->in_flight--;
+        return;
+    }
+    slot->done += res;
+    if (slot->done < slot->length && copier->failed == -1) {  // short transfer, ask for the rest
+        queue_slot(copier, index);
+        return;
+    }
+    if (slot->state == SLOT_READING && copier->failed == -1) {  // the chunk is in memory, now write it out
+        slot->state = SLOT_WRITING;
+        slot->done = 0;
+        queue_slot(copier, index);
+        return;
+    }
+    if (slot->done == slot->length) {
+        state->completed += slot->length;
+    }
+    slot->state = SLOT_FREE;
+    copier->in_flight--;
+}
+
+/*
+ * Closes the files of every copy that has finished, oldest first
+ */
+static void retire_copies(copier_t *copier) {
+    while (copier->oldest_open < copier->next_copy) {
+        int copy = copier->oldest_open;
+        if (copier->states[copy].completed != copier->copies[copy].size) {
+            break;
+        }
+        close_copy(copier, copy);
+        copier->oldest_open++;
+    }
+}
+
+/*
+ * Allocates one buffer per slot, and registers them so the kernel needn't map them on every I/O
+ * Returns 0 on success or -1 if the buffers can't be allocated
+ */
+static int setup_buffers(copier_t *copier) {
+    struct iovec iovecs[URING_QUEUE_DEPTH];
+    for (int i = 0; i < URING_QUEUE_DEPTH; i++) {
+        if (posix_memalign((void **)&copier->slots[i].buffer, 4096, URING_CHUNK_SIZE) != 0) {
+            return -1;
+        }
+        iovecs[i].iov_base = copier->slots[i].buffer;
+        iovecs[i].iov_len = URING_CHUNK_SIZE;
+    }
+    // Registration can fail on memory limits; plain reads and writes into the same buffers still work
+    copier->fixed = sys_io_uring_register(copier->ring.fd, IORING_REGISTER_BUFFERS, iovecs, URING_QUEUE_DEPTH) == 0;
+    return 0;
+}
+
+int uring_copy_run(const uring_copy_t *copies, int count, int *failed) {
+    copier_t *copier = calloc(1, sizeof(copier_t));
+    if (copier == NULL) {
+        *failed = -1;
+        return -1;
+    }
+    copier->copies = copies;
+    copier->failed = -1;
+    copier->states = malloc((count > 0 ? count : 1) * sizeof(copy_state_t));
+    if (copier->states == NULL || ring_init(&copier->ring, URING_QUEUE_DEPTH) != 0) {
+        int err = errno;
+        free(copier->states);
+        free(copier);
+        errno = err;
+        *failed = -1;
+        return -1;
+    }
+    int needs_buffers = 0;
+    for (int i = 0; i < count; i++) {
+        copier->states[i].src_fd = -1;
+        copier->states[i].dst_fd = -1;
+        copier->states[i].issued = 0;
+        copier->states[i].completed = 0;
+        needs_buffers |= copies[i].src_data == NULL;
+    }
+    if (needs_buffers && setup_buffers(copier) != 0) {
+        ring_free(&copier->ring);
+        for (int i = 0; i < URING_QUEUE_DEPTH; i++) {
+            free(copier->slots[i].buffer);
+        }
+        free(copier->states);
+        free(copier);
+        errno = ENOMEM;
+        *failed = -1;
+        return -1;
+    }
+
+    while (1) {
+        for (int i = 0; i < URING_QUEUE_DEPTH; i++) {  // keep every free slot busy
+            if (copier->slots[i].state == SLOT_FREE && !start_chunk(copier, i, count)) {
+                break;
+            }
+        }
+        retire_copies(copier);  // empty copies finish without ever reaching the ring
+        if (copier->in_flight == 0) {
+            break;
+        }
+        if (ring_submit(&copier->ring, 1) != 0) {
+            // The ring itself broke; in-flight operations can't be waited for, so abandon them
+            copier_fail(copier, copier->next_copy < count ? copier->next_copy : count - 1, errno);
+            break;
+        }
+        unsigned head = *copier->ring.cq_head;
+        unsigned tail = __atomic_load_n(copier->ring.cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            struct io_uring_cqe *cqe = &copier->ring.cqes[head & copier->ring.cq_mask];
+            complete_slot(copier, cqe->user_data, cqe->res);
+        }
+        __atomic_store_n(copier->ring.cq_head, head, __ATOMIC_RELEASE);
+        retire_copies(copier);
+    }
+
+    for (int i = copier->oldest_open; i < count && i <= copier->next_copy; i++) {  // after a failure
+        close_copy(copier, i);
+    }
+    ring_free(&copier->ring);
+    for (int i = 0; i < URING_QUEUE_DEPTH; i++) {
+        free(copier->slots[i].buffer);
+    }
+    int result = copier->failed == -1 ? 0 : -1;
+    *failed = copier->failed;
+    errno = copier->err;
+    free(copier->states);
+    free(copier);
+    return result;
+}
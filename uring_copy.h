@@ -0,0 +1,28 @@
+#ifndef _URING_COPY_H
+#define _URING_COPY_H
+#include <sys/types.h>
+
+// One copy for uring_copy_run: 'size' bytes from a file or from memory into a file
+typedef struct {
+    const char *src_name;  // file to read from, opened by uring_copy_run; NULL to read 'src_fd' or copy 'src_data'
+    const char *src_data;  // bytes to copy when not NULL, e.g. part of a mapped archive
+    int src_fd;  // already open file to read from, used when both 'src_name' and 'src_data' are NULL
+    off_t src_offset;  // where in the source file the first byte is read from
+    const char *dst_name;  // file to create (or truncate) and write to; NULL to write to 'dst_fd'
+    int dst_fd;  // already open destination, used when 'dst_name' is NULL
+    off_t dst_offset;  // where in the destination the first byte goes
+    off_t size;  // number of bytes to copy
+} uring_copy_t;
+
+// Returns 1 if the kernel lets this process use io_uring, 0 otherwise
+int uring_available(void);
+
+// Performs all 'count' copies through one io_uring, keeping many reads and writes in flight
+// Copies are started in order; files are read into registered buffers, and a file named in
+// a copy is only open while that copy is in progress. Descriptors given as 'src_fd' or
+// 'dst_fd' are left open.
+// Returns 0 on success, or -1 with errno set and '*failed' set to the index of the copy that
+// failed (-1 if setting up the ring failed)
+int uring_copy_run(const uring_copy_t *copies, int count, int *failed);
+
+#endif